@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "hash.h"
+
+#define HASH_BUCKETS 64
+#define MAX_PATH_DIRS 64
+
+typedef struct hash_entry {
+  char *name;
+  char *path;
+  int dir;                  /* index in PATH of the directory it is in */
+  int hits;
+  struct hash_entry *next;
+} hash_entry;
+
+typedef struct {
+  char *name;
+  struct timespec mtime;    /* when the directory was last looked at */
+  int exists;
+} path_dir;
+
+static hash_entry *buckets[HASH_BUCKETS];
+static path_dir dirs[MAX_PATH_DIRS];
+static int dir_count;
+static char *hashed_path;   /* the PATH the table is for */
+
+static unsigned hash_name(const char *name) {
+  unsigned h = 5381;
+  while (*name) h = h * 33 + (unsigned char)*name++;
+  return h % HASH_BUCKETS;
+}
+
+/* Forgets the commands found in directory FIRST of PATH or a later one. */
+static void forget_from(int first) {
+  for (int i = 0; i < HASH_BUCKETS; i++) {
+    hash_entry **e = &buckets[i];
+    while (*e) {
+      if ((*e)->dir >= first) {
+        hash_entry *gone = *e;
+        *e = gone->next;
+        free(gone->name);
+        free(gone->path);
+        free(gone);
+      } else {
+        e = &(*e)->next;
+      }
+    }
+  }
+}
+
+static void stat_dir(path_dir *d) {
+  struct stat st;
+  d->exists = stat(d->name, &st) == 0;
+  if (d->exists) d->mtime = st.st_mtim;
+}
+
+/* Starts over if PATH is no longer the one the table was made for. */
+static void check_path(void) {
+  const char *path = getenv("PATH");
+  if (!path) path = "";
+  if (hashed_path && strcmp(hashed_path, path) == 0) return;
+
+  forget_from(0);
+  for (int i = 0; i < dir_count; i++) free(dirs[i].name);
+  free(hashed_path);
+  hashed_path = strdup(path);
+
+  /* An empty entry is the current directory */
+  dir_count = 0;
+  const char *start = path;
+  while (dir_count < MAX_PATH_DIRS) {
+    size_t len = strcspn(start, ":");
+    dirs[dir_count].name = len ? strndup(start, len) : strdup(".");
+    stat_dir(&dirs[dir_count]);
+    dir_count++;
+    if (start[len] == '\0') break;
+    start += len + 1;
+  }
+}
+
+/* Looks at directories 0 to LAST of PATH, forgetting what a modified one may have changed. */
+static void check_dirs(int last) {
+  for (int i = 0; i <= last && i < dir_count; i++) {
+    path_dir before = dirs[i];
+    stat_dir(&dirs[i]);
+    if (before.exists != dirs[i].exists || (dirs[i].exists &&
+        (before.mtime.tv_sec != dirs[i].mtime.tv_sec || before.mtime.tv_nsec != dirs[i].mtime.tv_nsec))) {
+      forget_from(i);
+    }
+  }
+}
+
+static hash_entry *find_entry(const char *name) {
+  hash_entry *e;
+  for (e = buckets[hash_name(name)]; e; e = e->next) {
+    if (strcmp(e->name, name) == 0) return e;
+  }
+  return NULL;
+}
+
+/* Returns the index in PATH of the directory NAME was found in, or -1. */
+static int search_dirs(const char *name, char *path, size_t size) {
+  struct stat st;
+  for (int i = 0; i < dir_count; i++) {
+    if (!dirs[i].exists) continue;
+    if (snprintf(path, size, "%s/%s", dirs[i].name, name) >= size) continue;
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0) return i;
+  }
+  return -1;
+}
+
+const char *hash_lookup(const char *name) {
+  check_path();
+  hash_entry *e = find_entry(name);
+  if (!e) return NULL;
+  check_dirs(e->dir);
+  e = find_entry(name);
+  return e ? e->path : NULL;
+}
+
+int hash_search(const char *name, char *path, size_t size) {
+  check_path();
+  return search_dirs(name, path, size) < 0 ? -1 : 0;
+}
+
+/* Copies FROM to PATH. Returns 0, or -1 if it does not fit. */
+static int copy_path(const char *from, char *path, size_t size) {
+  return snprintf(path, size, "%s", from) < size ? 0 : -1;
+}
+
+int hash_find(const char *name, int hit, char *path, size_t size) {
+  if (strchr(name, '/')) return copy_path(name, path, size);
+
+  if (hash_lookup(name)) {
+    hash_entry *e = find_entry(name);
+    if (hit) e->hits++;
+    return copy_path(e->path, path, size);
+  }
+
+  /* Take the directories' times before searching them, so later changes are seen */
+  check_dirs(dir_count - 1);
+  int dir = search_dirs(name, path, size);
+  if (dir < 0) return -1;
+  /* A relative directory means something else after cd, so it is not remembered */
+  if (dirs[dir].name[0] != '/') return 0;
+
+  /* Without memory for an entry the command still runs, it is just not remembered */
+  hash_entry *e = malloc(sizeof(hash_entry));
+  if (!e) return 0;
+  e->name = strdup(name);
+  e->path = strdup(path);
+  if (!e->name || !e->path) {
+    free(e->name);
+    free(e->path);
+    free(e);
+    return 0;
+  }
+  unsigned b = hash_name(name);
+  e->dir = dir;
+  e->hits = hit ? 1 : 0;
+  e->next = buckets[b];
+  buckets[b] = e;
+  return 0;
+}
+
+void hash_forget(void) {
+  forget_from(0);
+}
+
+void hash_print(FILE *out) {
+  int empty = 1;
+  for (int i = 0; i < HASH_BUCKETS; i++) {
+    for (hash_entry *e = buckets[i]; e; e = e->next) {
+      if (empty) fprintf(out, "hits\tcommand\n");
+      empty = 0;
+      fprintf(out, "%4d\t%s\n", e->hits, e->path);
+    }
+  }
+  if (empty) fprintf(out, "hash: hash table empty\n");
+}
@@ -0,0 +1,31 @@
+#ifndef _hash_H_
+#define _hash_H_
+
+#include <stdio.h>
+
+/*
+ * Hashed command lookup, like the hash builtin of sh.
+ *
+ * A command name without a slash is searched for in the directories of
+ * PATH once, and the full path remembered, so running it again costs a
+ * single execv instead of one per directory. The table is emptied when
+ * PATH changes. A remembered path is also forgotten when its directory,
+ * or one before it in PATH, has been modified since it was found, as a
+ * command may have been removed or put earlier in PATH.
+ */
+
+/* Copies the full path to run NAME from into PATH: NAME itself if it has a
+   slash, or the remembered or newly found one (counted as used when HIT).
+   Returns 0, or -1 if it is not in PATH. */
+int hash_find(const char *name, int hit, char *path, size_t size);
+
+/* The remembered path for NAME, without searching PATH. NULL if there is none. */
+const char *hash_lookup(const char *name);
+
+/* Searches PATH for NAME without remembering it. Returns 0, or -1 if not found. */
+int hash_search(const char *name, char *path, size_t size);
+
+void hash_forget(void);
+void hash_print(FILE *out);
+
+#endif
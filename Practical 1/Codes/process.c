@@ -6,6 +6,8 @@
 #include <sys/wait.h>
 #include <termios.h>
 
+process *first_process;
+
 /**
  * Executes the process p.
  * If the shell is in interactive mode and the process is a foreground process,
@@ -24,33 +26,58 @@ void launch_process(process *p)
     }
 }
 
+/* Wake up the stopped processes of a job */
+static void continue_job(pid_t job)
+{
+  process *p;
+  for (p = first_process; p; p = p->next) {
+    if (p->pgid == job && !p->completed) {
+      p->stopped = 0;
+      /* Without a terminal the job has no process group of its own */
+      if (!shell_is_interactive) kill(p->pid, SIGCONT);
+    }
+  }
+  if (shell_is_interactive) kill(-job, SIGCONT);
+}
+
 /* Put a process in the foreground. This function assumes that the shell
  * is in interactive mode. If the cont argument is true, send the process
  * group a SIGCONT signal to wake it up.
  */
-void put_process_in_foreground (process *proc) {
-  int proc_status;
-  pid_t shell_pgid = first_process->pid;
+void put_process_in_foreground (process *p, int cont) {
+  process *q;
+  for (q = first_process; q; q = q->next) {
+    if (q->pgid == p->pgid) q->background = 0;
+  }
 
-  if (tcsetpgrp(STDIN_FILENO, proc->pid) != 0) {
+  if (shell_is_interactive && tcsetpgrp(shell_terminal, p->pgid) != 0) {
       perror("tcsetpgrp error");
-      return;
   }
-
-  if (waitpid(proc->pid, &proc_status, WUNTRACED) < 0) {
-      perror("waitpid error");
-      return;
+  if (cont) {
+      if (shell_is_interactive) tcsetattr(shell_terminal, TCSADRAIN, &p->tmodes);
+      continue_job(p->pgid);
   }
 
-  tcsetpgrp(STDIN_FILENO, shell_pgid);
+  wait_for_job(p->pgid);
+
+  /* Take the terminal back, keeping the job's modes for when it is continued */
+  if (shell_is_interactive) {
+      tcsetpgrp(shell_terminal, shell_pgid);
+      tcgetattr(shell_terminal, &p->tmodes);
+      tcsetattr(shell_terminal, TCSADRAIN, &shell_tmodes);
+  }
 }
 
 /* Put a process in the background. If the cont argument is true, send
  * the process group a SIGCONT signal to wake it up. */
 void put_process_in_background (process *p, int cont)
 {
-  if (cont && p->stopped) {
-      kill(-p->pid, SIGCONT);
+  process *q;
+  for (q = first_process; q; q = q->next) {
+    if (q->pgid == p->pgid) q->background = 1;
+  }
+  if (cont) {
+      continue_job(p->pgid);
   }
 }
 
@@ -60,9 +87,53 @@ int update_individual_process_status(pid_t pid, int new_status)
   for (current_process = first_process; current_process; current_process = current_process->next) {
     if (current_process->pid == pid) {
       current_process->status = new_status;
-      current_process->completed = 1;
+      if (WIFSTOPPED(new_status)) {
+        current_process->stopped = 1;
+      } else {
+        current_process->completed = 1;
+        current_process->stopped = 0;
+      }
       return 0;
     }
   }
   return -1;
 }
+
+int job_is_stopped(pid_t job)
+{
+  process *p;
+  for (p = first_process; p; p = p->next) {
+    if (p->pgid == job && p->stopped) return 1;
+  }
+  return 0;
+}
+
+int job_is_completed(pid_t job)
+{
+  process *p;
+  for (p = first_process; p; p = p->next) {
+    if (p->pgid == job && !p->completed) return 0;
+  }
+  return 1;
+}
+
+/* Wait until every process of a job has finished, or one of them has stopped.
+ * The status of any child that changes meanwhile is recorded as well. */
+void wait_for_job(pid_t job)
+{
+  int status;
+  pid_t pid;
+
+  while (!job_is_completed(job) && !job_is_stopped(job)) {
+    pid = waitpid(-1, &status, WUNTRACED);
+    if (pid < 0 && errno == EINTR) continue;
+    if (pid < 0) {
+      /* Someone else waited for them, so they are gone */
+      for (process *p = first_process; p; p = p->next) {
+        if (p->pgid == job) p->completed = 1;
+      }
+      break;
+    }
+    update_individual_process_status(pid, status);
+  }
+}
@@ -11,6 +11,7 @@ typedef struct process
   char** argv;
   int argc;
   pid_t pid;
+  pid_t pgid; //pid of the first process of its pipeline, the job it belongs to
   char completed;
   char stopped;
   char background;
@@ -21,10 +22,14 @@ typedef struct process
   struct process* prev;
 } process;
 
-process* first_process; //pointer to the first process that is launched */
+extern process* first_process; //pointer to the first process that is launched */
 
 void launch_process(process* p);
 void put_process_in_background (process* p, int cont);
-void put_process_in_foreground (process* p);
+void put_process_in_foreground (process* p, int cont);
+int update_individual_process_status(pid_t pid, int new_status);
+void wait_for_job(pid_t job);
+int job_is_stopped(pid_t job);
+int job_is_completed(pid_t job);
 
 #endif
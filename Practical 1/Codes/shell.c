@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
@@ -9,11 +10,20 @@
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <limits.h> 
+#include <spawn.h>
+#include <signal.h>
 
 #define FALSE 0
 #define TRUE 1
 #define INPUT_STRING_SIZE 80
 
+/* Pipes between the commands of a pipeline are enlarged to this many
+   bytes, where the system allows it, so a fast writer blocks less often */
+#define PIPE_BUFFER_SIZE (256 * 1024)
+
+extern char **environ;
+
+#include "hash.h"
 #include "io.h"
 #include "parse.h"
 #include "process.h"
@@ -32,6 +42,10 @@ int cmd_quit(tok_t arg[]);
 int cmd_pwd(tok_t arg[]);
 int cmd_cd(tok_t arg[]);
 int cmd_wait(tok_t arg[]);
+int cmd_hash(tok_t arg[]);
+int cmd_type(tok_t arg[]);
+int cmd_fg(tok_t arg[]);
+int cmd_bg(tok_t arg[]);
 
 fun_desc_t cmd_table[] = {
 	{cmd_help, "?", "show this help menu"},
@@ -39,10 +53,30 @@ fun_desc_t cmd_table[] = {
 	{cmd_pwd, "pwd", "get directory"},
 	{cmd_cd, "cd", "go to path"},
 	{cmd_wait, "wait", "wait for all processes to finish"},
+	{cmd_hash, "hash", "list remembered command paths, -r to forget them, or look up the names given"},
+	{cmd_type, "type", "tell how each name would be run"},
+	{cmd_fg, "fg", "continue a job in the foreground, the last one unless given its number"},
+	{cmd_bg, "bg", "continue a stopped job in the background"},
 };
 
+int shell_terminal;
+int shell_is_interactive;
+struct termios shell_tmodes;
+id_t shell_pgid;
+
+/* Exit status of the last foreground pipeline, which the shell exits with */
+static int last_status;
 
 process *create_process(tok_t *arg, int background);
+int lookup(char cmd[]);
+void exec_command(const char *path, tok_t args[]);
+void add_process(process *new_proc);
+void remove_process(process *proc);
+void initialize_process(process *proc, pid_t process_id, tok_t args[], int is_background);
+int is_pipeline(tok_t *tokens);
+void handle_command_line(tok_t *tokens);
+static void finish_job(pid_t job);
+static process *find_job(tok_t arg[]);
 
 int cmd_help(tok_t arg[]) {
   int i;
@@ -88,115 +122,334 @@ int cmd_cd(tok_t arg[]) {
     return 0;
 }
 
+void report_process(process *p) {
+    if (WIFEXITED(p->status)) {
+        printf("Process %d terminated with exit status %d\n", p->pid, WEXITSTATUS(p->status));
+    } else if (WIFSIGNALED(p->status)) {
+        printf("Process %d terminated due to signal %d\n", p->pid, WTERMSIG(p->status));
+    }
+}
+
 int cmd_wait(tok_t arg[]) {
-    int status;
-    pid_t child_pid;
+    process *p, *next;
 
-    do {
-        child_pid = waitpid(-1, &status, WNOHANG);
+    for (p = first_process; p; p = p->next) {
+        if (p->argv && p->background && !job_is_stopped(p->pgid)) wait_for_job(p->pgid);
+    }
 
-        if (child_pid > 0) {
-            if (WIFEXITED(status)) {
-                printf("Process %d terminated with exit status %d\n", child_pid, WEXITSTATUS(status));
-            } else if (WIFSIGNALED(status)) {
-                printf("Process %d terminated due to signal %d\n", child_pid, WTERMSIG(status));
-            }
+    for (p = first_process; p; p = next) {
+        next = p->next;
+        if (p->argv && p->background && p->completed && job_is_completed(p->pgid)) {
+            report_process(p);
+            remove_process(p);
         }
-    } while (child_pid > 0 || (child_pid == -1 && errno == EINTR));
-
-    if (child_pid == -1 && errno != ECHILD) {
-        perror("waitpid");
-        return -1;
     }
+    return 1;
+}
+
+int cmd_fg(tok_t arg[]) {
+    process *job = find_job(arg);
+    if (!job) return -1;
 
+    put_process_in_foreground(job, 1);
+    finish_job(job->pgid);
     return 1;
 }
 
-void execute_external_command(tok_t cmd, tok_t args[], int read, tok_t read_file, int write, tok_t write_file, int background) {
-    process *proc;
-    int fdIn, fdOut;
-    pid_t cpid, current_pid;
+int cmd_bg(tok_t arg[]) {
+    process *job = find_job(arg);
+    if (!job) return -1;
 
-    current_pid = getpid();
-    proc = create_process(args, background);
-    if (!proc) return;
+    put_process_in_background(job, 1);
+    return 1;
+}
+
+int cmd_hash(tok_t arg[]) {
+    char path[PATH_MAX];
+    int i, status = 1;
+
+    if (arg[0] == NULL) {
+        hash_print(stdout);
+        return 1;
+    }
+    if (strcmp(arg[0], "-r") == 0) {
+        hash_forget();
+        return 1;
+    }
+    for (i = 0; arg[i] != NULL; i++) {
+        if (lookup(arg[i]) < 0 && hash_find(arg[i], 0, path, sizeof(path)) < 0) {
+            fprintf(stderr, "hash: %s: not found\n", arg[i]);
+            status = -1;
+        }
+    }
+    return status;
+}
 
-    add_process(proc);
+int cmd_type(tok_t arg[]) {
+    char path[PATH_MAX];
+    const char *hashed;
+    int i, status = 1;
+
+    for (i = 0; arg[i] != NULL; i++) {
+        if (lookup(arg[i]) >= 0) {
+            printf("%s is a shell builtin\n", arg[i]);
+        } else if (strchr(arg[i], '/')) {
+            printf("%s is %s\n", arg[i], arg[i]);
+        } else if ((hashed = hash_lookup(arg[i])) != NULL) {
+            printf("%s is hashed (%s)\n", arg[i], hashed);
+        } else if (hash_search(arg[i], path, sizeof(path)) == 0) {
+            printf("%s is %s\n", arg[i], path);
+        } else {
+            fprintf(stderr, "type: %s: not found\n", arg[i]);
+            status = -1;
+        }
+    }
+    return status;
+}
+
+/* Signals the shell ignores, which commands get back with their default action */
+static void default_signals(sigset_t *set) {
+    sigemptyset(set);
+    sigaddset(set, SIGINT);
+    sigaddset(set, SIGQUIT);
+    sigaddset(set, SIGTSTP);
+    sigaddset(set, SIGTTIN);
+    sigaddset(set, SIGTTOU);
+}
+
+/* One command of a pipeline */
+typedef struct stage {
+  tok_t *args;
+  tok_t read_file;
+  tok_t write_file;
+  int builtin;          /* index in cmd_table, or -1 to run path */
+  char path[PATH_MAX];
+  int in, out;          /* pipe ends for its input and output, or -1 */
+  int next_in;          /* the pipe end the next command reads, or -1 */
+} stage_t;
+
+/**
+ * Starts a command with posix_spawn, which glibc does with a clone that shares
+ * the shell's memory until the exec, like vfork, instead of copying its page
+ * tables. The pipes and redirections are done by file actions in the child;
+ * the shell's pipe ends are close-on-exec, so the command only keeps its own.
+ * It joins process group PGID, or starts one if that is 0, and with FOREGROUND
+ * the child gives that group the terminal before the exec, so it is not stopped
+ * for reading it before the shell gets to. If it cannot be started, STATUS is
+ * set to the exit status that stands for why.
+ */
+static pid_t spawn_command(const stage_t *stage, pid_t pgid, int own_group, int foreground, int *status) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t defaults;
+    short flags = POSIX_SPAWN_SETSIGDEF;
+    pid_t pid;
+    int err;
+
+    posix_spawn_file_actions_init(&actions);
+    if (stage->in >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, stage->in, STDIN_FILENO);
+    }
+    if (stage->out >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, stage->out, STDOUT_FILENO);
+    }
+    if (stage->read_file) {
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, stage->read_file, O_RDONLY, 0);
+    }
+    if (stage->write_file) {
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, stage->write_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (foreground) {
+        posix_spawn_file_actions_addtcsetpgrp_np(&actions, shell_terminal);
+    }
+
+    posix_spawnattr_init(&attr);
+    default_signals(&defaults);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    if (own_group) {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        posix_spawnattr_setpgroup(&attr, pgid);
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    err = posix_spawn(&pid, stage->path, &actions, &attr, stage->args, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (err == 0) return pid;
+
+    /* A failed redirection is reported like a failed exec, so tell them apart
+       the way the fork path would have: the program can be run, the file not */
+    if ((stage->read_file || stage->write_file) && access(stage->path, X_OK) == 0) {
+        if (stage->read_file && access(stage->read_file, R_OK) != 0) {
+            fprintf(stderr, "Error opening input file: %s\n", strerror(err));
+        } else {
+            fprintf(stderr, "Error opening output file: %s\n", strerror(err));
+        }
+        *status = 1;
+    } else {
+        fprintf(stderr, "%s: %s\n", stage->args[0], strerror(err));
+        *status = err == ENOENT ? 127 : 126;
+    }
+    return -1;
+}
+
+/* Starts a command in a forked copy of the shell, doing the pipes and redirections there.
+   This is also how builtins run as part of a pipeline. */
+static pid_t fork_command(const stage_t *stage, pid_t pgid, int own_group, int foreground, int *status) {
+    int fdIn, fdOut;
+    pid_t cpid;
 
     cpid = fork();
     if (cpid < 0) {
         perror("Error in fork");
-        return;
+        *status = 1;
+        return -1;
     }
 
     if (cpid == 0) { // Child process
+        /* Still ignoring SIGTTOU, so taking the terminal cannot stop it */
+        if (own_group) setpgid(0, pgid);
+        if (foreground) tcsetpgrp(shell_terminal, getpgrp());
         signal(SIGINT, SIG_DFL);
         signal(SIGQUIT, SIG_DFL);
         signal(SIGTSTP, SIG_DFL);
         signal(SIGTTIN, SIG_DFL);
         signal(SIGTTOU, SIG_DFL);
-        proc->pid = getpid();
 
-        if (write) {
-            fdOut = open(write_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (stage->in >= 0) {
+            dup2(stage->in, STDIN_FILENO);
+            close(stage->in);
+        }
+        if (stage->out >= 0) {
+            dup2(stage->out, STDOUT_FILENO);
+            close(stage->out);
+        }
+        if (stage->next_in >= 0) close(stage->next_in);
+
+        if (stage->write_file) {
+            fdOut = open(stage->write_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
             if (fdOut < 0) {
                 perror("Error opening output file");
-                exit(EXIT_FAILURE);
+                _exit(EXIT_FAILURE);
             }
             dup2(fdOut, STDOUT_FILENO);
             close(fdOut);
         }
 
-        if (read) {
-            fdIn = open(read_file, O_RDONLY);
+        if (stage->read_file) {
+            fdIn = open(stage->read_file, O_RDONLY);
             if (fdIn < 0) {
                 perror("Error opening input file");
-                exit(EXIT_FAILURE);
+                _exit(EXIT_FAILURE);
             }
             dup2(fdIn, STDIN_FILENO);
             close(fdIn);
         }
 
-        exec_command(cmd, args);
-        exit(EXIT_FAILURE); // If exec_command returns, it failed
-    } else { // Parent process
-        proc->pid = cpid;
-
-        if (!background) {
-            int status;
-            do {
-                waitpid(cpid, &status, WUNTRACED);
-            } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+        if (stage->builtin >= 0) {
+            int result = cmd_table[stage->builtin].fun(&stage->args[1]);
+            fflush(stdout);
+            _exit(result < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
         }
+        exec_command(stage->path, stage->args);
+        _exit(errno == ENOENT ? 127 : 126); // If exec_command returns, it failed
     }
+
+    /* Also set here, so the group exists before the shell hands it the terminal */
+    if (own_group) setpgid(cpid, pgid ? pgid : cpid);
+    return cpid;
 }
 
-void exec_command(tok_t cmd, tok_t args[]) {
-    if (execv(cmd, args) == -1) {
-        search_and_exec_command(cmd, args);
+/**
+ * Starts the COUNT commands of a pipeline at once, each one's output going
+ * through a pipe to the next one's input. They form one job, named after the
+ * pid of the first; with a terminal they also share its process group, so
+ * they are stopped, continued and interrupted together.
+ */
+void run_pipeline(stage_t *stages, int count, int background) {
+    process *proc, *leader = NULL;
+    int fds[2], next_in = -1, i, status, failed_status = 0;
+    pid_t cpid, job = 0;
+    char *launch = getenv("SHELL_LAUNCH");
+    int use_fork = launch && strcmp(launch, "fork") == 0;
+
+    /* Resolved before starting anything, so each child only has to exec */
+    for (i = 0; i < count; i++) {
+        stage_t *stage = &stages[i];
+        if (stage->builtin >= 0) continue;
+        if (hash_find(stage->args[0], 1, stage->path, sizeof(stage->path)) < 0 &&
+            (access(stage->args[0], X_OK) != 0 ||
+             snprintf(stage->path, sizeof(stage->path), "%s", stage->args[0]) >= sizeof(stage->path))) {
+            printf("Command not found: %s\n", stage->args[0]);
+            last_status = 127;
+            return;
+        }
     }
-}
 
-void search_and_exec_command(tok_t cmd, tok_t args[]) {
-    char *path = getenv("PATH");
-    char *path_env = (char*) malloc(1024);
-    strncpy(path_env, path, 1024);
-    char fullPath[1024];
-    int found = 0;
-
-    if (path_env != NULL) {
-        char *token;
-        for (token = strtok(path_env, ":"); token != NULL; token = strtok(NULL, ":")) {
-            snprintf(fullPath, sizeof(fullPath), "%s/%s", token, cmd);
-            if (execv(fullPath, args) != -1) {
-                found = 1;
+    /* What the shell printed so far comes before the commands' output */
+    fflush(stdout);
+
+    for (i = 0; i < count; i++) {
+        stage_t *stage = &stages[i];
+        stage->in = next_in;
+        stage->out = stage->next_in = next_in = -1;
+        if (i + 1 < count) {
+            if (pipe2(fds, O_CLOEXEC) < 0) {
+                perror("pipe");
+                failed_status = 1;
                 break;
             }
+            fcntl(fds[1], F_SETPIPE_SZ, PIPE_BUFFER_SIZE);
+            stage->out = fds[1];
+            stage->next_in = next_in = fds[0];
+        }
+
+        /* Commands get a process group of their own only when there is a terminal to share.
+           The first one of a foreground job hands it the terminal itself, before the
+           others start and may read it */
+        int foreground = shell_is_interactive && !background && !job;
+        if (use_fork || stage->builtin >= 0) {
+            cpid = fork_command(stage, job, shell_is_interactive, foreground, &status);
+        } else {
+            cpid = spawn_command(stage, job, shell_is_interactive, foreground, &status);
         }
-        if (!found) {
-            printf("Command not found: %s\n", cmd);
+        if (stage->in >= 0) close(stage->in);
+        if (stage->out >= 0) close(stage->out);
+        if (cpid < 0) {
+            /* The others still run, against the closed ends of its pipes,
+               and it stands for the pipeline if it was the last one */
+            if (i + 1 == count) failed_status = status;
+            continue;
         }
+
+        if (!job) job = cpid;
+        proc = create_process(stage->args, background);
+        proc->pid = cpid;
+        proc->pgid = job;
+        add_process(proc);
+        if (!leader) leader = proc;
+    }
+    if (next_in >= 0) close(next_in);
+
+    if (!leader) {
+        last_status = failed_status;
+        return;
+    }
+    if (background) {
+        if (shell_is_interactive) printf("[%d]\n", job);
+        return;
     }
+    put_process_in_foreground(leader, 0);
+    finish_job(job);
+    /* A pipeline whose last command could not start takes the status of why */
+    if (failed_status) last_status = failed_status;
+}
+
+void exec_command(const char *path, tok_t args[]) {
+    execv(path, args);
+    int err = errno;
+    perror(path);
+    errno = err; /* for the exit status */
 }
 
 int lookup(char cmd[]) {
@@ -222,6 +475,13 @@ void init_shell()
     while(tcgetpgrp (shell_terminal) != (shell_pgid = getpgrp()))
       kill( - shell_pgid, SIGTTIN);
 
+    /* Ignored first, as taking the terminal from a new group raises SIGTTOU */
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+
     shell_pgid = getpid();
     /* Put shell in its own process group */
     if(setpgid(shell_pgid, shell_pgid) < 0){
@@ -232,15 +492,10 @@ void init_shell()
     /* Take control of the terminal */
     tcsetpgrp(shell_terminal, shell_pgid);
     tcgetattr(shell_terminal, &shell_tmodes);
-
-    signal(SIGINT, SIG_IGN);
-    signal(SIGQUIT, SIG_IGN);
-    signal(SIGTSTP, SIG_IGN);
-    signal(SIGTTIN, SIG_IGN);
-    signal(SIGTTOU, SIG_IGN);
   }
 
-  initialize_process(&first_process, getpid(), NULL, 0);
+  first_process = malloc(sizeof(process));
+  initialize_process(first_process, getpid(), NULL, 0);
 
 }
 
@@ -263,6 +518,17 @@ void add_process(process* new_proc)
     new_proc->prev = current;
 }
 
+/**
+ * Take a finished process out of our process list and free it
+ */
+void remove_process(process* proc)
+{
+    if (proc->prev) proc->prev->next = proc->next;
+    else first_process = proc->next;
+    if (proc->next) proc->next->prev = proc->prev;
+    free(proc);
+}
+
 /**
  * Creates a process given the inputString from stdin
  */
@@ -279,6 +545,9 @@ process* create_process(tok_t *args, int is_background)
 
 void initialize_process(process *proc, pid_t process_id, tok_t args[], int is_background) {
     proc->pid = (process_id == -1) ? getpid() : process_id;
+    proc->pgid = proc->pid;
+    proc->status = 0;
+    proc->tmodes = shell_tmodes;
     proc->stopped = 0;
     proc->completed = 0;
     proc->background = is_background;
@@ -290,35 +559,69 @@ void initialize_process(process *proc, pid_t process_id, tok_t args[], int is_ba
     proc->argv = args;
 }
 
-void refresh_process_status() {
-    int process_status;
-    pid_t completed_pid;
+/* The first process of a job, for fg and bg: the job numbered ARG[0], or the last one */
+static process *find_job(tok_t arg[]) {
+    process *p, *found = NULL;
+    pid_t job = arg[0] ? atoi(arg[0]) : 0;
+
+    for (p = first_process; p; p = p->next) {
+        if (p->argv && p->pid == p->pgid && (!job || p->pgid == job)) found = p;
+    }
+    if (!found) {
+        fprintf(stderr, arg[0] ? "No such job: %s\n" : "No current job\n", arg[0]);
+    }
+    return found;
+}
 
-    while (1) {
-        completed_pid = waitpid(-1, &process_status, WNOHANG); // Non-blocking wait
+/* Take a job that was in the foreground out of the list once it is done,
+ * keeping the status of its last command, or note that it stopped */
+static void finish_job(pid_t job) {
+    process *p, *next, *last = NULL;
 
-        if (completed_pid <= 0) {
-            break;
+    if (job_is_stopped(job)) {
+        for (p = first_process; p; p = p->next) {
+            if (p->pgid == job) p->background = 1;
         }
+        printf("\n[%d] Stopped\n", job);
+        return;
+    }
 
-        if (!update_individual_process_status(completed_pid, process_status)) {
-            break;
-        }
-        
-        if (WIFEXITED(process_status) || WIFSIGNALED(process_status)) {
-            mark_process_as_completed(completed_pid);
+    for (p = first_process; p; p = p->next) {
+        if (p->pgid == job) last = p;
+    }
+    if (!last) return;
+    if (WIFSIGNALED(last->status)) {
+        last_status = 128 + WTERMSIG(last->status);
+        if (WTERMSIG(last->status) != SIGINT && WTERMSIG(last->status) != SIGPIPE) {
+            printf("%s\n", strsignal(WTERMSIG(last->status)));
         }
+    } else {
+        last_status = WEXITSTATUS(last->status);
+    }
+
+    for (p = first_process; p; p = next) {
+        next = p->next;
+        if (p->pgid == job) remove_process(p);
     }
 }
 
-void mark_process_as_completed(pid_t pid) {
-    process* current = first_process;
-    while (current != NULL) {
-        if (current->pid == pid) {
-            current->completed = TRUE;
-            break;
+/* Record what happened to children without waiting, and drop background
+ * jobs that are done, telling about them when there is a terminal */
+void refresh_process_status() {
+    int process_status;
+    pid_t completed_pid;
+    process *p, *next;
+
+    while ((completed_pid = waitpid(-1, &process_status, WNOHANG | WUNTRACED)) > 0) {
+        update_individual_process_status(completed_pid, process_status);
+    }
+
+    for (p = first_process; p; p = next) {
+        next = p->next;
+        if (p->argv && p->background && p->completed && job_is_completed(p->pgid)) {
+            if (shell_is_interactive) report_process(p);
+            remove_process(p);
         }
-        current = current->next;
     }
 }
 
@@ -340,38 +643,53 @@ int shell (int argc, char *argv[]) {
   while ((s = freadln(stdin))){
     t = getToks(s); /* break the line into tokens */
     fundex = lookup(t[0]); /* Is first token a shell literal */
-    if(fundex >= 0) cmd_table[fundex].fun(&t[1]);
-    else {
-      handle_non_builtin_commands(t);
+    if(fundex >= 0 && !is_pipeline(t)) last_status = cmd_table[fundex].fun(&t[1]) < 0 ? 1 : 0;
+    else if (t[0]) {
+      handle_command_line(t);
     }
     // fprintf(stdout, "%d: ", lineNum);
     refresh_process_status();
   }
+  return last_status;
+}
+
+int is_pipeline(tok_t *tokens) {
+  for (int i = 0; tokens[i] != NULL; i++) {
+    if (strcmp(tokens[i], "|") == 0) return 1;
+  }
   return 0;
 }
 
-void handle_non_builtin_commands(tok_t *tokens) {
-  char *write_file = NULL, *read_file = NULL;
-  int is_write = 0, is_read = 0, is_background = 0;
+/* Split a line into the commands of a pipeline, with their own < and >, and run it */
+void handle_command_line(tok_t *tokens) {
+  stage_t stages[MAXTOKS];
+  int count = 0, is_background = 0;
 
+  stages[0] = (stage_t){tokens, NULL, NULL};
   for (int i = 0; tokens[i] != NULL; i++) {
-    if (strcmp(tokens[i], ">") == 0 && tokens[i + 1] != NULL) {
-      is_write = 1;
-      write_file = tokens[i + 1];
+    if (strcmp(tokens[i], "|") == 0) {
       tokens[i] = NULL;
+      if (stages[count].args[0] == NULL) break;
+      stages[++count] = (stage_t){&tokens[i + 1], NULL, NULL};
+    } else if (strcmp(tokens[i], ">") == 0 && tokens[i + 1] != NULL) {
+      stages[count].write_file = tokens[i + 1];
+      tokens[i++] = NULL;
     } else if (strcmp(tokens[i], "<") == 0 && tokens[i + 1] != NULL) {
-      is_read = 1;
-      read_file = tokens[i + 1];
-      tokens[i] = NULL;
+      stages[count].read_file = tokens[i + 1];
+      tokens[i++] = NULL;
     } else if (strcmp(tokens[i], "&") == 0) {
       is_background = 1;
       tokens[i] = NULL;
     }
   }
 
-  if (is_write || is_read || is_background) {
-    execute_external_command(tokens[0], tokens, is_read, read_file, is_write, write_file, is_background);
-  } else {
-    execute_external_command(tokens[0], tokens, 0, NULL, 0, NULL, 0);
+  for (int i = 0; i <= count; i++) {
+    if (stages[i].args[0] == NULL) {
+      fprintf(stderr, "Missing command in pipeline\n");
+      last_status = 2;
+      return;
+    }
+    stages[i].builtin = lookup(stages[i].args[0]);
   }
+  run_pipeline(stages, count + 1, is_background);
 }
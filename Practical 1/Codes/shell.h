@@ -4,10 +4,10 @@
 #include <termios.h>
 #include "sys/types.h"
 
-int shell_terminal; //File descripter for the terminal.
-int shell_is_interactive; //1 if shell_terminal is a valid terminal. 0 otherwise
-struct termios shell_tmodes; //terminal options for the shell
-id_t shell_pgid; //The shell's process id
+extern int shell_terminal; //File descripter for the terminal.
+extern int shell_is_interactive; //1 if shell_terminal is a valid terminal. 0 otherwise
+extern struct termios shell_tmodes; //terminal options for the shell
+extern id_t shell_pgid; //The shell's process id
 int shell(int argc, char *argv[]);
 
 #endif
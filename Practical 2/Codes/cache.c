@@ -0,0 +1,451 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "utlist.h"
+
+#define CACHE_BUCKETS 4096
+#define CACHE_SEGMENT_SIZE (64 * 1024 * 1024)
+#define CACHE_WAIT_SECONDS 30
+#define CACHE_PAGE_SIZE 4096
+
+/* Entries start on a page, so the hole punched for one frees all of its blocks. */
+#define CACHE_SPAN(size) (((size) + CACHE_PAGE_SIZE - 1) & ~(size_t) (CACHE_PAGE_SIZE - 1))
+
+/* An unlinked, mmap'd file that spilled entries are bump-allocated from.
+ * The file is sparse, and an entry's pages are punched out of it once the
+ * entry is gone, so the disk it takes is what disk_used counts. */
+typedef struct cache_segment {
+  char *map;
+  int fd;
+  size_t used;
+  int live;  // Number of entries still pointing into this segment.
+} cache_segment_t;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_cond = PTHREAD_COND_INITIALIZER;
+
+static cache_entry_t *buckets[CACHE_BUCKETS];
+static cache_entry_t *mem_lru;   // Most recently used first.
+static cache_entry_t *disk_lru;
+static size_t mem_used, mem_limit;
+static size_t disk_used, disk_limit;
+static char *spill_dir;
+static cache_segment_t *active_segment;
+static unsigned int segment_counter;
+
+static unsigned int hash_key(const char *key) {
+  uint32_t h = 2166136261u;
+  for (; *key; key++) {
+    h ^= (unsigned char) *key;
+    h *= 16777619u;
+  }
+  return h % CACHE_BUCKETS;
+}
+
+void cache_init(size_t limit, const char *dir, size_t disk) {
+  mem_limit = limit;
+  disk_limit = disk;
+  spill_dir = dir ? strdup(dir) : NULL;
+}
+
+int cache_enabled(void) {
+  return mem_limit > 0;
+}
+
+size_t cache_max_object_size(void) {
+  return mem_limit / 8;
+}
+
+static void segment_release(cache_segment_t *segment) {
+  munmap(segment->map, CACHE_SEGMENT_SIZE);
+  close(segment->fd);
+  free(segment);
+}
+
+/* Gives back the disk blocks under SIZE bytes at DATA, which nothing uses any more. */
+static void segment_punch(cache_segment_t *segment, char *data, size_t size) {
+  static int warned;
+  if (fallocate(segment->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+        data - segment->map, CACHE_SPAN(size)) < 0 && !warned) {
+    fprintf(stderr, "Failed to free cache segment space: %s\n", strerror(errno));
+    warned = 1;
+  }
+}
+
+static cache_segment_t *segment_create(void) {
+  char path[1024];
+  snprintf(path, sizeof(path), "%s/httpcache-%d-%u.seg", spill_dir, getpid(),
+      segment_counter++);
+
+  int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to create cache segment %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  /* The mapping and fd keep the file alive, so it disappears with the process. */
+  unlink(path);
+
+  cache_segment_t *segment = NULL;
+  void *map = MAP_FAILED;
+  if (ftruncate(fd, CACHE_SEGMENT_SIZE) == 0)
+    map = mmap(NULL, CACHE_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "Failed to map cache segment: %s\n", strerror(errno));
+    close(fd);
+    return NULL;
+  }
+  segment = calloc(1, sizeof(cache_segment_t));
+  if (!segment) {
+    munmap(map, CACHE_SEGMENT_SIZE);
+    close(fd);
+    return NULL;
+  }
+  segment->map = map;
+  segment->fd = fd;  // Kept open to punch holes in.
+  return segment;
+}
+
+/* Returns space for SIZE bytes in the active segment, rotating if full. */
+static char *segment_alloc(size_t size, cache_segment_t **out) {
+  if (size > CACHE_SEGMENT_SIZE)
+    return NULL;
+
+  size = CACHE_SPAN(size);
+  if (!active_segment || active_segment->used + size > CACHE_SEGMENT_SIZE) {
+    cache_segment_t *segment = segment_create();
+    if (!segment)
+      return NULL;
+    if (active_segment && active_segment->live == 0)
+      segment_release(active_segment);
+    active_segment = segment;
+  }
+
+  char *space = active_segment->map + active_segment->used;
+  active_segment->used += size;
+  active_segment->live++;
+  *out = active_segment;
+  return space;
+}
+
+/* Frees ENTRY once the last reference is gone. Called with cache_lock held. */
+static void entry_put(cache_entry_t *entry) {
+  if (--entry->refcount > 0)
+    return;
+
+  if (entry->segment) {
+    cache_segment_t *segment = entry->segment;
+    if (--segment->live == 0 && segment != active_segment)
+      segment_release(segment);
+    else
+      segment_punch(segment, entry->data, entry->size);
+  } else {
+    free(entry->data);
+  }
+  free(entry->key);
+  free(entry);
+}
+
+static void hash_remove(cache_entry_t *entry) {
+  cache_entry_t **link = &buckets[hash_key(entry->key)];
+  while (*link && *link != entry)
+    link = &(*link)->hash_next;
+  if (*link)
+    *link = entry->hash_next;
+  entry->hash_next = NULL;
+}
+
+/* Removes a committed entry from the index and drops the cache's reference. */
+static void entry_evict(cache_entry_t *entry) {
+  hash_remove(entry);
+  if (entry->segment) {
+    DL_DELETE(disk_lru, entry);
+    disk_used -= CACHE_SPAN(entry->size);
+  } else {
+    DL_DELETE(mem_lru, entry);
+    mem_used -= entry->size;
+  }
+  entry_put(entry);
+}
+
+/* Moves an in-memory entry into a segment. Returns 0 on failure. */
+static int entry_spill(cache_entry_t *entry) {
+  /* Readers may still be sending from the heap copy. */
+  if (!spill_dir || entry->refcount > 1 || CACHE_SPAN(entry->size) > disk_limit)
+    return 0;
+
+  cache_segment_t *segment;
+  char *space = segment_alloc(entry->size, &segment);
+  if (!space)
+    return 0;
+
+  memcpy(space, entry->data, entry->size);
+  free(entry->data);
+  entry->data = space;
+  entry->segment = segment;
+
+  DL_DELETE(mem_lru, entry);
+  mem_used -= entry->size;
+  DL_PREPEND(disk_lru, entry);
+  disk_used += CACHE_SPAN(entry->size);
+  return 1;
+}
+
+static void enforce_limits(time_t now) {
+  while (mem_used > mem_limit && mem_lru) {
+    cache_entry_t *victim = mem_lru->prev;
+    if (victim->expires <= now || !entry_spill(victim))
+      entry_evict(victim);
+  }
+  while (disk_used > disk_limit && disk_lru)
+    entry_evict(disk_lru->prev);
+}
+
+static void touch(cache_entry_t *entry) {
+  if (entry->segment) {
+    DL_DELETE(disk_lru, entry);
+    DL_PREPEND(disk_lru, entry);
+  } else {
+    DL_DELETE(mem_lru, entry);
+    DL_PREPEND(mem_lru, entry);
+  }
+}
+
+static cache_entry_t *hash_find(const char *key) {
+  cache_entry_t *entry;
+  for (entry = buckets[hash_key(key)]; entry; entry = entry->hash_next) {
+    if (strcmp(entry->key, key) == 0)
+      return entry;
+  }
+  return NULL;
+}
+
+cache_entry_t *cache_lookup(const char *key, int *is_leader) {
+  cache_entry_t *entry;
+  time_t now = time(NULL);
+  *is_leader = 0;
+
+  pthread_mutex_lock(&cache_lock);
+
+  entry = hash_find(key);
+  if (entry && entry->state == CACHE_READY && entry->expires <= now) {
+    entry_evict(entry);
+    entry = NULL;
+  }
+
+  if (entry && entry->state == CACHE_READY) {
+    touch(entry);
+    entry->refcount++;
+    pthread_mutex_unlock(&cache_lock);
+    return entry;
+  }
+
+  if (entry) {
+    /* Someone else is already fetching this key, wait for them. */
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += CACHE_WAIT_SECONDS;
+
+    entry->refcount++;
+    while (entry->state == CACHE_PENDING) {
+      if (pthread_cond_timedwait(&cache_cond, &cache_lock, &deadline) == ETIMEDOUT)
+        break;
+    }
+    if (entry->state != CACHE_READY) {
+      entry_put(entry);
+      entry = NULL;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return entry;
+  }
+
+  entry = calloc(1, sizeof(cache_entry_t));
+  if (entry)
+    entry->key = strdup(key);
+  if (!entry || !entry->key) {
+    free(entry);
+    pthread_mutex_unlock(&cache_lock);
+    return NULL;
+  }
+
+  /* One reference for the index, one for the leader. */
+  entry->state = CACHE_PENDING;
+  entry->refcount = 2;
+  unsigned int bucket = hash_key(key);
+  entry->hash_next = buckets[bucket];
+  buckets[bucket] = entry;
+  *is_leader = 1;
+
+  pthread_mutex_unlock(&cache_lock);
+  return entry;
+}
+
+void cache_commit(cache_entry_t *entry, char *data, size_t size, time_t expires) {
+  pthread_mutex_lock(&cache_lock);
+  entry->data = data;
+  entry->size = size;
+  entry->expires = expires;
+  entry->stored = time(NULL);
+  entry->age = 0;
+  char value[32];
+  char *headers_end = memmem(data, size, "\r\n\r\n", 4);
+  if (headers_end && cache_find_header(data, headers_end + 4 - data, "Age", value, sizeof(value)))
+    entry->age = strtol(value, NULL, 10);
+  entry->state = CACHE_READY;
+  DL_PREPEND(mem_lru, entry);
+  mem_used += size;
+  enforce_limits(time(NULL));
+  pthread_cond_broadcast(&cache_cond);
+  pthread_mutex_unlock(&cache_lock);
+}
+
+void cache_abandon(cache_entry_t *entry) {
+  pthread_mutex_lock(&cache_lock);
+  entry->state = CACHE_FAILED;
+  hash_remove(entry);
+  entry_put(entry);
+  pthread_cond_broadcast(&cache_cond);
+  pthread_mutex_unlock(&cache_lock);
+}
+
+void cache_release(cache_entry_t *entry) {
+  pthread_mutex_lock(&cache_lock);
+  entry_put(entry);
+  pthread_mutex_unlock(&cache_lock);
+}
+
+char *cache_hit_headers(const cache_entry_t *entry, time_t now, size_t *len, size_t *body) {
+  const char *data = entry->data;
+  const char *headers_end = memmem(data, entry->size, "\r\n\r\n", 4);
+  size_t header_len = headers_end ? (size_t) (headers_end + 2 - data) : 0;
+  char *out = malloc(header_len + 32);
+  if (!out)
+    return NULL;
+  /* Without a header block there is nothing to add to, the data goes as it is. */
+  if (!headers_end) {
+    *len = *body = 0;
+    return out;
+  }
+
+  /* Every line but the old Age, up to and including the last header's CRLF. */
+  size_t used = 0;
+  const char *line = data;
+  while (line < data + header_len) {
+    const char *eol = memchr(line, '\n', data + header_len - line);
+    size_t n = (eol ? eol + 1 : data + header_len) - line;
+    if (line == data || n < 4 || strncasecmp(line, "Age:", 4) != 0) {
+      memcpy(out + used, line, n);
+      used += n;
+    }
+    line += n;
+  }
+
+  long age = entry->age + (long) (now - entry->stored);
+  used += sprintf(out + used, "Age: %ld\r\n\r\n", age > 0 ? age : 0);
+  *len = used;
+  *body = header_len + 2;
+  return out;
+}
+
+int cache_find_header(const char *headers, size_t len, const char *name,
+    char *value, size_t value_size) {
+  size_t name_len = strlen(name);
+  const char *end = headers + len;
+  const char *line = memchr(headers, '\n', len);
+
+  while (line && ++line < end) {
+    const char *eol = memchr(line, '\n', end - line);
+    if (!eol)
+      eol = end;
+    if (eol - line <= 1)
+      break;  // Blank line ends the header block.
+
+    if ((size_t) (eol - line) > name_len && line[name_len] == ':' &&
+        strncasecmp(line, name, name_len) == 0) {
+      const char *start = line + name_len + 1;
+      const char *stop = eol;
+      while (start < stop && (*start == ' ' || *start == '\t')) start++;
+      while (stop > start && (stop[-1] == '\r' || stop[-1] == ' ')) stop--;
+      size_t n = stop - start;
+      if (n >= value_size)
+        n = value_size - 1;
+      memcpy(value, start, n);
+      value[n] = '\0';
+      return 1;
+    }
+    line = eol;
+  }
+  return 0;
+}
+
+static time_t parse_http_date(const char *value) {
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  if (!strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm))
+    return 0;
+  return timegm(&tm);
+}
+
+static long directive_seconds(const char *cache_control, const char *directive) {
+  const char *p = strcasestr(cache_control, directive);
+  if (!p)
+    return -1;
+  return strtol(p + strlen(directive), NULL, 10);
+}
+
+time_t cache_response_expiry(const char *headers, size_t len, time_t now) {
+  char value[256];
+  int status = 0;
+
+  if (sscanf(headers, "HTTP/%*d.%*d %d", &status) != 1)
+    return 0;
+  if (status != 200 && status != 203 && status != 301)
+    return 0;
+
+  /* We key on the path only, so anything that varies per client stays out. */
+  if (cache_find_header(headers, len, "Vary", value, sizeof(value)) ||
+      cache_find_header(headers, len, "Set-Cookie", value, sizeof(value)))
+    return 0;
+
+  long age = 0;
+  if (cache_find_header(headers, len, "Age", value, sizeof(value)))
+    age = strtol(value, NULL, 10);
+
+  if (cache_find_header(headers, len, "Cache-Control", value, sizeof(value))) {
+    if (strcasestr(value, "no-store") || strcasestr(value, "no-cache") ||
+        strcasestr(value, "private"))
+      return 0;
+
+    long max_age = directive_seconds(value, "s-maxage=");
+    if (max_age < 0)
+      max_age = directive_seconds(value, "max-age=");
+    if (max_age >= 0)
+      return max_age > age ? now + max_age - age : 0;
+  }
+
+  if (cache_find_header(headers, len, "Expires", value, sizeof(value))) {
+    time_t expires = parse_http_date(value);
+    if (!expires)
+      return 0;
+    /* Measure against the origin's clock when it tells us what that is. */
+    if (cache_find_header(headers, len, "Date", value, sizeof(value))) {
+      time_t date = parse_http_date(value);
+      if (date)
+        expires = now + (expires - date);
+    }
+    expires -= age;
+    return expires > now ? expires : 0;
+  }
+
+  return 0;
+}
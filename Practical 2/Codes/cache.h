@@ -0,0 +1,107 @@
+#ifndef __CACHE__
+#define __CACHE__
+
+#include <stddef.h>
+#include <time.h>
+
+/*
+ * An HTTP response cache used by the proxy. Entries are keyed by request
+ * path and hold the complete upstream response (status line, headers and
+ * body) exactly as it was received, so a hit can be replayed verbatim.
+ *
+ * Entries live in memory until the memory budget is exceeded. If a spill
+ * directory is configured, the least recently used entries are then moved
+ * into mmap'd segment files instead of being dropped.
+ *
+ * Concurrent misses for the same key are coalesced: the first caller
+ * becomes the leader and fetches from upstream, everyone else waits for
+ * the leader to commit (or abandon) the entry.
+ *
+ * Usage example:
+ *
+ *     int is_leader;
+ *     cache_entry_t *entry = cache_lookup(path, &is_leader);
+ *     if (!entry) {
+ *       // Not cacheable right now, go upstream without the cache.
+ *     } else if (is_leader) {
+ *       // Fetch, then either cache_commit(entry, ...) or cache_abandon(entry).
+ *       cache_release(entry);
+ *     } else {
+ *       size_t len, body;
+ *       char *headers = cache_hit_headers(entry, time(NULL), &len, &body);
+ *       http_send_data(fd, headers, len);
+ *       http_send_data(fd, entry->data + body, entry->size - body);
+ *       free(headers);
+ *       cache_release(entry);
+ *     }
+ */
+
+typedef enum {
+  CACHE_PENDING,  // Leader is still fetching the response.
+  CACHE_READY,    // data/size hold a fresh response.
+  CACHE_FAILED,   // Leader gave up, waiters must go upstream themselves.
+} cache_state_t;
+
+struct cache_segment;
+
+typedef struct cache_entry {
+  char *key;
+  char *data;
+  size_t size;
+  time_t expires;
+  time_t stored;                  // When the response was committed.
+  long age;                       // Its Age header then, 0 if it had none.
+  cache_state_t state;
+  int refcount;
+  struct cache_segment *segment;  // Non-NULL once spilled to disk.
+  struct cache_entry *hash_next;
+  struct cache_entry *next;       // LRU list links.
+  struct cache_entry *prev;
+} cache_entry_t;
+
+/*
+ * Sets up the cache. A mem_limit of 0 leaves the cache disabled. spill_dir
+ * may be NULL, in which case evicted entries are simply dropped.
+ */
+void cache_init(size_t mem_limit, const char *spill_dir, size_t disk_limit);
+int cache_enabled(void);
+
+/* Largest response (headers included) that will be cached. */
+size_t cache_max_object_size(void);
+
+/*
+ * Returns a referenced entry for KEY, or NULL if the caller should bypass
+ * the cache. Sets *is_leader when the caller must fetch the response.
+ */
+cache_entry_t *cache_lookup(const char *key, int *is_leader);
+
+/* Hands DATA (malloc'd, SIZE bytes) to a pending entry and wakes waiters. */
+void cache_commit(cache_entry_t *entry, char *data, size_t size, time_t expires);
+
+/* Marks a pending entry as failed and wakes waiters. */
+void cache_abandon(cache_entry_t *entry);
+
+/* Drops a reference obtained from cache_lookup. */
+void cache_release(cache_entry_t *entry);
+
+/*
+ * Returns the header block of a ready entry, with its Age brought up to NOW,
+ * in malloc'd memory of *LEN bytes. A hit is replayed by sending it, then
+ * the entry's data from offset *BODY on.
+ */
+char *cache_hit_headers(const cache_entry_t *entry, time_t now, size_t *len, size_t *body);
+
+/*
+ * Copies the value of header NAME from the header block HEADERS (LEN bytes,
+ * starting with the request/status line) into VALUE. Returns 1 if found.
+ */
+int cache_find_header(const char *headers, size_t len, const char *name,
+    char *value, size_t value_size);
+
+/*
+ * Returns the absolute expiry time of the response whose header block is
+ * HEADERS, based on Cache-Control and Expires, or 0 if it is not cacheable.
+ */
+time_t cache_response_expiry(const char *headers, size_t len, time_t now);
+
+#endif
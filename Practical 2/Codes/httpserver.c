@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <errno.h>
@@ -13,9 +14,13 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <strings.h>
 #include <unistd.h>
 #include <unistd.h>
 
+#define PROXY_REQUEST_MAX_SIZE 8192
+
+#include "cache.h"
 #include "libhttp.h"
 #include "wq.h"
 
@@ -31,11 +36,15 @@ int server_port;
 char *server_files_directory;
 char *server_proxy_hostname;
 int server_proxy_port;
+size_t cache_size_mb = 64;
+char *cache_spill_directory;
+size_t cache_disk_size_mb = 1024;
 
 /*
  * Serves the contents the file stored at `path` to the client socket `fd`.
  * It is the caller's reponsibility to ensure that the file stored at `path` exists.
  * You can change these functions to anything you want.
+ * The caller closes `fd`.
  * 
  * ATTENTION: Be careful to optimize your code. Judge is
  *            sesnsitive to time-out errors.
@@ -74,7 +83,6 @@ void serve_file(int fd, char *path) {
         munmap(file_memory, length);
         close(file_fd);
     }
-    close(fd);
 }
 
 void serve_directory(int fd, char *path) {
@@ -125,7 +133,6 @@ void serve_directory(int fd, char *path) {
         free(body);
         closedir(dir);
     }
-    close(fd);
 }
 
 /*
@@ -158,10 +165,10 @@ void handle_files_request(int fd) {
         } else {
             if (S_ISREG(path_stat.st_mode)) {
                 serve_file(fd, resolved_path);
-                goto cleanup; // Avoid closing fd twice
+                goto cleanup; // Response already sent
             } else if (S_ISDIR(path_stat.st_mode)) {
                 serve_directory(fd, resolved_path);
-                goto cleanup; // Avoid closing fd twice
+                goto cleanup; // Response already sent
             } else {
                 http_start_response(fd, 404);
             }
@@ -249,7 +256,11 @@ void *forward_data_thread(void *arg) {
     return NULL;
 }
 
-void handle_proxy_request(int fd) {
+/*
+ * Opens a connection to the proxy target. Returns the connected socket, or -1
+ * if the target could not be reached.
+ */
+int connect_proxy_target() {
 
   /*
   * The code below does a DNS lookup of server_proxy_hostname and 
@@ -266,14 +277,12 @@ void handle_proxy_request(int fd) {
   int target_fd = socket(PF_INET, SOCK_STREAM, 0);
   if (target_fd == -1) {
     fprintf(stderr, "Failed to create a new socket: error %d: %s\n", errno, strerror(errno));
-    close(fd);
     exit(errno);
   }
 
   if (target_dns_entry == NULL) {
     fprintf(stderr, "Cannot find host: %s\n", server_proxy_hostname);
     close(target_fd);
-    close(fd);
     exit(ENXIO);
   }
 
@@ -284,14 +293,203 @@ void handle_proxy_request(int fd) {
       sizeof(target_address));
 
   if (connection_status < 0) {
+    close(target_fd);
+    return -1;
+  }
+  return target_fd;
+}
+
+void send_bad_gateway(int fd) {
+  http_start_response(fd, 502);
+  http_send_header(fd, "Content-Type", "text/html");
+  http_end_headers(fd);
+  http_send_string(fd, "<center><h1>502 Bad Gateway</h1><hr></center>");
+}
+
+/*
+ * Returns 1 if the request header block REQUEST (LEN bytes) is a plain GET
+ * whose response may be shared between clients.
+ */
+int proxy_request_is_cacheable(char *request, size_t len) {
+  char value[256];
+  if (strncmp(request, "GET ", 4) != 0)
+    return 0;
+  if (cache_find_header(request, len, "Authorization", value, sizeof(value)) ||
+      cache_find_header(request, len, "Range", value, sizeof(value)) ||
+      cache_find_header(request, len, "Content-Length", value, sizeof(value)) ||
+      cache_find_header(request, len, "Transfer-Encoding", value, sizeof(value)))
+    return 0;
+  if (cache_find_header(request, len, "Cache-Control", value, sizeof(value)) &&
+      (strstr(value, "no-cache") || strstr(value, "no-store")))
+    return 0;
+  if (cache_find_header(request, len, "Pragma", value, sizeof(value)) &&
+      strstr(value, "no-cache"))
+    return 0;
+  return 1;
+}
+
+/*
+ * Sends REQUEST to the target with hop-by-hop connection headers replaced by
+ * "Connection: close", so the response is delimited by EOF.
+ */
+int send_upstream_request(int target_fd, char *request, size_t len) {
+  char *upstream = malloc(len + 32);
+  if (!upstream)
+    return -1;
+
+  char *line = request, *end = request + len, *out = upstream;
+  while (line < end) {
+    char *eol = memchr(line, '\n', end - line);
+    eol = eol ? eol + 1 : end;
+    if (eol - line <= 2)
+      break;  // Blank line, re-added below.
+    if (line == request ||
+        (strncasecmp(line, "Connection:", 11) != 0 &&
+         strncasecmp(line, "Keep-Alive:", 11) != 0 &&
+         strncasecmp(line, "Proxy-Connection:", 17) != 0)) {
+      memcpy(out, line, eol - line);
+      out += eol - line;
+    }
+    line = eol;
+  }
+  out += sprintf(out, "Connection: close\r\n\r\n");
+
+  http_send_data(target_fd, upstream, out - upstream);
+  free(upstream);
+  return 0;
+}
+
+/*
+ * Fetches the response for a cache miss we are the leader of, streaming it to
+ * the client as it arrives and committing it to the cache if it is cacheable.
+ */
+void fetch_and_cache(int fd, char *request, size_t request_len, cache_entry_t *entry) {
+  int target_fd = connect_proxy_target();
+  if (target_fd < 0) {
+    cache_abandon(entry);
+    send_bad_gateway(fd);
+    return;
+  }
+  send_upstream_request(target_fd, request, request_len);
+
+  size_t max_size = cache_max_object_size();
+  size_t capacity = 16384, size = 0;
+  char *response = malloc(capacity);
+  char buffer[16384];
+  ssize_t bytes_read;
+
+  while ((bytes_read = read(target_fd, buffer, sizeof(buffer))) > 0) {
+    /* Keep going after the client hangs up, others may be waiting on us. */
+    http_send_data(fd, buffer, bytes_read);
+    if (!response)
+      continue;
+    if (size + bytes_read > max_size) {
+      free(response);
+      response = NULL;
+      continue;
+    }
+    if (size + bytes_read > capacity) {
+      while (size + bytes_read > capacity) capacity *= 2;
+      char *grown = realloc(response, capacity);
+      if (!grown) {
+        free(response);
+        response = NULL;
+        continue;
+      }
+      response = grown;
+    }
+    memcpy(response + size, buffer, bytes_read);
+    size += bytes_read;
+  }
+  close(target_fd);
+
+  time_t expires = 0;
+  char *headers_end = response ? memmem(response, size, "\r\n\r\n", 4) : NULL;
+  if (bytes_read == 0 && headers_end) {
+    size_t header_len = headers_end + 4 - response;
+    char value[32];
+    expires = cache_response_expiry(response, header_len, time(NULL));
+    /* Don't keep responses that were cut short. */
+    if (cache_find_header(response, header_len, "Content-Length", value, sizeof(value)) &&
+        strtoul(value, NULL, 10) != size - header_len)
+      expires = 0;
+  }
+
+  if (expires) {
+    cache_commit(entry, response, size, expires);
+  } else {
+    cache_abandon(entry);
+    free(response);
+  }
+}
+
+/*
+ * Tries to answer the request on fd through the response cache. Returns 1 if
+ * the request was handled, or 0 if it was left unread for the plain relay.
+ */
+int handle_cached_proxy_request(int fd) {
+  char request[PROXY_REQUEST_MAX_SIZE + 1];
+
+  /* Peek so that uncacheable requests can still be relayed untouched. */
+  ssize_t bytes_read = recv(fd, request, PROXY_REQUEST_MAX_SIZE, MSG_PEEK);
+  if (bytes_read <= 0)
+    return 0;
+  request[bytes_read] = '\0';
+
+  char *headers_end = strstr(request, "\r\n\r\n");
+  if (!headers_end)
+    return 0;
+  size_t request_len = headers_end + 4 - request;
+  if (!proxy_request_is_cacheable(request, request_len))
+    return 0;
+
+  char *path = request + 4;
+  size_t path_len = strcspn(path, " \r\n");
+  char key[PROXY_REQUEST_MAX_SIZE];
+  memcpy(key, path, path_len);
+  key[path_len] = '\0';
+
+  int is_leader;
+  cache_entry_t *entry = cache_lookup(key, &is_leader);
+  if (!entry)
+    return 0;
+
+  /* Consume the request we peeked at, the peeked copy stays in request. */
+  char discard[PROXY_REQUEST_MAX_SIZE];
+  size_t consumed = 0;
+  while (consumed < request_len) {
+    bytes_read = read(fd, discard, request_len - consumed);
+    if (bytes_read <= 0)
+      break;
+    consumed += bytes_read;
+  }
+
+  if (is_leader) {
+    fetch_and_cache(fd, request, request_len, entry);
+  } else {
+    size_t len, body;
+    char *headers = cache_hit_headers(entry, time(NULL), &len, &body);
+    if (headers) {
+      http_send_data(fd, headers, len);
+      http_send_data(fd, entry->data + body, entry->size - body);
+      free(headers);
+    }
+  }
+  cache_release(entry);
+  close(fd);
+  return 1;
+}
+
+void handle_proxy_request(int fd) {
+  if (cache_enabled() && handle_cached_proxy_request(fd))
+    return;
+
+  int target_fd = connect_proxy_target();
+  if (target_fd < 0) {
     /* Dummy request parsing, just to be compliant. */
     http_request_parse(fd);
 
-    http_start_response(fd, 502);
-    http_send_header(fd, "Content-Type", "text/html");
-    http_end_headers(fd);
-    http_send_string(fd, "<center><h1>502 Bad Gateway</h1><hr></center>");
-    close(target_fd);
+    send_bad_gateway(fd);
     close(fd);
     return;
   }
@@ -309,9 +507,9 @@ void handle_proxy_request(int fd) {
   }
   if(pthread_create(&t2, NULL, forward_data_thread, &target_to_client) != 0) {
       perror("pthread_create for target_to_client failed");
-      pthread_cancel(t1);
-      close(fd);
-      close(target_fd);
+      /* t1 closes fd, relay the other way here so target_fd is closed once too. */
+      forward_data_thread(&target_to_client);
+      pthread_join(t1, NULL);
       return;
   }
 
@@ -319,7 +517,6 @@ void handle_proxy_request(int fd) {
   pthread_join(t2, NULL);
 }
 
-
 typedef struct {
     void (*handler)(int socket);
 } worker_args;
@@ -329,8 +526,8 @@ void worker_routine(void *parameters) {
     for (;;) {
         int socketDescriptor = wq_pop(&work_queue);
         if (socketDescriptor >= 0) {
+            /* Handlers close the socket themselves. */
             workerParams->handler(socketDescriptor);
-            close(socketDescriptor);
         } else {
             break;
         }
@@ -348,13 +545,12 @@ void init_thread_pool(int threadCount, void (*handlerFunc)(int)) {
             *args = (worker_args){.handler = handlerFunc}; 
             if (pthread_create(&threads[i], NULL, (void *(*)(void *))worker_routine, args) != 0) {
                 free(args);
+            } else {
+                pthread_detach(threads[i]); // Workers run for the life of the server
             }
         }
     }
 
-    for (int i = 0; i < threadCount; ++i) {
-        pthread_join(threads[i], NULL);
-    }
     free(threads); // Cleanup
 }
 
@@ -400,6 +596,7 @@ void serve_forever(int *socket_number, void (*request_handler)(int)) {
 
   printf("Listening on port %d...\n", server_port);
 
+  wq_init(&work_queue);
   init_thread_pool(num_threads, request_handler);
 
   while (1) {
@@ -415,11 +612,8 @@ void serve_forever(int *socket_number, void (*request_handler)(int)) {
         inet_ntoa(client_address.sin_addr),
         client_address.sin_port);
 
-    wq_init(&work_queue);
-
     if (num_threads == 0) {
       request_handler(client_socket_number);
-      close(client_socket_number);
     } else {
       wq_push(&work_queue, client_socket_number);
     }
@@ -439,7 +633,8 @@ void signal_callback_handler(int signum) {
 
 char *USAGE =
   "Usage: ./httpserver --files www_directory/ --port 8000 [--num-threads 5]\n"
-  "       ./httpserver --proxy inst.eecs.berkeley.edu:80 --port 8000 [--num-threads 5]\n";
+  "       ./httpserver --proxy inst.eecs.berkeley.edu:80 --port 8000 [--num-threads 5]\n"
+  "                    [--cache-size 64] [--cache-dir /tmp] [--cache-disk-size 1024]\n";
 
 void exit_with_usage() {
   fprintf(stderr, "%s", USAGE);
@@ -495,6 +690,26 @@ int main(int argc, char **argv) {
         fprintf(stderr, "Expected positive integer after --num-threads\n");
         exit_with_usage();
       }
+    } else if (strcmp("--cache-size", argv[i]) == 0) {
+      char *cache_size_str = argv[++i];
+      if (!cache_size_str) {
+        fprintf(stderr, "Expected size in MB after --cache-size\n");
+        exit_with_usage();
+      }
+      cache_size_mb = strtoul(cache_size_str, NULL, 10);
+    } else if (strcmp("--cache-dir", argv[i]) == 0) {
+      cache_spill_directory = argv[++i];
+      if (!cache_spill_directory) {
+        fprintf(stderr, "Expected argument after --cache-dir\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--cache-disk-size", argv[i]) == 0) {
+      char *disk_size_str = argv[++i];
+      if (!disk_size_str) {
+        fprintf(stderr, "Expected size in MB after --cache-disk-size\n");
+        exit_with_usage();
+      }
+      cache_disk_size_mb = strtoul(disk_size_str, NULL, 10);
     } else if (strcmp("--help", argv[i]) == 0) {
       exit_with_usage();
     } else {
@@ -509,6 +724,11 @@ int main(int argc, char **argv) {
     exit_with_usage();
   }
 
+  if (request_handler == handle_proxy_request) {
+    cache_init(cache_size_mb * 1024 * 1024, cache_spill_directory,
+        cache_disk_size_mb * 1024 * 1024);
+  }
+
   serve_forever(&server_fd, request_handler);
 
   return EXIT_SUCCESS;
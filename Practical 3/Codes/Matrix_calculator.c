@@ -1,123 +1,422 @@
-#include <pthread.h>
+/*
+ * Multiplies the two matrices of input_matrix.txt and prints the result.
+ *
+ *     Matrix_calculator [-t threads] [-s cutoff] [-d density] [-i input.txt | -a A -b B]
+ *                       [-o result.txt | -O result.bin] [-A A.bin -B B.bin]
+ *     Matrix_calculator [-t threads] -m memory -a A.bin -b B.bin -O result.bin
+ *     Matrix_calculator [-t threads] -j jobs | -l socket
+ *     Matrix_calculator [-t threads] -e expression [-i input.txt] [-o result.txt | -O result.bin]
+ *
+ * -a and -b read the binary or the Matrix Market format instead (see
+ * matrix_io.h). A matrix with at most DENSITY of its elements nonzero,
+ * SPARSE_DENSITY by default, is multiplied in sparse form. -o and -O
+ * write the result to a file rather than standard output, and -A and -B
+ * save the inputs in the binary format. -t overrides the thread count.
+ * -s multiplies with Strassen-Winograd down to blocks of CUTOFF, or of
+ * STRASSEN_CUTOFF for 0.
+ *
+ * -m multiplies binary files out of core, in tiles that take about MEMORY
+ * bytes (with a K, M or G suffix) however large the matrices are.
+ *
+ * -j runs the jobs listed in the file JOBS, or on standard input for -,
+ * and -l those sent to the UNIX socket SOCKET, until killed. See service.h.
+ *
+ * -e computes an expression like "A*B*C", "A'*B" or "A*B + C" over all the
+ * matrices of the input file instead, A being the first. See expression.h.
+ *
+ * The threads are pinned to CPUs, node by node on NUMA machines, unless
+ * $MATRIX_PIN is 0, and what each node computed is reported at the end.
+ *
+ * The element and result types are chosen when building, see
+ * matrix_types.h; the default multiplies int32 into int32.
+ */
+
+#include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include <unistd.h>
+#include <string.h>
 #include <time.h>
-#include <stdbool.h>
+#include <unistd.h>
+#include "expression.h"
+#include "matrix.h"
+#include "matrix_io.h"
+#include "numa.h"
+#include "outofcore.h"
+#include "pool.h"
+#include "scheduler.h"
+#include "service.h"
+#include "sparse.h"
+#include "strassen.h"
 
-int first_matrix[5000][5000];
-int second_matrix[5000][5000];
-int result[5000][5000];
+Matrix first_matrix;
+Matrix second_matrix;
+Sparse first_sparse;
+Sparse second_sparse;
+Matrix result;
 int M, K, N;
 int number_of_threads;
-int pipeline_fd[2];
 
-typedef struct {
-    int i;
-    int j;
-} Task;
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-void sendTask(const Task* task) {
-    write(pipeline_fd[1], task, sizeof(Task));
+void usage(const char *program) {
+    fprintf(stderr, "usage: %s [-t threads] [-s cutoff] [-d density] [-i input.txt | -a A -b B] "
+            "[-o result.txt | -O result.bin] [-A A.bin -B B.bin]\n"
+            "       %s [-t threads] -m memory -a A.bin -b B.bin -O result.bin\n"
+            "       %s [-t threads] -j jobs | -l socket\n"
+            "       %s [-t threads] -e expression [-i input.txt] [-o result.txt | -O result.bin]\n",
+            program, program, program, program);
+    exit(EXIT_FAILURE);
 }
 
-bool receiveTask(Task* task) {
-    if (read(pipeline_fd[0], task, sizeof(Task)) > 0) {
-        return true;
+/* A number of bytes with an optional K, M or G suffix, 0 if malformed. */
+size_t parseSize(const char *text) {
+    char *end;
+    double size = strtod(text, &end);
+    switch (*end) {
+    case 'G': case 'g': size *= 1024;   /* Fall through. */
+    case 'M': case 'm': size *= 1024;   /* Fall through. */
+    case 'K': case 'k': size *= 1024; end++; break;
     }
-    return false;
+    return *end || size < 0 ? 0 : (size_t)size;
 }
 
-void *threadFunction(void *arg) {
-    Task task;
-    while (receiveTask(&task)) {
-        if (task.i == -1 && task.j == -1) { // Check for termination signal
-            break;
-        }
+void multiplyFiles(const char *first, const char *second, const char *output, size_t memory) {
+    const GemmKernel *kernel = selectKernel();
+    OutOfCoreStats stats;
+    printf("Number of threads used: %d\n", number_of_threads);
+    printf("Kernel used: %s (%s -> %s)\n", kernel->name,
+           element_types[ELEM_TYPE].name, element_types[ACC_TYPE].name);
+    /* A multiplication per tile, all on the same threads. */
+    poolStart(number_of_threads);
+    double start = now();
+    if (multiplyOutOfCore(kernel, first, second, output, number_of_threads, memory, &stats) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    double elapsed = now() - start;
+    poolStop();
+    printf("Out of core in %dx%d tiles, %.1f MB of them, %.6f seconds waiting for I/O\n",
+           stats.tile, stats.tile, stats.buffer_bytes / 1048576.0, stats.io_wait);
+    printf("Taken time for calculating the multplication of two given matrises: %.6f seconds\n", elapsed);
+}
 
-        int sum = 0;
-        for (int k = 0; k < K; ++k) {
-            sum += first_matrix[task.i][k] * second_matrix[k][task.j];
-        }
-        result[task.i][task.j] = sum;
+/* Loads a matrix in the binary format into DENSE, or one in the Matrix Market format into SPARSE. */
+int loadOperand(const char *path, Matrix *dense, Sparse *sparse) {
+    return isMarket(path) ? loadMarket(path, sparse) : loadBinary(path, dense);
+}
+
+int saveOperand(const char *path, const Matrix *dense, const Sparse *sparse) {
+    if (dense->data) {
+        return storeBinary(path, dense);
+    }
+    Matrix copy;
+    if (sparseToDense(&copy, sparse) != 0) {
+        fprintf(stderr, "Cannot allocate a %dx%d matrix\n", sparse->rows, sparse->cols);
+        return -1;
     }
-    return NULL;
+    int status = storeBinary(path, &copy);
+    matrixDestroy(&copy);
+    return status;
 }
 
-void distributeTasks() {
-    for (int i = 0; i < M; ++i) {
-        for (int j = 0; j < N; ++j) {
-            Task task = {i, j};
-            sendTask(&task);
+/*
+ * Leaves an operand in sparse form if at most DENSITY of its elements are
+ * nonzero, and in dense form otherwise, converting it when it was loaded
+ * in the other. Sets FRACTION to the fraction of nonzeros and returns
+ * whether the operand is sparse.
+ */
+int chooseForm(Matrix *dense, Sparse *sparse, double density, double *fraction) {
+    if (dense->data) {
+        *fraction = (double)countNonzeros(dense) / ((double)dense->rows * dense->cols);
+        if (*fraction > density) {
+            return 0;
+        }
+        if (sparseFromDense(sparse, dense) != 0) {
+            fprintf(stderr, "Cannot allocate a sparse %dx%d matrix\n", dense->rows, dense->cols);
+            exit(EXIT_FAILURE);
         }
+        matrixDestroy(dense);
+        return 1;
     }
-    Task endTask = {-1, -1}; // Termination signal
-    for (int i = 0; i < number_of_threads; ++i) {
-        sendTask(&endTask);
+    *fraction = (double)sparse->nnz / ((double)sparse->rows * sparse->cols);
+    if (*fraction <= density) {
+        return 1;
     }
+    if (sparseToDense(dense, sparse) != 0) {
+        fprintf(stderr, "Cannot allocate a %dx%d matrix\n", sparse->rows, sparse->cols);
+        exit(EXIT_FAILURE);
+    }
+    sparseDestroy(sparse);
+    return 0;
 }
 
-int main(int argc, char *argv[]) {
-    FILE *file = fopen("input_matrix.txt", "r");
+/* Writes the result to OUTPUT_BINARY, OUTPUT or standard output. Returns the time taken. */
+double storeResult(const char *output, const char *output_binary) {
+    double store_start = now();
+    int stored;
+    if (output_binary) {
+        stored = storeBinary(output_binary, &result);
+    } else if (output) {
+        FILE *file = fopen(output, "w");
+        if (!file) {
+            perror(output);
+            exit(EXIT_FAILURE);
+        }
+        stored = storeText(file, &result);
+        if (fclose(file) != 0) {
+            stored = -1;
+        }
+    } else {
+        printf("The Result Matrix: \n");
+        stored = storeText(stdout, &result);
+        fflush(stdout);
+    }
+    double store_time = now() - store_start;
+    if (stored != 0) {
+        fprintf(stderr, "Cannot write the result\n");
+        exit(EXIT_FAILURE);
+    }
+    return store_time;
+}
 
-    fscanf(file, "%d", &number_of_threads);
-    fscanf(file, "%d %d", &M, &K);
+/* Computes an expression over all the matrices of INPUT, see expression.h. */
+void multiplyExpression(const char *input, const char *text, const char *output, const char *output_binary,
+                        int threads_option) {
+    Expression expression;
+    ExpressionStats stats;
+    Matrix operands[TEXT_MAX_MATRICES];
+    int count;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (parseExpression(text, &expression) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    double load_start = now();
+    if (loadMatrices(input, cores > 0 ? cores : 1, &number_of_threads, operands, TEXT_MAX_MATRICES, &count) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    double load_time = now() - load_start;
+    if (threads_option > 0) {
+        number_of_threads = threads_option;
+    }
     printf("Number of threads used: %d\n", number_of_threads);
-    printf("The dimension of the first matrix: %d %d\n", M, K);
+    for (int i = 0; i < count; ++i) {
+        printf("The dimension of matrix %c: %d %d\n", 'A' + i, operands[i].rows, operands[i].cols);
+    }
+    const GemmKernel *kernel = selectKernel();
+    printf("Kernel used: %s (%s -> %s)\n", kernel->name,
+           element_types[ELEM_TYPE].name, element_types[ACC_TYPE].name);
 
-    for (int i = 0; i < M; i++) {
-        for (int j = 0; j < K; j++) {
-            fscanf(file, "%d", &first_matrix[i][j]);
-        }
+    double compute_start = now();
+    if (evaluateExpression(kernel, &expression, operands, count, number_of_threads, &result, &stats) != 0) {
+        exit(EXIT_FAILURE);
     }
+    double compute_time = now() - compute_start;
+    printf("Computed as %s, %.0f multiply-adds (%.0f left to right)\n", stats.order,
+           stats.multiply_adds, stats.left_to_right);
+    double store_time = storeResult(output, output_binary);
 
-    fscanf(file, "%d %d", &K, &N);
-    printf("The dimension of the second matrix: %d %d\n", K, N);
+    printf("Load time: %.6f seconds\n", load_time);
+    printf("Taken time for calculating the expression: %.6f seconds\n", compute_time);
+    printf("Store time: %.6f seconds\n", store_time);
+    for (int i = 0; i < count; ++i) {
+        matrixDestroy(&operands[i]);
+    }
+    matrixDestroy(&result);
+}
 
-    for (int i = 0; i < K; i++) {
-        for (int j = 0; j < N; j++) {
-            fscanf(file, "%d", &second_matrix[i][j]);
+/* Starts the threads once and runs jobs on them until the input ends. */
+void serve(const char *jobs, const char *socket_path) {
+    int status;
+    if (poolStart(number_of_threads) != 0) {
+        fprintf(stderr, "Cannot start the threads\n");
+        exit(EXIT_FAILURE);
+    }
+    if (socket_path) {
+        status = serveSocket(socket_path, number_of_threads);
+    } else {
+        int fd = strcmp(jobs, "-") == 0 ? STDIN_FILENO : open(jobs, O_RDONLY);
+        if (fd < 0) {
+            perror(jobs);
+            exit(EXIT_FAILURE);
         }
+        status = serveStream(fd, STDOUT_FILENO, number_of_threads);
     }
+    poolStop();
+    if (status != 0) {
+        exit(EXIT_FAILURE);
+    }
+}
 
-    fclose(file);
-
-    struct timespec starter, ender;
-    clock_gettime(CLOCK_MONOTONIC, &starter);
+/*
+ * Prints what the threads of each node computed and the rate at which they
+ * went through A, B and C, counting every tile as reading its panels.
+ */
+void reportNodes(const NodeTraffic *traffic, double elapsed) {
+    for (int node = 0; node < numaNodes(); ++node) {
+        if (traffic->tiles[node] == 0) {
+            continue;
+        }
+        printf("Node %d: %ld tiles (%ld from other nodes), %.1f MB, %.2f GB/s", node,
+               traffic->tiles[node], traffic->stolen[node], traffic->bytes[node] / 1e6,
+               elapsed > 0 ? traffic->bytes[node] / elapsed / 1e9 : 0);
+        double a_local = numaLocalFraction(&first_matrix, node);
+        double c_local = numaLocalFraction(&result, node);
+        if (a_local >= 0 && c_local >= 0) {
+            printf(", %.0f%% of A and %.0f%% of C local", 100 * a_local, 100 * c_local);
+        }
+        printf("\n");
+    }
+}
 
-    if (pipe(pipeline_fd) == -1) {
-        perror("Pipe creation failed");
-        exit(EXIT_FAILURE);
+int main(int argc, char *argv[]) {
+    const char *input = "input_matrix.txt";
+    const char *first_binary = NULL, *second_binary = NULL;
+    const char *output = NULL, *output_binary = NULL;
+    const char *save_first = NULL, *save_second = NULL;
+    int threads_option = 0;
+    int cutoff = -1;
+    double density = SPARSE_DENSITY;
+    size_t memory = 0;
+    const char *jobs = NULL, *socket_path = NULL;
+    const char *expression = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:s:d:m:i:a:b:o:O:A:B:j:l:e:")) != -1) {
+        switch (opt) {
+        case 't': threads_option = atoi(optarg); break;
+        case 's': cutoff = atoi(optarg) > 0 ? atoi(optarg) : STRASSEN_CUTOFF; break;
+        case 'd': density = atof(optarg); break;
+        case 'm': memory = parseSize(optarg); if (!memory) usage(argv[0]); break;
+        case 'i': input = optarg; break;
+        case 'a': first_binary = optarg; break;
+        case 'b': second_binary = optarg; break;
+        case 'o': output = optarg; break;
+        case 'O': output_binary = optarg; break;
+        case 'A': save_first = optarg; break;
+        case 'B': save_second = optarg; break;
+        case 'j': jobs = optarg; break;
+        case 'l': socket_path = optarg; break;
+        case 'e': expression = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc || !first_binary != !second_binary || (threads_option < 0)) {
+        usage(argv[0]);
     }
 
-    pthread_t threads[number_of_threads];
-    for (int i = 0; i < number_of_threads; ++i) {
-        if (pthread_create(&threads[i], NULL, threadFunction, NULL) != 0) {
-            perror("pthread_create");
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (expression) {
+        if (first_binary || memory || jobs || socket_path || save_first || save_second) {
+            usage(argv[0]);
+        }
+        if (cutoff > 0) {
+            fprintf(stderr, "Strassen-Winograd is not used for expressions, ignoring -s\n");
+        }
+        multiplyExpression(input, expression, output, output_binary, threads_option);
+        return 0;
+    }
+    if (jobs || socket_path) {
+        if (jobs && socket_path) {
+            usage(argv[0]);
+        }
+        number_of_threads = threads_option > 0 ? threads_option : cores > 0 ? cores : 1;
+        serve(jobs, socket_path);
+        return 0;
+    }
+    if (memory) {
+        if (!first_binary || !output_binary) {
+            usage(argv[0]);
+        }
+        number_of_threads = threads_option > 0 ? threads_option : cores > 0 ? cores : 1;
+        multiplyFiles(first_binary, second_binary, output_binary, memory);
+        return 0;
+    }
+    double load_start = now();
+    if (first_binary) {
+        if (loadOperand(first_binary, &first_matrix, &first_sparse) != 0 ||
+            loadOperand(second_binary, &second_matrix, &second_sparse) != 0) {
             exit(EXIT_FAILURE);
         }
+        number_of_threads = cores > 0 ? cores : 1;
+    } else if (loadText(input, cores > 0 ? cores : 1, &number_of_threads, &first_matrix, &second_matrix) != 0) {
+        exit(EXIT_FAILURE);
     }
+    double load_time = now() - load_start;
+    if (threads_option > 0) {
+        number_of_threads = threads_option;
+    }
+    M = first_matrix.data ? first_matrix.rows : first_sparse.rows;
+    K = first_matrix.data ? first_matrix.cols : first_sparse.cols;
+    int second_rows = second_matrix.data ? second_matrix.rows : second_sparse.rows;
+    N = second_matrix.data ? second_matrix.cols : second_sparse.cols;
+    printf("Number of threads used: %d\n", number_of_threads);
+    printf("The dimension of the first matrix: %d %d\n", M, K);
+    printf("The dimension of the second matrix: %d %d\n", second_rows, N);
+    if (second_rows != K) {
+        fprintf(stderr, "Cannot multiply a %dx%d matrix by a %dx%d one\n", M, K, second_rows, N);
+        exit(EXIT_FAILURE);
+    }
+    if ((save_first && saveOperand(save_first, &first_matrix, &first_sparse) != 0) ||
+        (save_second && saveOperand(save_second, &second_matrix, &second_sparse) != 0)) {
+        exit(EXIT_FAILURE);
+    }
+    double first_fraction, second_fraction;
+    int first_is_sparse = chooseForm(&first_matrix, &first_sparse, density, &first_fraction);
+    int second_is_sparse = chooseForm(&second_matrix, &second_sparse, density, &second_fraction);
+    printf("Nonzero fraction of the matrices: %.4f %.4f\n", first_fraction, second_fraction);
 
-    distributeTasks();
-
-    for (int i = 0; i < number_of_threads; ++i) {
-        pthread_join(threads[i], NULL);
+    if (matrixCreate(&result, M, N, ACC_TYPE) != 0) {
+        fprintf(stderr, "Cannot allocate a %dx%d matrix\n", M, N);
+        exit(EXIT_FAILURE);
     }
+    numaPlaceRows(&result);
 
-    close(pipeline_fd[0]);
-    close(pipeline_fd[1]);
+    const GemmKernel *kernel = selectKernel();
+    printf("Kernel used: %s (%s -> %s)\n",
+           first_is_sparse && second_is_sparse ? "sparse x sparse" :
+           first_is_sparse ? "sparse x dense" : second_is_sparse ? "dense x sparse" : kernel->name,
+           element_types[ELEM_TYPE].name, element_types[ACC_TYPE].name);
+    if (first_is_sparse || second_is_sparse) {
+        cutoff = -1;
+    }
+    if (cutoff > 0 && !ELEM_IS_ACC) {
+        fprintf(stderr, "Strassen-Winograd needs inputs as wide as the result, ignoring -s\n");
+        cutoff = -1;
+    }
+    if (cutoff > 0) {
+        printf("Strassen-Winograd down to %dx%d blocks\n", cutoff, cutoff);
+    }
 
-    printf("The Result Matrix: \n");
-    for (int i = 0; i < M; ++i) {
-        for (int j = 0; j < N; j++) {
-            printf("%d\t", result[i][j]);
-        }
-        printf("\n");
+    double compute_start = now();
+    NodeTraffic traffic = {{0}};
+    Multiplication job = {kernel, M, N, K, first_matrix.data, first_matrix.stride,
+                          second_matrix.data, second_matrix.stride, result.data, result.stride, &traffic};
+    if (first_is_sparse && second_is_sparse) {
+        multiplySparseSparse(&first_sparse, &second_sparse, &result, number_of_threads);
+    } else if (first_is_sparse) {
+        multiplySparseDense(&first_sparse, &second_matrix, &result, number_of_threads);
+    } else if (second_is_sparse) {
+        multiplyDenseSparse(&first_matrix, &second_sparse, &result, number_of_threads);
+    } else if (cutoff > 0) {
+        multiplyStrassen(&job, number_of_threads, cutoff);
+    } else {
+        multiplyParallel(&job, number_of_threads);
     }
-    clock_gettime(CLOCK_MONOTONIC, &ender);
+    double compute_time = now() - compute_start;
 
-    double taken_time = (ender.tv_sec - starter.tv_sec) + (ender.tv_nsec - starter.tv_nsec) / 1e9;
-    printf("Taken time for calculating the multplication of two given matrises: %.6f seconds\n", taken_time);
+    double store_time = storeResult(output, output_binary);
 
+    printf("Load time: %.6f seconds\n", load_time);
+    printf("Taken time for calculating the multplication of two given matrises: %.6f seconds\n", compute_time);
+    printf("Store time: %.6f seconds\n", store_time);
+    reportNodes(&traffic, compute_time);
+
+    matrixDestroy(&first_matrix);
+    matrixDestroy(&second_matrix);
+    sparseDestroy(&first_sparse);
+    sparseDestroy(&second_sparse);
+    matrixDestroy(&result);
     return 0;
-}
\ No newline at end of file
+}
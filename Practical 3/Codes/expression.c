@@ -0,0 +1,207 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include "expression.h"
+#include "numa.h"
+#include "scheduler.h"
+
+typedef struct {
+    const GemmKernel *kernel;
+    const Expression *expression;
+    const Matrix *operands;
+    int threads;
+    int rows[EXPRESSION_MAX_FACTORS];   /* Of each factor, transposed if it is. */
+    int cols[EXPRESSION_MAX_FACTORS];
+    int split[EXPRESSION_MAX_FACTORS][EXPRESSION_MAX_FACTORS];  /* Last factor of the left half. */
+} Chain;
+
+static const char *skipBlanks(const char *p) {
+    while (isspace((unsigned char)*p)) {
+        p++;
+    }
+    return p;
+}
+
+static const char *parseFactor(const char *p, int *operand, int *transposed) {
+    p = skipBlanks(p);
+    if (*p < 'A' || *p > 'Z') {
+        return NULL;
+    }
+    *operand = *p++ - 'A';
+    p = skipBlanks(p);
+    *transposed = *p == '\'';
+    return *transposed ? p + 1 : p;
+}
+
+int parseExpression(const char *text, Expression *expression) {
+    const char *p = text;
+    int transposed;
+    expression->factors = 0;
+    expression->addend = -1;
+    for (;;) {
+        int i = expression->factors;
+        if (i == EXPRESSION_MAX_FACTORS ||
+            !(p = parseFactor(p, &expression->operands[i], &expression->transposed[i]))) {
+            goto bad;
+        }
+        expression->factors++;
+        p = skipBlanks(p);
+        if (*p != '*') {
+            break;
+        }
+        p++;
+    }
+    if (*p == '+') {
+        if (!(p = parseFactor(p + 1, &expression->addend, &transposed)) || transposed) {
+            goto bad;
+        }
+        p = skipBlanks(p);
+    }
+    if (*p == '\0' && expression->factors >= 2) {
+        return 0;
+    }
+bad:
+    fprintf(stderr, "%s: not a product of matrices A to Z, plus at most one more not transposed\n", text);
+    return -1;
+}
+
+/* Appends how factors I to J are multiplied to ORDER. */
+static void describe(const Chain *chain, int i, int j, int outermost, char *order) {
+    if (i == j) {
+        size_t length = strlen(order);
+        order[length++] = 'A' + chain->expression->operands[i];
+        if (chain->expression->transposed[i]) {
+            order[length++] = '\'';
+        }
+        order[length] = '\0';
+        return;
+    }
+    if (!outermost) {
+        strcat(order, "(");
+    }
+    describe(chain, i, chain->split[i][j], 0, order);
+    strcat(order, "*");
+    describe(chain, chain->split[i][j] + 1, j, 0, order);
+    if (!outermost) {
+        strcat(order, ")");
+    }
+}
+
+/* Computes factors I to J into OUT, plus ADD when it is not NULL. Returns 0 or -1. */
+static int product(const Chain *chain, int i, int j, Matrix *out, const Matrix *add) {
+    const Expression *expression = chain->expression;
+    int s = chain->split[i][j];
+    int first[2] = {i, s + 1}, last[2] = {s, j};
+    Matrix parts[2] = {{0}};
+    const Matrix *halves[2];
+    int transposed[2] = {0, 0}, status = 0;
+
+    /* Single factors are used as they are, longer products first go into a matrix of their own. */
+    for (int h = 0; h < 2; ++h) {
+        if (first[h] == last[h]) {
+            halves[h] = &chain->operands[expression->operands[first[h]]];
+            transposed[h] = expression->transposed[first[h]];
+            continue;
+        }
+        if (matrixCreate(&parts[h], chain->rows[first[h]], chain->cols[last[h]], ACC_TYPE) != 0) {
+            fprintf(stderr, "Cannot allocate a %dx%d matrix\n", chain->rows[first[h]], chain->cols[last[h]]);
+            status = -1;
+            break;
+        }
+        halves[h] = &parts[h];
+        if ((status = product(chain, first[h], last[h], &parts[h], NULL)) != 0) {
+            break;
+        }
+    }
+    if (status == 0) {
+        Multiplication job = {chain->kernel, chain->rows[i], chain->cols[j], chain->cols[s],
+                              halves[0]->data, halves[0]->stride, halves[1]->data, halves[1]->stride,
+                              out->data, out->stride, NULL, transposed[0], transposed[1],
+                              add ? add->data : NULL, add ? add->stride : 0};
+        multiplyParallel(&job, chain->threads);
+    }
+    for (int h = 0; h < 2; ++h) {
+        if (parts[h].data) {
+            matrixDestroy(&parts[h]);
+        }
+    }
+    return status;
+}
+
+int evaluateExpression(const GemmKernel *kernel, const Expression *expression, const Matrix *operands,
+                       int count, int threads, Matrix *result, ExpressionStats *stats) {
+    Chain chain = {kernel, expression, operands, threads};
+    int n = expression->factors;
+    for (int i = 0; i < n; ++i) {
+        int o = expression->operands[i], t = expression->transposed[i];
+        if (o >= count) {
+            fprintf(stderr, "There is no matrix %c in the input\n", 'A' + o);
+            return -1;
+        }
+        chain.rows[i] = t ? operands[o].cols : operands[o].rows;
+        chain.cols[i] = t ? operands[o].rows : operands[o].cols;
+        if (i > 0 && chain.rows[i] != chain.cols[i - 1]) {
+            fprintf(stderr, "Cannot multiply a %dx%d matrix by a %dx%d one\n",
+                    chain.rows[i - 1], chain.cols[i - 1], chain.rows[i], chain.cols[i]);
+            return -1;
+        }
+    }
+    const Matrix *add = NULL;
+    if (expression->addend >= 0) {
+        if (expression->addend >= count) {
+            fprintf(stderr, "There is no matrix %c in the input\n", 'A' + expression->addend);
+            return -1;
+        }
+        add = &operands[expression->addend];
+        if (add->rows != chain.rows[0] || add->cols != chain.cols[n - 1]) {
+            fprintf(stderr, "Cannot add a %dx%d matrix to a %dx%d one\n",
+                    add->rows, add->cols, chain.rows[0], chain.cols[n - 1]);
+            return -1;
+        }
+    }
+    if (n > 2 && !ELEM_IS_ACC) {
+        fprintf(stderr, "Products of %s matrices cannot be multiplied further into %s\n",
+                element_types[ELEM_TYPE].name, element_types[ACC_TYPE].name);
+        return -1;
+    }
+
+    /* COST[I][J] is the fewest multiply-adds for the product of factors I to J. */
+    double cost[EXPRESSION_MAX_FACTORS][EXPRESSION_MAX_FACTORS] = {{0}};
+    for (int i = 0; i < n; ++i) {
+        cost[i][i] = 0;
+    }
+    for (int length = 2; length <= n; ++length) {
+        for (int i = 0; i + length <= n; ++i) {
+            int j = i + length - 1;
+            cost[i][j] = -1;
+            for (int s = i; s < j; ++s) {
+                double c = cost[i][s] + cost[s + 1][j] + (double)chain.rows[i] * chain.cols[s] * chain.cols[j];
+                if (cost[i][j] < 0 || c < cost[i][j]) {
+                    cost[i][j] = c;
+                    chain.split[i][j] = s;
+                }
+            }
+        }
+    }
+    stats->multiply_adds = cost[0][n - 1];
+    stats->left_to_right = 0;
+    for (int s = 1; s < n; ++s) {
+        stats->left_to_right += (double)chain.rows[0] * chain.rows[s] * chain.cols[s];
+    }
+    stats->order[0] = '\0';
+    describe(&chain, 0, n - 1, 1, stats->order);
+    if (add) {
+        snprintf(stats->order + strlen(stats->order), 5, " + %c", 'A' + expression->addend);
+    }
+
+    if (matrixCreate(result, chain.rows[0], chain.cols[n - 1], ACC_TYPE) != 0) {
+        fprintf(stderr, "Cannot allocate a %dx%d matrix\n", chain.rows[0], chain.cols[n - 1]);
+        return -1;
+    }
+    numaPlaceRows(result);
+    if (product(&chain, 0, n - 1, result, add) != 0) {
+        matrixDestroy(result);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,49 @@
+#ifndef EXPRESSION_H
+#define EXPRESSION_H
+
+#include "gemm.h"
+#include "matrix.h"
+#include "matrix_io.h"
+
+/*
+ * Expressions over the matrices of an input file, named A, B, C and so on
+ * in the order they come in: a product of two or more of them, any of them
+ * transposed by a following ', and optionally one more added to it.
+ *
+ *     A*B*C    A'*B    A*B'*C + D
+ *
+ * Transposed matrices are read in place and the added one is the starting
+ * value of the last product, so neither is copied. Products of three or
+ * more are done in the order that takes the fewest multiply-adds, found by
+ * dynamic programming over their dimensions. The products in between are
+ * of acc_t and multiplied further as elem_t, so they need the two to be
+ * the same.
+ */
+#define EXPRESSION_MAX_FACTORS TEXT_MAX_MATRICES
+
+typedef struct {
+    int factors;
+    int operands[EXPRESSION_MAX_FACTORS];   /* 0 for A and so on. */
+    int transposed[EXPRESSION_MAX_FACTORS];
+    int addend;                             /* -1 if there is none. */
+} Expression;
+
+/* What evaluating an expression did, for the report. */
+typedef struct {
+    double multiply_adds;
+    double left_to_right;   /* Multiply-adds in the written order. */
+    char order[6 * EXPRESSION_MAX_FACTORS];  /* Like "(A*B)*C". */
+} ExpressionStats;
+
+/* Returns 0, or -1 after saying what is wrong with TEXT. */
+int parseExpression(const char *text, Expression *expression);
+
+/*
+ * Creates RESULT and computes EXPRESSION into it, over the COUNT matrices
+ * OPERANDS, THREADS threads doing each product. Returns 0, or -1 after
+ * saying why not.
+ */
+int evaluateExpression(const GemmKernel *kernel, const Expression *expression, const Matrix *operands,
+                       int count, int threads, Matrix *result, ExpressionStats *stats);
+
+#endif
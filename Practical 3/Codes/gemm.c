@@ -0,0 +1,586 @@
+#include "gemm.h"
+#include <immintrin.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Cache blocking: a KC x NC panel of B stays in L2/L3 while MC x KC panels
+ * of A, small enough for L2, stream past it. Each micro-kernel call then
+ * reads an MR x KC sliver of A and a KC x NR sliver of B from L1.
+ */
+#define KC 256
+#define MC 96
+#define NC 2048
+
+/* Large enough for the biggest register block of any kernel. */
+#define MAX_MR 8
+#define MAX_NR 32
+
+static __thread pack_t *packed_a;
+static __thread pack_t *packed_b;
+
+/* Widening products are formed in the accumulator type. */
+static void microScalar(int kp, const pack_t *a, const pack_t *b, acc_t *c, int ldc) {
+    acc_t acc[4][4] = {{0}};
+    for (int p = 0; p < kp; ++p) {
+        for (int r = 0; r < 4; ++r) {
+            for (int s = 0; s < 4; ++s) {
+                for (int q = 0; q < KPACK; ++q) {
+                    acc[r][s] += (acc_t)a[r * KPACK + q] * b[s * KPACK + q];
+                }
+            }
+        }
+        a += 4 * KPACK;
+        b += 4 * KPACK;
+    }
+    for (int r = 0; r < 4; ++r) {
+        for (int s = 0; s < 4; ++s) {
+            c[r * ldc + s] += acc[r][s];
+        }
+    }
+}
+
+static int haveAvx2(void) {
+    return __builtin_cpu_supports("avx2");
+}
+
+static int haveAvx512(void) {
+    return __builtin_cpu_supports("avx512f");
+}
+
+#if defined(TYPES_INT32)
+
+__attribute__((target("avx2")))
+static void microAvx2(int kc, const int *a, const int *b, int *c, int ldc) {
+    __m256i acc[6][2];
+    for (int r = 0; r < 6; ++r) {
+        acc[r][0] = _mm256_setzero_si256();
+        acc[r][1] = _mm256_setzero_si256();
+    }
+    for (int p = 0; p < kc; ++p) {
+        __m256i b0 = _mm256_load_si256((const __m256i *)b);
+        __m256i b1 = _mm256_load_si256((const __m256i *)(b + 8));
+#pragma GCC unroll 6
+        for (int r = 0; r < 6; ++r) {
+            __m256i ar = _mm256_set1_epi32(a[r]);
+            acc[r][0] = _mm256_add_epi32(acc[r][0], _mm256_mullo_epi32(ar, b0));
+            acc[r][1] = _mm256_add_epi32(acc[r][1], _mm256_mullo_epi32(ar, b1));
+        }
+        a += 6;
+        b += 16;
+    }
+    for (int r = 0; r < 6; ++r) {
+        __m256i *row = (__m256i *)(c + r * ldc);
+        _mm256_storeu_si256(row, _mm256_add_epi32(_mm256_loadu_si256(row), acc[r][0]));
+        _mm256_storeu_si256(row + 1, _mm256_add_epi32(_mm256_loadu_si256(row + 1), acc[r][1]));
+    }
+}
+
+__attribute__((target("avx512f")))
+static void microAvx512(int kc, const int *a, const int *b, int *c, int ldc) {
+    __m512i acc[8][2];
+    for (int r = 0; r < 8; ++r) {
+        acc[r][0] = _mm512_setzero_si512();
+        acc[r][1] = _mm512_setzero_si512();
+    }
+    for (int p = 0; p < kc; ++p) {
+        __m512i b0 = _mm512_load_si512(b);
+        __m512i b1 = _mm512_load_si512(b + 16);
+#pragma GCC unroll 8
+        for (int r = 0; r < 8; ++r) {
+            __m512i ar = _mm512_set1_epi32(a[r]);
+            acc[r][0] = _mm512_add_epi32(acc[r][0], _mm512_mullo_epi32(ar, b0));
+            acc[r][1] = _mm512_add_epi32(acc[r][1], _mm512_mullo_epi32(ar, b1));
+        }
+        a += 8;
+        b += 32;
+    }
+    for (int r = 0; r < 8; ++r) {
+        int *row = c + r * ldc;
+        _mm512_storeu_si512(row, _mm512_add_epi32(_mm512_loadu_si512(row), acc[r][0]));
+        _mm512_storeu_si512(row + 16, _mm512_add_epi32(_mm512_loadu_si512(row + 16), acc[r][1]));
+    }
+}
+
+static const GemmKernel scalar_kernel = {"scalar", 4, 4, microScalar, NULL};
+static const GemmKernel avx2_kernel = {"avx2", 6, 16, microAvx2, haveAvx2};
+static const GemmKernel avx512_kernel = {"avx512", 8, 32, microAvx512, haveAvx512};
+
+/* Fastest first. */
+const GemmKernel *const gemm_kernels[] = {&avx512_kernel, &avx2_kernel, &scalar_kernel, NULL};
+
+#elif defined(TYPES_INT32_64)
+
+/*
+ * The packed int32 are sign-extended into 64-bit lanes, whose low halves
+ * vpmuldq multiplies into full 64-bit products.
+ */
+__attribute__((target("avx2")))
+static void microAvx2(int kc, const int32_t *a, const int32_t *b, int64_t *c, int ldc) {
+    __m256i acc[6][2];
+    for (int r = 0; r < 6; ++r) {
+        acc[r][0] = _mm256_setzero_si256();
+        acc[r][1] = _mm256_setzero_si256();
+    }
+    for (int p = 0; p < kc; ++p) {
+        __m256i b0 = _mm256_cvtepi32_epi64(_mm_load_si128((const __m128i *)b));
+        __m256i b1 = _mm256_cvtepi32_epi64(_mm_load_si128((const __m128i *)(b + 4)));
+#pragma GCC unroll 6
+        for (int r = 0; r < 6; ++r) {
+            __m256i ar = _mm256_set1_epi64x(a[r]);
+            acc[r][0] = _mm256_add_epi64(acc[r][0], _mm256_mul_epi32(ar, b0));
+            acc[r][1] = _mm256_add_epi64(acc[r][1], _mm256_mul_epi32(ar, b1));
+        }
+        a += 6;
+        b += 8;
+    }
+    for (int r = 0; r < 6; ++r) {
+        __m256i *row = (__m256i *)(c + r * ldc);
+        _mm256_storeu_si256(row, _mm256_add_epi64(_mm256_loadu_si256(row), acc[r][0]));
+        _mm256_storeu_si256(row + 1, _mm256_add_epi64(_mm256_loadu_si256(row + 1), acc[r][1]));
+    }
+}
+
+__attribute__((target("avx512f")))
+static void microAvx512(int kc, const int32_t *a, const int32_t *b, int64_t *c, int ldc) {
+    __m512i acc[8][2];
+    for (int r = 0; r < 8; ++r) {
+        acc[r][0] = _mm512_setzero_si512();
+        acc[r][1] = _mm512_setzero_si512();
+    }
+    for (int p = 0; p < kc; ++p) {
+        __m512i b0 = _mm512_cvtepi32_epi64(_mm256_load_si256((const __m256i *)b));
+        __m512i b1 = _mm512_cvtepi32_epi64(_mm256_load_si256((const __m256i *)(b + 8)));
+#pragma GCC unroll 8
+        for (int r = 0; r < 8; ++r) {
+            __m512i ar = _mm512_set1_epi64(a[r]);
+            acc[r][0] = _mm512_add_epi64(acc[r][0], _mm512_mul_epi32(ar, b0));
+            acc[r][1] = _mm512_add_epi64(acc[r][1], _mm512_mul_epi32(ar, b1));
+        }
+        a += 8;
+        b += 16;
+    }
+    for (int r = 0; r < 8; ++r) {
+        int64_t *row = c + r * ldc;
+        _mm512_storeu_si512(row, _mm512_add_epi64(_mm512_loadu_si512(row), acc[r][0]));
+        _mm512_storeu_si512(row + 8, _mm512_add_epi64(_mm512_loadu_si512(row + 8), acc[r][1]));
+    }
+}
+
+static const GemmKernel scalar_kernel = {"scalar", 4, 4, microScalar, NULL};
+static const GemmKernel avx2_kernel = {"avx2", 6, 8, microAvx2, haveAvx2};
+static const GemmKernel avx512_kernel = {"avx512", 8, 16, microAvx512, haveAvx512};
+
+const GemmKernel *const gemm_kernels[] = {&avx512_kernel, &avx2_kernel, &scalar_kernel, NULL};
+
+#elif defined(TYPES_INT16) || defined(TYPES_INT8)
+
+/*
+ * Each 32-bit lane of a packed B row holds a pair of elements adjacent in
+ * K. The matching pair of A is broadcast, and vpmaddwd multiplies the pairs
+ * and adds both products into the lane.
+ */
+static int32_t pairAt(const int16_t *a) {
+    int32_t pair;
+    memcpy(&pair, a, sizeof(pair));
+    return pair;
+}
+
+__attribute__((target("avx2")))
+static void microAvx2(int kp, const int16_t *a, const int16_t *b, int32_t *c, int ldc) {
+    __m256i acc[6][2];
+    for (int r = 0; r < 6; ++r) {
+        acc[r][0] = _mm256_setzero_si256();
+        acc[r][1] = _mm256_setzero_si256();
+    }
+    for (int p = 0; p < kp; ++p) {
+        __m256i b0 = _mm256_load_si256((const __m256i *)b);
+        __m256i b1 = _mm256_load_si256((const __m256i *)(b + 16));
+#pragma GCC unroll 6
+        for (int r = 0; r < 6; ++r) {
+            __m256i ar = _mm256_set1_epi32(pairAt(a + 2 * r));
+            acc[r][0] = _mm256_add_epi32(acc[r][0], _mm256_madd_epi16(ar, b0));
+            acc[r][1] = _mm256_add_epi32(acc[r][1], _mm256_madd_epi16(ar, b1));
+        }
+        a += 12;
+        b += 32;
+    }
+    for (int r = 0; r < 6; ++r) {
+        __m256i *row = (__m256i *)(c + r * ldc);
+        _mm256_storeu_si256(row, _mm256_add_epi32(_mm256_loadu_si256(row), acc[r][0]));
+        _mm256_storeu_si256(row + 1, _mm256_add_epi32(_mm256_loadu_si256(row + 1), acc[r][1]));
+    }
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void microAvx512(int kp, const int16_t *a, const int16_t *b, int32_t *c, int ldc) {
+    __m512i acc[8][2];
+    for (int r = 0; r < 8; ++r) {
+        acc[r][0] = _mm512_setzero_si512();
+        acc[r][1] = _mm512_setzero_si512();
+    }
+    for (int p = 0; p < kp; ++p) {
+        __m512i b0 = _mm512_load_si512(b);
+        __m512i b1 = _mm512_load_si512(b + 32);
+#pragma GCC unroll 8
+        for (int r = 0; r < 8; ++r) {
+            __m512i ar = _mm512_set1_epi32(pairAt(a + 2 * r));
+            acc[r][0] = _mm512_add_epi32(acc[r][0], _mm512_madd_epi16(ar, b0));
+            acc[r][1] = _mm512_add_epi32(acc[r][1], _mm512_madd_epi16(ar, b1));
+        }
+        a += 16;
+        b += 64;
+    }
+    for (int r = 0; r < 8; ++r) {
+        int32_t *row = c + r * ldc;
+        _mm512_storeu_si512(row, _mm512_add_epi32(_mm512_loadu_si512(row), acc[r][0]));
+        _mm512_storeu_si512(row + 16, _mm512_add_epi32(_mm512_loadu_si512(row + 16), acc[r][1]));
+    }
+}
+
+/* vpdpwssd does the multiply and both adds in one instruction. */
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+static void microVnni(int kp, const int16_t *a, const int16_t *b, int32_t *c, int ldc) {
+    __m512i acc[8][2];
+    for (int r = 0; r < 8; ++r) {
+        acc[r][0] = _mm512_setzero_si512();
+        acc[r][1] = _mm512_setzero_si512();
+    }
+    for (int p = 0; p < kp; ++p) {
+        __m512i b0 = _mm512_load_si512(b);
+        __m512i b1 = _mm512_load_si512(b + 32);
+#pragma GCC unroll 8
+        for (int r = 0; r < 8; ++r) {
+            __m512i ar = _mm512_set1_epi32(pairAt(a + 2 * r));
+            acc[r][0] = _mm512_dpwssd_epi32(acc[r][0], ar, b0);
+            acc[r][1] = _mm512_dpwssd_epi32(acc[r][1], ar, b1);
+        }
+        a += 16;
+        b += 64;
+    }
+    for (int r = 0; r < 8; ++r) {
+        int32_t *row = c + r * ldc;
+        _mm512_storeu_si512(row, _mm512_add_epi32(_mm512_loadu_si512(row), acc[r][0]));
+        _mm512_storeu_si512(row + 16, _mm512_add_epi32(_mm512_loadu_si512(row + 16), acc[r][1]));
+    }
+}
+
+static int haveAvx512bw(void) {
+    return haveAvx512() && __builtin_cpu_supports("avx512bw");
+}
+
+static int haveVnni(void) {
+    return haveAvx512bw() && __builtin_cpu_supports("avx512vnni");
+}
+
+static const GemmKernel scalar_kernel = {"scalar", 4, 4, microScalar, NULL};
+static const GemmKernel avx2_kernel = {"avx2", 6, 16, microAvx2, haveAvx2};
+static const GemmKernel avx512_kernel = {"avx512", 8, 32, microAvx512, haveAvx512bw};
+static const GemmKernel vnni_kernel = {"vnni", 8, 32, microVnni, haveVnni};
+
+const GemmKernel *const gemm_kernels[] = {&vnni_kernel, &avx512_kernel, &avx2_kernel, &scalar_kernel, NULL};
+
+#elif defined(TYPES_FLOAT)
+
+__attribute__((target("avx2,fma")))
+static void microAvx2(int kc, const float *a, const float *b, float *c, int ldc) {
+    __m256 acc[6][2];
+    for (int r = 0; r < 6; ++r) {
+        acc[r][0] = _mm256_setzero_ps();
+        acc[r][1] = _mm256_setzero_ps();
+    }
+    for (int p = 0; p < kc; ++p) {
+        __m256 b0 = _mm256_load_ps(b);
+        __m256 b1 = _mm256_load_ps(b + 8);
+#pragma GCC unroll 6
+        for (int r = 0; r < 6; ++r) {
+            __m256 ar = _mm256_set1_ps(a[r]);
+            acc[r][0] = _mm256_fmadd_ps(ar, b0, acc[r][0]);
+            acc[r][1] = _mm256_fmadd_ps(ar, b1, acc[r][1]);
+        }
+        a += 6;
+        b += 16;
+    }
+    for (int r = 0; r < 6; ++r) {
+        float *row = c + r * ldc;
+        _mm256_storeu_ps(row, _mm256_add_ps(_mm256_loadu_ps(row), acc[r][0]));
+        _mm256_storeu_ps(row + 8, _mm256_add_ps(_mm256_loadu_ps(row + 8), acc[r][1]));
+    }
+}
+
+__attribute__((target("avx512f")))
+static void microAvx512(int kc, const float *a, const float *b, float *c, int ldc) {
+    __m512 acc[8][2];
+    for (int r = 0; r < 8; ++r) {
+        acc[r][0] = _mm512_setzero_ps();
+        acc[r][1] = _mm512_setzero_ps();
+    }
+    for (int p = 0; p < kc; ++p) {
+        __m512 b0 = _mm512_load_ps(b);
+        __m512 b1 = _mm512_load_ps(b + 16);
+#pragma GCC unroll 8
+        for (int r = 0; r < 8; ++r) {
+            __m512 ar = _mm512_set1_ps(a[r]);
+            acc[r][0] = _mm512_fmadd_ps(ar, b0, acc[r][0]);
+            acc[r][1] = _mm512_fmadd_ps(ar, b1, acc[r][1]);
+        }
+        a += 8;
+        b += 32;
+    }
+    for (int r = 0; r < 8; ++r) {
+        float *row = c + r * ldc;
+        _mm512_storeu_ps(row, _mm512_add_ps(_mm512_loadu_ps(row), acc[r][0]));
+        _mm512_storeu_ps(row + 16, _mm512_add_ps(_mm512_loadu_ps(row + 16), acc[r][1]));
+    }
+}
+
+static int haveFma(void) {
+    return haveAvx2() && __builtin_cpu_supports("fma");
+}
+
+static const GemmKernel scalar_kernel = {"scalar", 4, 4, microScalar, NULL};
+static const GemmKernel avx2_kernel = {"avx2", 6, 16, microAvx2, haveFma};
+static const GemmKernel avx512_kernel = {"avx512", 8, 32, microAvx512, haveAvx512};
+
+const GemmKernel *const gemm_kernels[] = {&avx512_kernel, &avx2_kernel, &scalar_kernel, NULL};
+
+#elif defined(TYPES_DOUBLE)
+
+__attribute__((target("avx2,fma")))
+static void microAvx2(int kc, const double *a, const double *b, double *c, int ldc) {
+    __m256d acc[6][2];
+    for (int r = 0; r < 6; ++r) {
+        acc[r][0] = _mm256_setzero_pd();
+        acc[r][1] = _mm256_setzero_pd();
+    }
+    for (int p = 0; p < kc; ++p) {
+        __m256d b0 = _mm256_load_pd(b);
+        __m256d b1 = _mm256_load_pd(b + 4);
+#pragma GCC unroll 6
+        for (int r = 0; r < 6; ++r) {
+            __m256d ar = _mm256_set1_pd(a[r]);
+            acc[r][0] = _mm256_fmadd_pd(ar, b0, acc[r][0]);
+            acc[r][1] = _mm256_fmadd_pd(ar, b1, acc[r][1]);
+        }
+        a += 6;
+        b += 8;
+    }
+    for (int r = 0; r < 6; ++r) {
+        double *row = c + r * ldc;
+        _mm256_storeu_pd(row, _mm256_add_pd(_mm256_loadu_pd(row), acc[r][0]));
+        _mm256_storeu_pd(row + 4, _mm256_add_pd(_mm256_loadu_pd(row + 4), acc[r][1]));
+    }
+}
+
+__attribute__((target("avx512f")))
+static void microAvx512(int kc, const double *a, const double *b, double *c, int ldc) {
+    __m512d acc[8][2];
+    for (int r = 0; r < 8; ++r) {
+        acc[r][0] = _mm512_setzero_pd();
+        acc[r][1] = _mm512_setzero_pd();
+    }
+    for (int p = 0; p < kc; ++p) {
+        __m512d b0 = _mm512_load_pd(b);
+        __m512d b1 = _mm512_load_pd(b + 8);
+#pragma GCC unroll 8
+        for (int r = 0; r < 8; ++r) {
+            __m512d ar = _mm512_set1_pd(a[r]);
+            acc[r][0] = _mm512_fmadd_pd(ar, b0, acc[r][0]);
+            acc[r][1] = _mm512_fmadd_pd(ar, b1, acc[r][1]);
+        }
+        a += 8;
+        b += 16;
+    }
+    for (int r = 0; r < 8; ++r) {
+        double *row = c + r * ldc;
+        _mm512_storeu_pd(row, _mm512_add_pd(_mm512_loadu_pd(row), acc[r][0]));
+        _mm512_storeu_pd(row + 8, _mm512_add_pd(_mm512_loadu_pd(row + 8), acc[r][1]));
+    }
+}
+
+static int haveFma(void) {
+    return haveAvx2() && __builtin_cpu_supports("fma");
+}
+
+static const GemmKernel scalar_kernel = {"scalar", 4, 4, microScalar, NULL};
+static const GemmKernel avx2_kernel = {"avx2", 6, 8, microAvx2, haveFma};
+static const GemmKernel avx512_kernel = {"avx512", 8, 16, microAvx512, haveAvx512};
+
+const GemmKernel *const gemm_kernels[] = {&avx512_kernel, &avx2_kernel, &scalar_kernel, NULL};
+
+#endif
+
+int kernelSupported(const GemmKernel *kernel) {
+    __builtin_cpu_init();
+    return !kernel->supported || kernel->supported();
+}
+
+const GemmKernel *findKernel(const char *name) {
+    for (int i = 0; gemm_kernels[i]; ++i) {
+        if (strcmp(gemm_kernels[i]->name, name) == 0) {
+            return kernelSupported(gemm_kernels[i]) ? gemm_kernels[i] : NULL;
+        }
+    }
+    return NULL;
+}
+
+const GemmKernel *selectKernel(void) {
+    const char *name = getenv("MATRIX_KERNEL");
+    if (name && findKernel(name)) {
+        return findKernel(name);
+    }
+    for (int i = 0;; ++i) {
+        if (kernelSupported(gemm_kernels[i])) {
+            return gemm_kernels[i];
+        }
+    }
+}
+
+/*
+ * Packs rows [0, m) x columns [0, kc) of A into slivers of MR rows, stored
+ * column by column, KPACK columns at a time. Rows past M and columns past
+ * KC are zero so edge slivers need no special case. A transposed A is read
+ * down its columns instead, which packing costs nothing more than rows.
+ */
+static void packA(int mr, int m, int kc, const elem_t *a, int lda, int transposed, pack_t *dst) {
+    for (int i = 0; i < m; i += mr) {
+        int rows = m - i < mr ? m - i : mr;
+        for (int p = 0; p < kc; p += KPACK) {
+            for (int r = 0; r < mr; ++r) {
+                for (int q = 0; q < KPACK; ++q) {
+                    if (r >= rows || p + q >= kc) {
+                        dst[r * KPACK + q] = 0;
+                    } else if (transposed) {
+                        dst[r * KPACK + q] = a[(size_t)(p + q) * lda + i + r];
+                    } else {
+                        dst[r * KPACK + q] = a[(size_t)(i + r) * lda + p + q];
+                    }
+                }
+            }
+            dst += mr * KPACK;
+        }
+    }
+}
+
+/*
+ * Packs B into slivers of NR columns, stored row by row and zero padded. A
+ * transposed B is read along its rows, a column of the sliver at a time.
+ */
+static void packB(int nr, int kc, int n, const elem_t *b, int ldb, int transposed, pack_t *dst) {
+    int steps = (kc + KPACK - 1) / KPACK;
+    for (int j = 0; j < n && transposed; j += nr) {
+        int cols = n - j < nr ? n - j : nr;
+        for (int s = 0; s < nr; ++s) {
+            for (int p = 0; p < steps * KPACK; ++p) {
+                dst[p / KPACK * nr * KPACK + s * KPACK + p % KPACK] =
+                    s < cols && p < kc ? b[(size_t)(j + s) * ldb + p] : 0;
+            }
+        }
+        dst += steps * nr * KPACK;
+    }
+    for (int j = 0; j < n && !transposed; j += nr) {
+        int cols = n - j < nr ? n - j : nr;
+        for (int p = 0; p < kc; p += KPACK) {
+#if KPACK == 1
+            memcpy(dst, b + (size_t)p * ldb + j, cols * sizeof(pack_t));
+            memset(dst + cols, 0, (nr - cols) * sizeof(pack_t));
+#else
+            for (int s = 0; s < nr; ++s) {
+                for (int q = 0; q < KPACK; ++q) {
+                    dst[s * KPACK + q] = s < cols && p + q < kc ? b[(size_t)(p + q) * ldb + j + s] : 0;
+                }
+            }
+#endif
+            dst += nr * KPACK;
+        }
+    }
+}
+
+/* Frees the panels of a thread as it exits. */
+static pthread_key_t panels_key;
+static pthread_once_t panels_once = PTHREAD_ONCE_INIT;
+
+static void createPanelsKey(void) {
+    pthread_key_create(&panels_key, free);
+}
+
+static int allocatePanels(void) {
+    if (packed_a) {
+        return 1;
+    }
+    /* Both in one block, aligned for the widest vector loads of the micro-kernels. */
+    size_t a_bytes = (MC + MAX_MR) * KC * sizeof(pack_t);
+    void *panels;
+    if (posix_memalign(&panels, 64, a_bytes + (NC + MAX_NR) * KC * sizeof(pack_t)) != 0) {
+        return 0;
+    }
+    pthread_once(&panels_once, createPanelsKey);
+    pthread_setspecific(panels_key, panels);
+    packed_a = panels;
+    packed_b = (pack_t *)((char *)panels + a_bytes);
+    return 1;
+}
+
+void gemmBlock(const GemmKernel *kernel, int m, int n, int k,
+               const elem_t *a, int lda, const elem_t *b, int ldb, acc_t *c, int ldc) {
+    gemmBlockFused(kernel, m, n, k, a, lda, 0, b, ldb, 0, NULL, 0, c, ldc);
+}
+
+void gemmBlockFused(const GemmKernel *kernel, int m, int n, int k,
+                    const elem_t *a, int lda, int a_transposed, const elem_t *b, int ldb, int b_transposed,
+                    const elem_t *add, int ldadd, acc_t *c, int ldc) {
+    int mr = kernel->mr, nr = kernel->nr;
+    acc_t edge[MAX_MR * MAX_NR];
+
+    for (int i = 0; i < m; ++i) {
+        acc_t *row = c + (size_t)i * ldc;
+        if (add) {
+            for (int j = 0; j < n; ++j) {
+                row[j] = add[(size_t)i * ldadd + j];
+            }
+        } else {
+            memset(row, 0, n * sizeof(acc_t));
+        }
+    }
+    if (!allocatePanels()) {
+        abort();
+    }
+
+    for (int jc = 0; jc < n; jc += NC) {
+        int nc = n - jc < NC ? n - jc : NC;
+        for (int pc = 0; pc < k; pc += KC) {
+            int kc = k - pc < KC ? k - pc : KC;
+            /* Steps of KPACK, the last one padded with zeros. */
+            int kp = (kc + KPACK - 1) / KPACK;
+            const elem_t *bp = b_transposed ? b + (size_t)jc * ldb + pc : b + (size_t)pc * ldb + jc;
+            packB(nr, kc, nc, bp, ldb, b_transposed, packed_b);
+            for (int ic = 0; ic < m; ic += MC) {
+                int mc = m - ic < MC ? m - ic : MC;
+                const elem_t *ap = a_transposed ? a + (size_t)pc * lda + ic : a + (size_t)ic * lda + pc;
+                packA(mr, mc, kc, ap, lda, a_transposed, packed_a);
+                for (int jr = 0; jr < nc; jr += nr) {
+                    for (int ir = 0; ir < mc; ir += mr) {
+                        const pack_t *pa = packed_a + ir * kp * KPACK;
+                        const pack_t *pb = packed_b + jr * kp * KPACK;
+                        acc_t *cc = c + (size_t)(ic + ir) * ldc + jc + jr;
+                        int rows = mc - ir < mr ? mc - ir : mr;
+                        int cols = nc - jr < nr ? nc - jr : nr;
+                        if (rows == mr && cols == nr) {
+                            kernel->micro(kp, pa, pb, cc, ldc);
+                            continue;
+                        }
+                        /* A partial block goes through a scratch block first. */
+                        memset(edge, 0, sizeof(edge));
+                        kernel->micro(kp, pa, pb, edge, nr);
+                        for (int r = 0; r < rows; ++r) {
+                            for (int s = 0; s < cols; ++s) {
+                                cc[r * ldc + s] += edge[r * nr + s];
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
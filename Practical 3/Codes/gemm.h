@@ -0,0 +1,55 @@
+#ifndef GEMM_H
+#define GEMM_H
+
+#include "matrix_types.h"
+
+/*
+ * Blocked matrix multiplication. Panels of A and B are packed into
+ * contiguous slivers so that a register-blocked micro-kernel streams through
+ * both with unit stride, whatever the shape of the matrices.
+ *
+ * Panels hold pack_t. Narrow integers are widened to int16 and packed
+ * KPACK at a time along K, so that the kernels can multiply pairs of them
+ * and add both products into a 32-bit lane in one instruction.
+ */
+#if defined(TYPES_INT16) || defined(TYPES_INT8)
+typedef int16_t pack_t;
+#define KPACK 2
+#else
+typedef elem_t pack_t;
+#define KPACK 1
+#endif
+
+typedef struct {
+    const char *name;
+    int mr;     /* Rows of C computed per micro-kernel call. */
+    int nr;     /* Columns of C computed per micro-kernel call. */
+    /* Adds the MR x NR product of packed slivers A and B, KP steps of KPACK long, to C. */
+    void (*micro)(int kp, const pack_t *a, const pack_t *b, acc_t *c, int ldc);
+    int (*supported)(void);     /* NULL if every CPU is. */
+} GemmKernel;
+
+/* The fastest kernel this CPU supports, or the one named by $MATRIX_KERNEL. */
+const GemmKernel *selectKernel(void);
+/* The kernel called NAME if this CPU supports it, NULL otherwise. */
+const GemmKernel *findKernel(const char *name);
+/* All kernels for the type set, terminated by NULL, supported or not. */
+extern const GemmKernel *const gemm_kernels[];
+int kernelSupported(const GemmKernel *kernel);
+
+/*
+ * C = A * B for an M x N block of C, with A being M x K and B being K x N.
+ * The leading dimensions are the row lengths of the full matrices.
+ */
+void gemmBlock(const GemmKernel *kernel, int m, int n, int k,
+               const elem_t *a, int lda, const elem_t *b, int ldb, acc_t *c, int ldc);
+/*
+ * The same with either operand stored transposed, A as K x M or B as N x K,
+ * which only changes how they are packed. C starts from the M x N block
+ * ADD instead of zero when ADD is not NULL, so C = A * B + ADD in one pass.
+ */
+void gemmBlockFused(const GemmKernel *kernel, int m, int n, int k,
+                    const elem_t *a, int lda, int a_transposed, const elem_t *b, int ldb, int b_transposed,
+                    const elem_t *add, int ldadd, acc_t *c, int ldc);
+
+#endif
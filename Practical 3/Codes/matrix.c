@@ -0,0 +1,73 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <sys/mman.h>
+#include "matrix.h"
+
+#define ROW_ALIGNMENT 64
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+
+const ElementType element_types[] = {
+    [TYPE_INT8] = {"int8", 1, "MATRIXi1"},
+    [TYPE_INT16] = {"int16", 2, "MATRIXi2"},
+    [TYPE_INT32] = {"int32", 4, "MATRIX01"},
+    [TYPE_INT64] = {"int64", 8, "MATRIXi8"},
+    [TYPE_FLOAT] = {"float", 4, "MATRIXf4"},
+    [TYPE_DOUBLE] = {"double", 8, "MATRIXf8"},
+};
+
+int matrixDimsValid(int rows, int cols) {
+    return rows > 0 && cols > 0 && rows <= MATRIX_MAX_DIM && cols <= MATRIX_MAX_DIM;
+}
+
+/*
+ * Explicit huge pages are tried first, they have to be reserved by the
+ * administrator. Failing that, transparent huge pages are asked for.
+ */
+static void *mapHuge(size_t bytes) {
+    void *p = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+        return p;
+    }
+    p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+    madvise(p, bytes, MADV_HUGEPAGE);
+    return p;
+}
+
+int matrixCreate(Matrix *matrix, int rows, int cols, int type) {
+    matrix->data = NULL;
+    if (!matrixDimsValid(rows, cols)) {
+        return -1;
+    }
+    int size = element_types[type].size;
+    int per_line = ROW_ALIGNMENT / size;
+    matrix->rows = rows;
+    matrix->cols = cols;
+    matrix->type = type;
+    matrix->stride = (cols + per_line - 1) / per_line * per_line;
+    matrix->bytes = (size_t)rows * matrix->stride * size;
+    matrix->mapping = NULL;
+
+    if (matrix->bytes >= HUGE_PAGE_SIZE && getenv("MATRIX_HUGEPAGES")) {
+        matrix->bytes = (matrix->bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        matrix->data = matrix->mapping = mapHuge(matrix->bytes);
+    } else {
+        if (posix_memalign(&matrix->data, ROW_ALIGNMENT, matrix->bytes) != 0) {
+            matrix->data = NULL;
+        }
+    }
+    return matrix->data ? 0 : -1;
+}
+
+void matrixDestroy(Matrix *matrix) {
+    if (matrix->mapping) {
+        munmap(matrix->mapping, matrix->bytes);
+    } else {
+        free(matrix->data);
+    }
+    matrix->data = NULL;
+    matrix->mapping = NULL;
+}
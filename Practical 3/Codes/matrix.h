@@ -0,0 +1,40 @@
+#ifndef MATRIX_H
+#define MATRIX_H
+
+#include <stddef.h>
+#include "matrix_types.h"
+
+/* Dimensions beyond this are rejected as corrupt input. */
+#define MATRIX_MAX_DIM (1 << 20)
+
+/*
+ * A row-major matrix of one of the element types. Rows of matrices from
+ * matrixCreate() start on a 64-byte boundary, so the stride, in elements,
+ * may be larger than the number of columns.
+ */
+typedef struct {
+    int rows;
+    int cols;
+    int stride;
+    int type;       /* TYPE_INT32 and so on. */
+    void *data;
+    void *mapping;  /* Start of the mmap() backing the data, NULL if on the heap. */
+    size_t bytes;   /* Size of the allocation or mapping. */
+} Matrix;
+
+/*
+ * Allocates a ROWS x COLS matrix of TYPE with undefined contents. Large matrices
+ * are put on huge pages when $MATRIX_HUGEPAGES is set. Returns 0, or -1 for
+ * bad dimensions or when out of memory.
+ */
+int matrixCreate(Matrix *matrix, int rows, int cols, int type);
+void matrixDestroy(Matrix *matrix);
+
+/* Whether ROWS x COLS is a matrix we are willing to allocate. */
+int matrixDimsValid(int rows, int cols);
+
+static inline void *matrixRow(const Matrix *matrix, int i) {
+    return (char *)matrix->data + (size_t)i * matrix->stride * element_types[matrix->type].size;
+}
+
+#endif
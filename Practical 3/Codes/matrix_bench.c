@@ -0,0 +1,480 @@
+/*
+ * Compares the multiplication kernels on random square matrices, against
+ * the original one dot product per element, in billions of multiply-adds
+ * counted as two operations each. With -s, reports how the tiled scheduler
+ * scales from one thread up to one per core (or THREADS) instead. With -c,
+ * finds the size from which one level of Strassen-Winograd beats the
+ * blocked kernel with THREADS threads, which tells a good cutoff. With -p,
+ * compares the sparse kernels with the blocked one on random matrices of
+ * falling density, which tells a good SPARSE_DENSITY.
+ *
+ * With -r, times every kernel under every scheduler on matrices of the
+ * given shapes, ROWSxINNERxCOLS or a single side for square ones, and
+ * writes a line of CSV for each thread count, for tracking regressions:
+ * the median and fastest of REPETITIONS runs after WARMUP more, the rate,
+ * and the speedup and efficiency against one thread. Every result is
+ * checked against the scalar kernel, which is itself checked against the
+ * original algorithm on a sample of rows.
+ *
+ *     matrix_bench [size...]
+ *     matrix_bench -s [threads] size
+ *     matrix_bench -c threads [size...]
+ *     matrix_bench -p threads size
+ *     matrix_bench -r [-w warmup] [-n repetitions] [-t threads,...] shape...
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "pool.h"
+#include "scheduler.h"
+#include "sparse.h"
+#include "strassen.h"
+
+/* The original algorithm is only timed on this many rows of large matrices. */
+#define NAIVE_ROWS 64
+/* Most thread counts and repetitions of -r. */
+#define MAX_COUNTS 64
+#define MAX_REPETITIONS 1000
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void naiveRows(int rows, int n, const elem_t *a, const elem_t *b, acc_t *c) {
+    for (int i = 0; i < rows; ++i) {
+        for (int j = 0; j < n; ++j) {
+            acc_t sum = 0;
+            for (int k = 0; k < n; ++k) {
+                sum += (acc_t)a[i * n + k] * b[k * n + j];
+            }
+            c[i * n + j] = sum;
+        }
+    }
+}
+
+/* Small integers, which every type holds and floating-point sums exactly. */
+static elem_t *randomMatrix(int rows, int cols) {
+    elem_t *m = malloc((size_t)rows * cols * sizeof(elem_t));
+    for (size_t i = 0; i < (size_t)rows * cols; ++i) {
+        m[i] = rand() % 19 - 9;
+    }
+    return m;
+}
+
+/* Nonzero with probability DENSITY. */
+static elem_t *randomSparse(int n, double density) {
+    elem_t *m = malloc((size_t)n * n * sizeof(elem_t));
+    for (size_t i = 0; i < (size_t)n * n; ++i) {
+        m[i] = rand() < density * RAND_MAX ? rand() % 9 + 1 - (rand() & 1) * 10 : 0;
+    }
+    return m;
+}
+
+static int sparsity(int threads, int n) {
+    static const double densities[] = {0.2, 0.1, 0.05, 0.02, 0.01, 0.005, 0.002, 0.001};
+    double crossover = 0;
+
+    printf("%dx%d, %d threads, sparse times dense and sparse times sparse against %s\n",
+           n, n, threads, selectKernel()->name);
+    printf("%8s %10s %10s %10s %8s %8s\n", "density", "dense", "csr*dense", "csr*csr", "speedup", "speedup");
+    for (int d = 0; d < sizeof(densities) / sizeof(densities[0]); ++d) {
+        elem_t *a = randomSparse(n, densities[d]), *b = randomSparse(n, densities[d]);
+        acc_t *reference = malloc((size_t)n * n * sizeof(acc_t));
+        acc_t *c = malloc((size_t)n * n * sizeof(acc_t));
+        Matrix am = {n, n, n, ELEM_TYPE, a}, bm = {n, n, n, ELEM_TYPE, b};
+        Matrix cm = {n, n, n, ACC_TYPE, c};
+        Sparse as, bs;
+        if (sparseFromDense(&as, &am) != 0 || sparseFromDense(&bs, &bm) != 0) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        Multiplication job = {selectKernel(), n, n, n, a, n, b, n, reference, n};
+
+        double start = now();
+        multiplyParallel(&job, threads);
+        double dense = now() - start;
+        start = now();
+        multiplySparseDense(&as, &bm, &cm, threads);
+        double sparse_dense = now() - start;
+        int wrong = memcmp(c, reference, (size_t)n * n * sizeof(acc_t)) != 0;
+        start = now();
+        multiplySparseSparse(&as, &bs, &cm, threads);
+        double sparse_sparse = now() - start;
+        wrong |= memcmp(c, reference, (size_t)n * n * sizeof(acc_t)) != 0;
+
+        printf("%8.3f %10.4f %10.4f %10.4f %8.2f %8.2f%s\n", densities[d], dense, sparse_dense,
+               sparse_sparse, dense / sparse_dense, dense / sparse_sparse, wrong ? "   WRONG" : "");
+        if (!crossover && sparse_dense < dense) {
+            crossover = densities[d];
+        }
+        sparseDestroy(&as);
+        sparseDestroy(&bs);
+        free(a);
+        free(b);
+        free(reference);
+        free(c);
+    }
+    if (crossover) {
+        printf("Sparse times dense wins from a density of %g down\n", crossover);
+    } else {
+        printf("The blocked kernel wins at every density tried\n");
+    }
+    return 0;
+}
+
+static int scaling(int max_threads, int n) {
+    elem_t *a = randomMatrix(n, n), *b = randomMatrix(n, n);
+    acc_t *c = malloc((size_t)n * n * sizeof(acc_t));
+    Multiplication job = {selectKernel(), n, n, n, a, n, b, n, c, n};
+    double base = 0;
+
+    printf("%dx%d with the %s kernel\n", n, n, job.kernel->name);
+    printf("%7s %10s %8s %8s %10s\n", "threads", "seconds", "GOP/s", "speedup", "efficiency");
+    for (int threads = 1; threads <= max_threads; ++threads) {
+        double start = now();
+        multiplyParallel(&job, threads);
+        double elapsed = now() - start;
+        if (threads == 1) {
+            base = elapsed;
+        }
+        printf("%7d %10.3f %8.2f %8.2f %10.2f\n", threads, elapsed,
+               2.0 * n * n * n / elapsed / 1e9, base / elapsed, base / elapsed / threads);
+    }
+    free(a);
+    free(b);
+    free(c);
+    return 0;
+}
+
+static int crossover(int threads, int count, char **sizes) {
+    static const int default_sizes[] = {256, 512, 768, 1024, 1536, 2048, 3072, 4096};
+    int largest_blocked = 0, first_strassen = 0;
+    if (!ELEM_IS_ACC) {
+        printf("Strassen-Winograd is not used for %s inputs\n", element_types[ELEM_TYPE].name);
+        return 0;
+    }
+    if (count == 0) {
+        count = sizeof(default_sizes) / sizeof(default_sizes[0]);
+        sizes = NULL;
+    }
+
+    printf("%6s %10s %10s %8s   (seconds, %d threads)\n", "size", "blocked", "strassen", "ratio", threads);
+    for (int s = 0; s < count; ++s) {
+        int n = sizes ? atoi(sizes[s]) : default_sizes[s];
+        if (n <= 1) {
+            fprintf(stderr, "bad size %s\n", sizes[s]);
+            return 1;
+        }
+        elem_t *a = randomMatrix(n, n), *b = randomMatrix(n, n);
+        acc_t *reference = malloc((size_t)n * n * sizeof(acc_t));
+        acc_t *c = malloc((size_t)n * n * sizeof(acc_t));
+        Multiplication job = {selectKernel(), n, n, n, a, n, b, n, reference, n};
+
+        double start = now();
+        multiplyParallel(&job, threads);
+        double blocked = now() - start;
+
+        /* A cutoff just below N splits exactly once. */
+        job.c = c;
+        start = now();
+        multiplyStrassen(&job, threads, n - 1);
+        double strassen = now() - start;
+
+        int wrong = memcmp(c, reference, (size_t)n * n * sizeof(acc_t)) != 0;
+        printf("%6d %10.3f %10.3f %8.2f%s\n", n, blocked, strassen, blocked / strassen,
+               wrong ? "   WRONG" : "");
+        if (strassen < blocked && !first_strassen) {
+            first_strassen = n;
+        } else if (strassen >= blocked) {
+            largest_blocked = n;
+            first_strassen = 0;
+        }
+        free(a);
+        free(b);
+        free(reference);
+        free(c);
+    }
+    if (first_strassen) {
+        printf("Strassen wins from %d on, a cutoff of %d or so\n", first_strassen,
+               largest_blocked > first_strassen / 2 ? largest_blocked : first_strassen / 2);
+    } else {
+        printf("The blocked kernel wins at every size tried\n");
+    }
+    return 0;
+}
+
+typedef struct {
+    const char *name;
+    int pooled;     /* On threads kept from one multiplication to the next. */
+    int strassen;   /* One level of Strassen-Winograd above the tiles. */
+} Scheduler;
+
+static const Scheduler schedulers[] = {
+    {"tiled", 0, 0},
+    {"pooled", 1, 0},
+    {"strassen", 1, 1},
+};
+
+static int compareTimes(const void *x, const void *y) {
+    double a = *(const double *)x, b = *(const double *)y;
+    return a < b ? -1 : a > b;
+}
+
+/* ROWSxINNERxCOLS, or one side for a square shape. */
+static int parseShape(const char *text, int *m, int *k, int *n) {
+    char *end;
+    *m = *k = *n = strtol(text, &end, 10);
+    if (*end == 'x') {
+        *k = strtol(end + 1, &end, 10);
+        if (*end != 'x') {
+            return 0;
+        }
+        *n = strtol(end + 1, &end, 10);
+    }
+    return !*end && *m > 0 && *k > 0 && *n > 0;
+}
+
+/* A list like 1,2,4. Returns its length, 0 if malformed. */
+static int parseCounts(const char *text, int *counts) {
+    int count = 0;
+    while (*text && count < MAX_COUNTS) {
+        char *end;
+        counts[count] = strtol(text, &end, 10);
+        if (end == text || counts[count] <= 0 || (*end && *end != ',')) {
+            return 0;
+        }
+        count++;
+        text = *end ? end + 1 : end;
+    }
+    return *text ? 0 : count;
+}
+
+/* Checks NAIVE_ROWS rows spread over C, M x N, against the original algorithm. */
+static int checkSample(int m, int n, int k, const elem_t *a, const elem_t *b, const acc_t *c) {
+    int step = m > NAIVE_ROWS ? m / NAIVE_ROWS : 1;
+    for (int i = 0; i < m; i += step) {
+        for (int j = 0; j < n; ++j) {
+            acc_t sum = 0;
+            for (int p = 0; p < k; ++p) {
+                sum += (acc_t)a[(size_t)i * k + p] * b[(size_t)p * n + j];
+            }
+            if (sum != c[(size_t)i * n + j]) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/* Times one variant at every thread count, returning how many results were wrong. */
+static int timeVariant(const char *shape, const GemmKernel *kernel, const Scheduler *scheduler,
+                       const int *counts, int count, int warmup, int repetitions,
+                       Multiplication *job, const acc_t *reference) {
+    double times[MAX_REPETITIONS], base = 0;
+    int wrong = 0;
+    for (int t = 0; t < count; ++t) {
+        int threads = counts[t];
+        for (int r = -warmup; r < repetitions; ++r) {
+            double start = now();
+            if (scheduler->strassen) {
+                /* A cutoff just below the shortest side splits exactly once. */
+                int shortest = job->m < job->n ? job->m : job->n;
+                multiplyStrassen(job, threads, (shortest < job->k ? shortest : job->k) - 1);
+            } else {
+                multiplyParallel(job, threads);
+            }
+            if (r >= 0) {
+                times[r] = now() - start;
+            }
+        }
+        qsort(times, repetitions, sizeof(double), compareTimes);
+        double median = repetitions % 2 ? times[repetitions / 2]
+                                        : (times[repetitions / 2 - 1] + times[repetitions / 2]) / 2;
+        int verified = memcmp(job->c, reference, (size_t)job->m * job->n * sizeof(acc_t)) == 0;
+        if (t == 0) {
+            base = median;
+        }
+        /* Against the first thread count, as if it scaled perfectly up to it. */
+        printf("%s,%s->%s,%s,%s,%d,%d,%.6f,%.6f,%.3f,%.3f,%.3f,%s\n", shape,
+               element_types[ELEM_TYPE].name, element_types[ACC_TYPE].name, kernel->name,
+               scheduler->name, threads, repetitions, median, times[0],
+               2.0 * job->m * job->n * job->k / median / 1e9, base / median,
+               base / median * counts[0] / threads, verified ? "yes" : "no");
+        fflush(stdout);
+        wrong += !verified;
+    }
+    return wrong;
+}
+
+static int regression(int argc, char *argv[]) {
+    int warmup = 1, repetitions = 5, counts[MAX_COUNTS], count = 0, opt;
+    optind = 2;
+    while ((opt = getopt(argc, argv, "w:n:t:")) != -1) {
+        switch (opt) {
+        case 'w': warmup = atoi(optarg); break;
+        case 'n': repetitions = atoi(optarg); break;
+        case 't': count = parseCounts(optarg, counts); if (!count) count = -1; break;
+        default: count = -1;
+        }
+    }
+    if (count < 0 || warmup < 0 || repetitions < 1 || repetitions > MAX_REPETITIONS || optind == argc) {
+        fprintf(stderr, "usage: %s -r [-w warmup] [-n repetitions] [-t threads,...] shape...\n", argv[0]);
+        return 1;
+    }
+    if (count == 0) {
+        /* Doubling up to one per core. */
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        for (int threads = 1; threads < cores && count < MAX_COUNTS - 1; threads *= 2) {
+            counts[count++] = threads;
+        }
+        counts[count++] = cores > 0 ? cores : 1;
+    }
+    int most = 0;
+    for (int t = 0; t < count; ++t) {
+        most = counts[t] > most ? counts[t] : most;
+    }
+
+    int wrong = 0;
+    printf("shape,types,kernel,scheduler,threads,repetitions,median_seconds,min_seconds,"
+           "gops,speedup,efficiency,verified\n");
+    for (int s = optind; s < argc; ++s) {
+        int m, k, n;
+        char shape[64];
+        if (!parseShape(argv[s], &m, &k, &n)) {
+            fprintf(stderr, "bad shape %s\n", argv[s]);
+            return 1;
+        }
+        snprintf(shape, sizeof(shape), "%dx%dx%d", m, k, n);
+        elem_t *a = randomMatrix(m, k), *b = randomMatrix(k, n);
+        acc_t *reference = malloc((size_t)m * n * sizeof(acc_t));
+        acc_t *c = malloc((size_t)m * n * sizeof(acc_t));
+        if (!a || !b || !reference || !c) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        gemmBlock(findKernel("scalar"), m, n, k, a, k, b, n, reference, n);
+        if (!checkSample(m, n, k, a, b, reference)) {
+            fprintf(stderr, "The %s kernel is wrong for %s, nothing is verified\n", "scalar", shape);
+            reference[0] += 1;
+        }
+
+        for (int kn = 0; gemm_kernels[kn]; ++kn) {
+            if (!kernelSupported(gemm_kernels[kn])) {
+                continue;
+            }
+            for (int v = 0; v < sizeof(schedulers) / sizeof(schedulers[0]); ++v) {
+                const Scheduler *scheduler = &schedulers[v];
+                if (scheduler->strassen && (!ELEM_IS_ACC || m < 2 || n < 2 || k < 2)) {
+                    continue;
+                }
+                Multiplication job = {gemm_kernels[kn], m, n, k, a, k, b, n, c, n};
+                if (scheduler->pooled) {
+                    poolStart(most);
+                }
+                wrong += timeVariant(shape, gemm_kernels[kn], scheduler, counts, count, warmup,
+                                     repetitions, &job, reference);
+                if (scheduler->pooled) {
+                    poolStop();
+                }
+            }
+        }
+        free(a);
+        free(b);
+        free(reference);
+        free(c);
+    }
+    if (wrong) {
+        fprintf(stderr, "%d results differ from the reference\n", wrong);
+    }
+    return wrong != 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "-r") == 0) {
+        return regression(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        int threads = argc > 2 ? atoi(argv[2]) : 0;
+        if (threads <= 0) {
+            fprintf(stderr, "usage: %s -c threads [size...]\n", argv[0]);
+            return 1;
+        }
+        return crossover(threads, argc - 3, argv + 3);
+    }
+    if (argc > 1 && strcmp(argv[1], "-p") == 0) {
+        int threads = argc > 3 ? atoi(argv[2]) : 0;
+        int n = argc > 3 ? atoi(argv[3]) : 0;
+        if (threads <= 0 || n <= 0) {
+            fprintf(stderr, "usage: %s -p threads size\n", argv[0]);
+            return 1;
+        }
+        return sparsity(threads, n);
+    }
+    if (argc > 1 && strcmp(argv[1], "-s") == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        int max_threads = argc > 3 ? atoi(argv[2]) : cores > 0 ? cores : 1;
+        int n = argc > 2 ? atoi(argv[argc - 1]) : 0;
+        if (n <= 0 || max_threads <= 0) {
+            fprintf(stderr, "usage: %s -s [threads] size\n", argv[0]);
+            return 1;
+        }
+        return scaling(max_threads, n);
+    }
+
+    static const int default_sizes[] = {256, 512, 1000, 2000, 3000, 5000};
+    int count = argc > 1 ? argc - 1 : sizeof(default_sizes) / sizeof(default_sizes[0]);
+
+    printf("%6s %10s", "size", "original");
+    for (int k = 0; gemm_kernels[k]; ++k) {
+        if (kernelSupported(gemm_kernels[k])) {
+            printf(" %10s", gemm_kernels[k]->name);
+        }
+    }
+    printf("   (GOP/s, one thread, %s -> %s)\n", element_types[ELEM_TYPE].name, element_types[ACC_TYPE].name);
+
+    for (int s = 0; s < count; ++s) {
+        int n = argc > 1 ? atoi(argv[s + 1]) : default_sizes[s];
+        if (n <= 0) {
+            fprintf(stderr, "bad size %s\n", argv[s + 1]);
+            return 1;
+        }
+        elem_t *a = randomMatrix(n, n), *b = randomMatrix(n, n);
+        acc_t *reference = malloc((size_t)n * n * sizeof(acc_t));
+        acc_t *c = malloc((size_t)n * n * sizeof(acc_t));
+
+        int rows = n < NAIVE_ROWS ? n : NAIVE_ROWS;
+        double start = now();
+        naiveRows(rows, n, a, b, reference);
+        double elapsed = now() - start;
+        printf("%6d %10.2f", n, 2.0 * rows * n * n / elapsed / 1e9);
+        fflush(stdout);
+
+        for (int k = 0; gemm_kernels[k]; ++k) {
+            const GemmKernel *kernel = gemm_kernels[k];
+            if (!kernelSupported(kernel)) {
+                continue;
+            }
+            start = now();
+            gemmBlock(kernel, n, n, n, a, n, b, n, c, n);
+            elapsed = now() - start;
+            if (memcmp(c, reference, (size_t)rows * n * sizeof(acc_t)) != 0) {
+                printf(" %10s", "WRONG");
+            } else {
+                printf(" %10.2f", 2.0 * n * n * n / elapsed / 1e9);
+            }
+            fflush(stdout);
+        }
+        printf("\n");
+        free(a);
+        free(b);
+        free(reference);
+        free(c);
+    }
+    return 0;
+}
@@ -0,0 +1,693 @@
+#include <ctype.h>
+#include <fcntl.h>
+#include <immintrin.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "matrix_io.h"
+#include "numa.h"
+
+_Static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "binary matrices are used in place");
+
+#define WRITE_BUFFER_SIZE (1 << 20)
+/* Longest formatted element, "-1.2345678901234567e-308" and its tab. */
+#define MAX_FORMATTED 25
+
+/* Where the elements of each matrix are in the file, counted in tokens. */
+typedef struct {
+    int count;
+    size_t start[TEXT_MAX_MATRICES];
+    size_t elements[TEXT_MAX_MATRICES];
+    Matrix *matrices;
+} Layout;
+
+/* A part of the file parsed by one thread. Tokens never straddle two slices. */
+typedef struct {
+    const char *start;
+    const char *end;
+    size_t tokens;      /* Tokens starting in the slice. */
+    size_t first;       /* Index of the first of them in the file. */
+    const Layout *layout;
+    const char *bad;    /* First malformed token, if any. */
+} Slice;
+
+/* Where the next element goes. */
+typedef struct {
+    Matrix *matrix;     /* NULL for tokens that are not elements. */
+    int row;
+    int col;
+} Cursor;
+
+/* Any control character separates tokens, which keeps the test vectorizable. */
+static int isSpace(char c) {
+    return (unsigned char)c <= ' ';
+}
+
+static const char *skipSpace(const char *p, const char *end) {
+    while (p < end && isSpace(*p)) {
+        p++;
+    }
+    return p;
+}
+
+/*
+ * Parses the integer token at P, of at most ten digits, into VALUE. Returns
+ * the end of the token, or NULL if it is no such integer.
+ */
+static const char *parseInteger(const char *p, const char *end, int64_t *value) {
+    int negative = 0;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p++ == '-';
+    }
+    const char *digits = p;
+    uint64_t v = 0;
+    unsigned int d;
+    while (p < end && (d = (unsigned char)*p - '0') <= 9) {
+        v = v * 10 + d;
+        p++;
+    }
+    /* Ten digits cannot overflow V, so the range is left to the caller. */
+    if (p == digits || p - digits > 10 || (p < end && !isSpace(*p))) {
+        return NULL;
+    }
+    *value = negative ? -(int64_t)v : (int64_t)v;
+    return p;
+}
+
+static const char *parseInt(const char *p, const char *end, int *value) {
+    int64_t v;
+    if (!(p = parseInteger(p, end, &v)) || v < INT32_MIN || v > INT32_MAX) {
+        return NULL;
+    }
+    *value = v;
+    return p;
+}
+
+#if ELEM_IS_FLOAT
+/* The token is copied out first, the mapped text has no terminating NUL. */
+static const char *parseElement(const char *p, const char *end, elem_t *value) {
+    char token[64];
+    size_t n = 0;
+    while (p + n < end && !isSpace(p[n]) && n < sizeof(token) - 1) {
+        token[n] = p[n];
+        n++;
+    }
+    if (n == 0 || (p + n < end && !isSpace(p[n]))) {
+        return NULL;
+    }
+    token[n] = '\0';
+    char *stop;
+    double v = strtod(token, &stop);
+    if (*stop != '\0') {
+        return NULL;
+    }
+    *value = v;
+    return p + n;
+}
+#else
+static const char *parseElement(const char *p, const char *end, elem_t *value) {
+    int64_t v;
+    if (!(p = parseInteger(p, end, &v)) || v < ELEM_MIN || v > ELEM_MAX) {
+        return NULL;
+    }
+    *value = v;
+    return p;
+}
+#endif
+
+static const char *skipTokens(const char *p, const char *end, size_t n) {
+    for (p = skipSpace(p, end); n > 0 && p < end; n--) {
+        while (p < end && !isSpace(*p)) {
+            p++;
+        }
+        p = skipSpace(p, end);
+    }
+    return p;
+}
+
+static void locate(const Layout *layout, size_t token, Cursor *cursor) {
+    cursor->matrix = NULL;
+    for (int i = 0; i < layout->count; ++i) {
+        if (token >= layout->start[i] && token < layout->start[i] + layout->elements[i]) {
+            size_t index = token - layout->start[i];
+            cursor->matrix = &layout->matrices[i];
+            cursor->row = index / cursor->matrix->cols;
+            cursor->col = index % cursor->matrix->cols;
+            return;
+        }
+    }
+}
+
+/* Bit I is set when byte I of the 64 at P is part of a token. */
+static uint64_t tokenMask(const unsigned char *p) {
+    const __m128i first = _mm_set1_epi8('!');
+    uint64_t mask = 0;
+    for (int i = 0; i < 4; ++i) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+        __m128i in_token = _mm_cmpeq_epi8(_mm_max_epu8(v, first), v);
+        mask |= (uint64_t)(unsigned int)_mm_movemask_epi8(in_token) << (16 * i);
+    }
+    return mask;
+}
+
+/* Counts where tokens start, 64 bytes at a time, as the lengths are too random to branch on. */
+static void *countTokens(void *arg) {
+    Slice *slice = arg;
+    const unsigned char *p = (const unsigned char *)slice->start;
+    const unsigned char *end = (const unsigned char *)slice->end;
+    size_t tokens = 0;
+    uint64_t previous = 0;  /* Whether the byte before P is part of a token. */
+    for (; p + 64 <= end; p += 64) {
+        uint64_t mask = tokenMask(p);
+        tokens += __builtin_popcountll(mask & ~(mask << 1 | previous));
+        previous = mask >> 63;
+    }
+    for (; p < end; p++) {
+        tokens += !previous && !isSpace(*p);
+        previous = !isSpace(*p);
+    }
+    slice->tokens = tokens;
+    return NULL;
+}
+
+static void *parseTokens(void *arg) {
+    Slice *slice = arg;
+    const char *p = skipSpace(slice->start, slice->end);
+    size_t token = slice->first;
+    Cursor cursor;
+    locate(slice->layout, token, &cursor);
+
+    while (p < slice->end) {
+        /* The thread count and dimensions were checked already, they only have to be skipped. */
+        elem_t value;
+        int ignored;
+        const char *next = cursor.matrix ? parseElement(p, slice->end, &value)
+                                         : parseInt(p, slice->end, &ignored);
+        if (!next) {
+            slice->bad = p;
+            return NULL;
+        }
+        token++;
+        if (cursor.matrix) {
+            ((elem_t *)matrixRow(cursor.matrix, cursor.row))[cursor.col] = value;
+            if (++cursor.col == cursor.matrix->cols) {
+                cursor.col = 0;
+                if (++cursor.row == cursor.matrix->rows) {
+                    locate(slice->layout, token, &cursor);
+                }
+            }
+        } else {
+            locate(slice->layout, token, &cursor);
+        }
+        p = skipSpace(next, slice->end);
+    }
+    return NULL;
+}
+
+/* Runs FN on every slice, on a thread each. */
+static void forEachSlice(Slice *slices, int count, void *(*fn)(void *)) {
+    pthread_t threads[count];
+    int started[count];
+    for (int i = 1; i < count; ++i) {
+        started[i] = pthread_create(&threads[i], NULL, fn, &slices[i]) == 0;
+        if (!started[i]) {
+            fn(&slices[i]);
+        }
+    }
+    fn(&slices[0]);
+    for (int i = 1; i < count; ++i) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+}
+
+static int lineOf(const char *text, const char *p) {
+    int line = 1;
+    for (; text < p; text++) {
+        line += *text == '\n';
+    }
+    return line;
+}
+
+static int parseDims(const char *path, const char *p, const char *end, int *rows, int *cols) {
+    p = skipSpace(p, end);
+    if ((p = parseInt(p, end, rows))) {
+        p = parseInt(skipSpace(p, end), end, cols);
+    }
+    if (!p || !matrixDimsValid(*rows, *cols)) {
+        fprintf(stderr, "%s: bad matrix dimensions\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+/* The first byte of token TOKEN, counting from the thread count. */
+static const char *findToken(const Slice *slices, int count, size_t token, const char *end) {
+    int s = 0;
+    while (s < count - 1 && slices[s].first + slices[s].tokens <= token) {
+        s++;
+    }
+    return skipTokens(slices[s].start, end, token - slices[s].first);
+}
+
+static int parseText(const char *path, const char *text, size_t length, int threads,
+                     int *number_of_threads, Matrix *matrices, int max, int *count) {
+    const char *end = text + length;
+    const char *p = skipSpace(text, end);
+    if (!(p = parseInt(p, end, number_of_threads)) || *number_of_threads < 1) {
+        fprintf(stderr, "%s: bad thread count\n", path);
+        return -1;
+    }
+
+    /* Slices start right after white space, so no token is cut in two. */
+    if (threads < 1) {
+        threads = 1;
+    }
+    if ((size_t)threads > length / 4096 + 1) {
+        threads = length / 4096 + 1;
+    }
+    Slice slices[threads];
+    for (int i = 0; i < threads; ++i) {
+        const char *start = i == 0 ? text : text + length / threads * i;
+        if (i > 0 && start < slices[i - 1].start) {
+            start = slices[i - 1].start;
+        }
+        while (start > text && start < end && !isSpace(start[-1])) {
+            start++;
+        }
+        slices[i].start = start;
+        if (i > 0) {
+            slices[i - 1].end = start;
+        }
+        slices[i].bad = NULL;
+    }
+    slices[threads - 1].end = end;
+    forEachSlice(slices, threads, countTokens);
+
+    size_t total = 0;
+    for (int i = 0; i < threads; ++i) {
+        slices[i].first = total;
+        total += slices[i].tokens;
+    }
+
+    /* Matrices follow one another as long as there are tokens left, up to MAX of them. */
+    Layout layout = {0};
+    size_t next = 1;
+    int rows[TEXT_MAX_MATRICES], cols[TEXT_MAX_MATRICES];
+    if (max > TEXT_MAX_MATRICES) {
+        max = TEXT_MAX_MATRICES;
+    }
+    while (layout.count < max && (layout.count == 0 || next < total)) {
+        int i = layout.count;
+        if (total < next + 2) {
+            fprintf(stderr, "%s: matrix %c ends early\n", path, 'A' + i);
+            return -1;
+        }
+        if (parseDims(path, findToken(slices, threads, next, end), end, &rows[i], &cols[i]) != 0) {
+            return -1;
+        }
+        layout.start[i] = next + 2;
+        layout.elements[i] = (size_t)rows[i] * cols[i];
+        next = layout.start[i] + layout.elements[i];
+        if (total < next) {
+            fprintf(stderr, "%s: matrix %c ends early\n", path, 'A' + i);
+            return -1;
+        }
+        layout.count++;
+    }
+
+    for (int i = 0; i < layout.count; ++i) {
+        if (matrixCreate(&matrices[i], rows[i], cols[i], ELEM_TYPE) != 0) {
+            fprintf(stderr, "Cannot allocate the input matrices\n");
+            *count = i;
+            return -1;
+        }
+        /* Before the parsing threads write them, wherever those happen to run. */
+        if (i == 0) {
+            numaPlaceRows(&matrices[i]);
+        } else {
+            numaInterleave(&matrices[i]);
+        }
+    }
+    *count = layout.count;
+    layout.matrices = matrices;
+    for (int i = 0; i < threads; ++i) {
+        slices[i].layout = &layout;
+    }
+    forEachSlice(slices, threads, parseTokens);
+    for (int i = 0; i < threads; ++i) {
+        if (slices[i].bad) {
+            fprintf(stderr, "%s:%d: not a valid %s\n", path, lineOf(text, slices[i].bad),
+                    element_types[ELEM_TYPE].name);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Maps a whole text file for reading. Returns NULL after saying why it cannot. */
+static char *mapText(const char *path, size_t *length) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    if (st.st_size == 0) {
+        fprintf(stderr, "%s: empty file\n", path);
+        close(fd);
+        return NULL;
+    }
+    char *text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (text == MAP_FAILED) {
+        perror(path);
+        return NULL;
+    }
+    *length = st.st_size;
+    return text;
+}
+
+int loadMatrices(const char *path, int threads, int *number_of_threads, Matrix *matrices, int max,
+                 int *count) {
+    size_t length;
+    char *text = mapText(path, &length);
+    if (!text) {
+        return -1;
+    }
+    *count = 0;
+    int status = parseText(path, text, length, threads, number_of_threads, matrices, max, count);
+    munmap(text, length);
+    if (status != 0) {
+        for (int i = 0; i < *count; ++i) {
+            matrixDestroy(&matrices[i]);
+        }
+        *count = 0;
+    }
+    return status;
+}
+
+int loadText(const char *path, int threads, int *number_of_threads, Matrix *a, Matrix *b) {
+    Matrix matrices[2];
+    int count;
+    if (loadMatrices(path, threads, number_of_threads, matrices, 2, &count) != 0) {
+        return -1;
+    }
+    if (count < 2 || matrices[0].cols != matrices[1].rows) {
+        if (count < 2) {
+            fprintf(stderr, "%s: matrix B ends early\n", path);
+        } else {
+            fprintf(stderr, "Cannot multiply a %dx%d matrix by a %dx%d one\n", matrices[0].rows,
+                    matrices[0].cols, matrices[1].rows, matrices[1].cols);
+        }
+        for (int i = 0; i < count; ++i) {
+            matrixDestroy(&matrices[i]);
+        }
+        return -1;
+    }
+    *a = matrices[0];
+    *b = matrices[1];
+    return 0;
+}
+
+int isMarket(const char *path) {
+    char banner[MARKET_BANNER_SIZE];
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return 0;
+    }
+    int market = fread(banner, 1, sizeof(banner), file) == sizeof(banner) &&
+                 memcmp(banner, MARKET_BANNER, sizeof(banner)) == 0;
+    fclose(file);
+    return market;
+}
+
+/* Nonzeros as read, before they are sorted into rows. */
+typedef struct {
+    int *rows;
+    int *cols;
+    elem_t *values;
+    size_t count;
+} Entries;
+
+static int parseEntries(const char *path, const char *text, const char *p, const char *end,
+                        int rows, int cols, int pattern, int symmetric, Entries *entries) {
+    size_t listed = entries->count;
+    entries->count = 0;
+    for (size_t e = 0; e < listed; ++e) {
+        const char *entry = p = skipSpace(p, end);
+        int i, j;
+        elem_t value = 1;
+        if ((p = parseInt(p, end, &i))) {
+            p = parseInt(skipSpace(p, end), end, &j);
+        }
+        if (p && !pattern) {
+            p = parseElement(skipSpace(p, end), end, &value);
+        }
+        if (!p || i < 1 || i > rows || j < 1 || j > cols) {
+            fprintf(stderr, "%s:%d: bad entry\n", path, lineOf(text, entry));
+            return -1;
+        }
+        entries->rows[entries->count] = i - 1;
+        entries->cols[entries->count] = j - 1;
+        entries->values[entries->count++] = value;
+        /* Only one triangle of a symmetric matrix is listed. */
+        if (symmetric && i != j) {
+            entries->rows[entries->count] = j - 1;
+            entries->cols[entries->count] = i - 1;
+            entries->values[entries->count++] = value;
+        }
+    }
+    return 0;
+}
+
+static int parseMarket(const char *path, const char *text, size_t length, Sparse *sparse) {
+    const char *end = text + length;
+    const char *p = memchr(text, '\n', length);
+    char banner[128], object[16], format[16], field[16], symmetry[16];
+    size_t banner_length = p ? (size_t)(p - text) : length;
+    if (banner_length >= sizeof(banner)) {
+        banner_length = sizeof(banner) - 1;
+    }
+    memcpy(banner, text, banner_length);
+    banner[banner_length] = '\0';
+    for (char *c = banner; *c; c++) {
+        *c = tolower((unsigned char)*c);
+    }
+    if (sscanf(banner, "%%%%matrixmarket %15s %15s %15s %15s", object, format, field, symmetry) != 4 ||
+        strcmp(object, "matrix") != 0 || strcmp(format, "coordinate") != 0 ||
+        (strcmp(field, "integer") != 0 && strcmp(field, "real") != 0 && strcmp(field, "pattern") != 0) ||
+        (strcmp(symmetry, "general") != 0 && strcmp(symmetry, "symmetric") != 0)) {
+        fprintf(stderr, "%s: only general or symmetric coordinate matrices are supported\n", path);
+        return -1;
+    }
+    int pattern = strcmp(field, "pattern") == 0;
+    int symmetric = strcmp(symmetry, "symmetric") == 0;
+
+    while (p && p + 1 < end && p[1] == '%') {
+        p = memchr(p + 1, '\n', end - p - 1);
+    }
+    int rows, cols;
+    int64_t listed;
+    if (!p || parseDims(path, p, end, &rows, &cols) != 0) {
+        return -1;
+    }
+    p = skipTokens(p, end, 2);
+    if (!(p = parseInteger(p, end, &listed)) || listed < 0 ||
+        listed > (symmetric ? 1 : 2) * (int64_t)rows * cols) {
+        fprintf(stderr, "%s: bad number of nonzeros\n", path);
+        return -1;
+    }
+
+    size_t room = (symmetric ? 2 : 1) * (size_t)listed + 1;
+    Entries entries = {malloc(room * sizeof(int)), malloc(room * sizeof(int)),
+                       malloc(room * sizeof(elem_t)), listed};
+    size_t *next = malloc(((size_t)rows + 1) * sizeof(size_t));
+    int status = -1;
+    if (!entries.rows || !entries.cols || !entries.values || !next) {
+        fprintf(stderr, "Cannot allocate %s\n", path);
+    } else if (parseEntries(path, text, p, end, rows, cols, pattern, symmetric, &entries) == 0) {
+        if (sparseCreate(sparse, rows, cols, entries.count) != 0) {
+            fprintf(stderr, "Cannot allocate %s\n", path);
+        } else {
+            /* A counting sort by row. */
+            for (size_t e = 0; e < entries.count; ++e) {
+                sparse->offsets[entries.rows[e] + 1]++;
+            }
+            for (int i = 0; i < rows; ++i) {
+                sparse->offsets[i + 1] += sparse->offsets[i];
+            }
+            memcpy(next, sparse->offsets, ((size_t)rows + 1) * sizeof(size_t));
+            for (size_t e = 0; e < entries.count; ++e) {
+                size_t at = next[entries.rows[e]]++;
+                sparse->indices[at] = entries.cols[e];
+                sparse->values[at] = entries.values[e];
+            }
+            status = 0;
+        }
+    }
+    free(entries.rows);
+    free(entries.cols);
+    free(entries.values);
+    free(next);
+    return status;
+}
+
+int loadMarket(const char *path, Sparse *sparse) {
+    size_t length;
+    char *text = mapText(path, &length);
+    if (!text) {
+        return -1;
+    }
+    int status = parseMarket(path, text, length, sparse);
+    munmap(text, length);
+    return status;
+}
+
+int openBinary(const char *path, int *rows, int *cols, size_t *bytes) {
+    struct stat st;
+    uint32_t dims[2];
+    char magic[MATRIX_MAGIC_SIZE];
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic) ||
+        memcmp(magic, element_types[ELEM_TYPE].magic, MATRIX_MAGIC_SIZE) != 0 ||
+        pread(fd, dims, sizeof(dims), MATRIX_MAGIC_SIZE) != sizeof(dims) ||
+        !matrixDimsValid(dims[0], dims[1]) ||
+        (size_t)st.st_size < MATRIX_HEADER_SIZE + (size_t)dims[0] * dims[1] * sizeof(elem_t)) {
+        fprintf(stderr, "%s: not a binary %s matrix\n", path, element_types[ELEM_TYPE].name);
+        close(fd);
+        return -1;
+    }
+    *rows = dims[0];
+    *cols = dims[1];
+    *bytes = st.st_size;
+    return fd;
+}
+
+int loadBinary(const char *path, Matrix *matrix) {
+    int rows, cols;
+    size_t bytes;
+    int fd = openBinary(path, &rows, &cols, &bytes);
+    if (fd < 0) {
+        return -1;
+    }
+
+    /* Private, so the matrix can be written to without touching the file. */
+    char *map = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror(path);
+        return -1;
+    }
+    matrix->rows = rows;
+    matrix->cols = cols;
+    matrix->stride = cols;
+    matrix->type = ELEM_TYPE;
+    matrix->data = map + MATRIX_HEADER_SIZE;
+    matrix->mapping = map;
+    matrix->bytes = bytes;
+    return 0;
+}
+
+int createBinary(const char *path, int rows, int cols, int type) {
+    uint32_t dims[2] = {rows, cols};
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 ||
+        pwrite(fd, element_types[type].magic, MATRIX_MAGIC_SIZE, 0) != MATRIX_MAGIC_SIZE ||
+        pwrite(fd, dims, sizeof(dims), MATRIX_MAGIC_SIZE) != sizeof(dims) ||
+        ftruncate(fd, MATRIX_HEADER_SIZE + (off_t)rows * cols * element_types[type].size) != 0) {
+        perror(path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+static char *formatInt(char *p, int64_t value) {
+    char digits[20];
+    int n = 0;
+    uint64_t u = value < 0 ? -(uint64_t)value : (uint64_t)value;
+    if (value < 0) {
+        *p++ = '-';
+    }
+    do {
+        digits[n++] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    while (n) {
+        *p++ = digits[--n];
+    }
+    return p;
+}
+
+/* Floating-point elements get enough digits to be read back exactly. */
+static char *formatElement(char *p, const void *row, int j, int type) {
+    switch (type) {
+    case TYPE_INT8: return formatInt(p, ((const int8_t *)row)[j]);
+    case TYPE_INT16: return formatInt(p, ((const int16_t *)row)[j]);
+    case TYPE_INT32: return formatInt(p, ((const int32_t *)row)[j]);
+    case TYPE_INT64: return formatInt(p, ((const int64_t *)row)[j]);
+    case TYPE_FLOAT: return p + sprintf(p, "%.9g", ((const float *)row)[j]);
+    default: return p + sprintf(p, "%.17g", ((const double *)row)[j]);
+    }
+}
+
+int storeText(FILE *file, const Matrix *matrix) {
+    char *buffer = malloc(WRITE_BUFFER_SIZE);
+    if (!buffer) {
+        return -1;
+    }
+    char *p = buffer;
+    for (int i = 0; i < matrix->rows; ++i) {
+        const void *row = matrixRow(matrix, i);
+        for (int j = 0; j < matrix->cols; ++j) {
+            if (p + MAX_FORMATTED + 1 > buffer + WRITE_BUFFER_SIZE) {
+                fwrite(buffer, 1, p - buffer, file);
+                p = buffer;
+            }
+            p = formatElement(p, row, j, matrix->type);
+            *p++ = '\t';
+        }
+        *p++ = '\n';
+    }
+    fwrite(buffer, 1, p - buffer, file);
+    free(buffer);
+    return ferror(file) ? -1 : 0;
+}
+
+int storeBinary(const char *path, const Matrix *matrix) {
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        perror(path);
+        return -1;
+    }
+    uint32_t dims[2] = {matrix->rows, matrix->cols};
+    fwrite(element_types[matrix->type].magic, 1, MATRIX_MAGIC_SIZE, file);
+    fwrite(dims, sizeof(dims), 1, file);
+    for (int i = 0; i < matrix->rows; ++i) {
+        fwrite(matrixRow(matrix, i), element_types[matrix->type].size, matrix->cols, file);
+    }
+    int failed = ferror(file);
+    if (fclose(file) != 0 || failed) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
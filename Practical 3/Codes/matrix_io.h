@@ -0,0 +1,70 @@
+#ifndef MATRIX_IO_H
+#define MATRIX_IO_H
+
+#include <stdio.h>
+#include "matrix.h"
+#include "sparse.h"
+
+/*
+ * The binary matrix format: the magic of the element type, "MATRIX01" for
+ * int32 (see element_types), the number of rows and of columns as 32-bit
+ * little-endian integers, then the elements row by row, little-endian.
+ */
+#define MATRIX_MAGIC_SIZE 8
+#define MATRIX_HEADER_SIZE 16
+
+/*
+ * Loads an input file in the text format: the thread count, then each
+ * matrix as "ROWS COLS" followed by its elements, all separated by white
+ * space, the elements read as elem_t. The file is mapped and parsed by
+ * THREADS threads, each taking a slice of it. Returns 0, or -1 after printing why the file is unusable.
+ */
+int loadText(const char *path, int threads, int *number_of_threads, Matrix *a, Matrix *b);
+
+/* Matrices A to Z of a file in the text format, see expression.h. */
+#define TEXT_MAX_MATRICES 26
+
+/*
+ * Loads every matrix of an input file in the text format, up to MAX of
+ * them, into MATRICES, setting COUNT. Unlike loadText(), one matrix is
+ * enough and their dimensions need not match.
+ */
+int loadMatrices(const char *path, int threads, int *number_of_threads, Matrix *matrices, int max,
+                 int *count);
+
+/*
+ * The Matrix Market coordinate format, for sparse matrices: a banner line
+ * "%%MatrixMarket matrix coordinate FIELD SYMMETRY", comment lines starting
+ * with %, "ROWS COLS NONZEROS", then "ROW COL VALUE" for each nonzero,
+ * counted from 1. FIELD is integer, real or pattern, which leaves out the
+ * values as they are all 1. SYMMETRY is general, or symmetric when only
+ * one triangle is listed.
+ */
+#define MARKET_BANNER "%%MatrixMarket"
+#define MARKET_BANNER_SIZE 14
+
+/* Whether PATH starts with the banner of the Matrix Market format. */
+int isMarket(const char *path);
+/* Loads a Matrix Market file of elem_t. Returns 0, or -1 after printing why not. */
+int loadMarket(const char *path, Sparse *sparse);
+
+/* Maps a matrix of elem_t in the binary format, without copying it. Returns 0 or -1. */
+int loadBinary(const char *path, Matrix *matrix);
+
+/*
+ * Opens a binary file of elem_t without mapping it. Returns the descriptor,
+ * with the dimensions and the size of the file, or -1 after saying why not.
+ */
+int openBinary(const char *path, int *rows, int *cols, size_t *bytes);
+/*
+ * Creates a binary file for a ROWS x COLS matrix of TYPE, whose elements
+ * are left to be written at MATRIX_HEADER_SIZE on. Returns the descriptor or -1.
+ */
+int createBinary(const char *path, int rows, int cols, int type);
+
+/* Writes MATRIX as text, tab after every element and a newline after every row. */
+int storeText(FILE *file, const Matrix *matrix);
+/* Writes MATRIX in the binary format. */
+int storeBinary(const char *path, const Matrix *matrix);
+
+#endif
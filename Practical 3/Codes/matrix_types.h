@@ -0,0 +1,89 @@
+#ifndef MATRIX_TYPES_H
+#define MATRIX_TYPES_H
+
+#include <stdint.h>
+
+/*
+ * The element types a matrix can be stored in. The binary format tells
+ * them apart by its magic.
+ */
+enum { TYPE_INT8, TYPE_INT16, TYPE_INT32, TYPE_INT64, TYPE_FLOAT, TYPE_DOUBLE };
+
+typedef struct {
+    const char *name;
+    int size;
+    const char *magic;
+} ElementType;
+
+extern const ElementType element_types[];
+
+/*
+ * The type set is chosen at compile time by defining one of the TYPES_
+ * macros, TYPES= in the Makefile. The inputs are made of elem_t and the
+ * result of acc_t, which is also what the sums are accumulated in.
+ *
+ *   INT32     int32 -> int32, wraps on overflow like the original program
+ *   INT32_64  int32 -> int64, exact unless a sum reaches 2^63
+ *   INT16     int16 -> int32, VNNI-style dot products of pairs, exact
+ *             while the sums fit in 32 bits
+ *   INT8      int8 -> int32, widened to int16 pairs, exact for K up to 2^17
+ *   FLOAT     float -> float
+ *   DOUBLE    double -> double
+ */
+#if defined(TYPES_INT32_64)
+typedef int32_t elem_t;
+typedef int64_t acc_t;
+#define ELEM_TYPE TYPE_INT32
+#define ACC_TYPE TYPE_INT64
+#define ELEM_IS_ACC 0
+#define ELEM_MIN INT32_MIN
+#define ELEM_MAX INT32_MAX
+#elif defined(TYPES_INT16)
+typedef int16_t elem_t;
+typedef int32_t acc_t;
+#define ELEM_TYPE TYPE_INT16
+#define ACC_TYPE TYPE_INT32
+#define ELEM_IS_ACC 0
+#define ELEM_MIN INT16_MIN
+#define ELEM_MAX INT16_MAX
+#elif defined(TYPES_INT8)
+typedef int8_t elem_t;
+typedef int32_t acc_t;
+#define ELEM_TYPE TYPE_INT8
+#define ACC_TYPE TYPE_INT32
+#define ELEM_IS_ACC 0
+#define ELEM_MIN INT8_MIN
+#define ELEM_MAX INT8_MAX
+#elif defined(TYPES_FLOAT)
+typedef float elem_t;
+typedef float acc_t;
+#define ELEM_TYPE TYPE_FLOAT
+#define ACC_TYPE TYPE_FLOAT
+#define ELEM_IS_FLOAT 1
+#elif defined(TYPES_DOUBLE)
+typedef double elem_t;
+typedef double acc_t;
+#define ELEM_TYPE TYPE_DOUBLE
+#define ACC_TYPE TYPE_DOUBLE
+#define ELEM_IS_FLOAT 1
+#else
+#ifndef TYPES_INT32
+#define TYPES_INT32
+#endif
+typedef int32_t elem_t;
+typedef int32_t acc_t;
+#define ELEM_TYPE TYPE_INT32
+#define ACC_TYPE TYPE_INT32
+#define ELEM_MIN INT32_MIN
+#define ELEM_MAX INT32_MAX
+#endif
+
+#ifndef ELEM_IS_FLOAT
+#define ELEM_IS_FLOAT 0
+#endif
+/* Whether inputs and result are of one type, which Strassen needs for its sums. */
+#ifndef ELEM_IS_ACC
+#define ELEM_IS_ACC 1
+#endif
+
+#endif
@@ -0,0 +1,255 @@
+#define _GNU_SOURCE
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "numa.h"
+
+/* Pages of a band looked up by numaLocalFraction(). */
+#define SAMPLE_PAGES 256
+/* Bits of the node masks passed to mbind(). */
+#define MASK_BITS 1024
+
+static pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+static int node_count = 1;
+static int node_ids[NUMA_MAX_NODES];            /* As numbered by the kernel. */
+static cpu_set_t node_cpus[NUMA_MAX_NODES];     /* Those we may run on. */
+static cpu_set_t allowed;
+static int cpu_count;
+/* What the calling thread was last pinned as, to skip pinning it the same way again. */
+static __thread int pinned_worker = -1, pinned_workers;
+
+/* Parses a list like "0-3,8-11\n" into SET. Returns how many it has. */
+static int parseList(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    while (*list >= '0' && *list <= '9') {
+        char *end;
+        long first = strtol(list, &end, 10), last = first;
+        if (*end == '-') {
+            last = strtol(end + 1, &end, 10);
+        }
+        for (long i = first; i <= last && i < CPU_SETSIZE; ++i) {
+            CPU_SET(i, set);
+        }
+        list = *end == ',' ? end + 1 : end;
+    }
+    return CPU_COUNT(set);
+}
+
+static int readList(const char *path, cpu_set_t *set) {
+    char list[4096];
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return 0;
+    }
+    int count = fgets(list, sizeof(list), file) ? parseList(list, set) : 0;
+    fclose(file);
+    return count;
+}
+
+/* Nodes without CPUs we may use are left out, nobody would compute there. */
+static void readTopology(void) {
+    cpu_set_t online;
+    int found = 0;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        CPU_ZERO(&allowed);
+    }
+    if (readList("/sys/devices/system/node/online", &online) > 0) {
+        for (int id = 0; id < CPU_SETSIZE && id < MASK_BITS && found < NUMA_MAX_NODES; ++id) {
+            char path[64];
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
+            if (!CPU_ISSET(id, &online) || readList(path, &node_cpus[found]) == 0) {
+                continue;
+            }
+            CPU_AND(&node_cpus[found], &node_cpus[found], &allowed);
+            if (CPU_COUNT(&node_cpus[found]) > 0) {
+                node_ids[found++] = id;
+            }
+        }
+    }
+    if (found == 0) {
+        node_ids[0] = 0;
+        node_cpus[0] = allowed;
+        found = 1;
+    }
+    node_count = found;
+    cpu_count = CPU_COUNT(&allowed);
+}
+
+int numaNodes(void) {
+    pthread_once(&topology_once, readTopology);
+    return node_count;
+}
+
+int numaNodeOf(int worker, int workers) {
+    return workers > 0 ? (long)worker * numaNodes() / workers : 0;
+}
+
+int numaBandStart(int rows, int node) {
+    return (long)rows * node / numaNodes();
+}
+
+int numaPinWorker(int worker, int workers) {
+    const char *pin = getenv("MATRIX_PIN");
+    int node = numaNodeOf(worker, workers);
+    if ((pin && strcmp(pin, "0") == 0) || cpu_count == 0) {
+        return 0;
+    }
+    if (worker == pinned_worker && workers == pinned_workers) {
+        return 1;
+    }
+    cpu_set_t set = node_cpus[node];
+    if (workers <= cpu_count) {
+        /* The workers of a node take its CPUs in turn. */
+        int first = ((long)node * workers + node_count - 1) / node_count;
+        int skip = (worker - first) % CPU_COUNT(&node_cpus[node]);
+        CPU_ZERO(&set);
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &node_cpus[node]) && skip-- == 0) {
+                CPU_SET(cpu, &set);
+                break;
+            }
+        }
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        return 0;
+    }
+    pinned_worker = worker;
+    pinned_workers = workers;
+    return 1;
+}
+
+void numaUnpin(void) {
+    pinned_worker = -1;
+    pthread_setaffinity_np(pthread_self(), sizeof(allowed), &allowed);
+}
+
+static size_t pageSize(void) {
+    return sysconf(_SC_PAGESIZE);
+}
+
+static size_t rowBytes(const Matrix *matrix) {
+    return (size_t)matrix->stride * element_types[matrix->type].size;
+}
+
+/* The pages from the one holding the first row of the band of NODE to the one before the next band. */
+static void bandPages(const Matrix *matrix, int node, char **start, char **end) {
+    size_t page = pageSize();
+    uintptr_t first = (uintptr_t)matrix->data + numaBandStart(matrix->rows, node) * rowBytes(matrix);
+    uintptr_t last = (uintptr_t)matrix->data + numaBandStart(matrix->rows, node + 1) * rowBytes(matrix);
+    if (node == node_count - 1) {
+        last = (uintptr_t)matrix->data + matrix->rows * rowBytes(matrix);
+    }
+    *start = (char *)(first & ~(page - 1));
+    *end = (char *)((last + page - 1) & ~(page - 1));
+}
+
+static int bind(char *start, char *end, int mode, const unsigned long *mask) {
+    return syscall(SYS_mbind, start, end - start, mode, mask, MASK_BITS, 0) == 0;
+}
+
+typedef struct {
+    const Matrix *matrix;
+    int node;
+    int interleave;
+} Toucher;
+
+/* Faults in the pages of one node from one of its CPUs, where they will then stay. */
+static void *touchPages(void *arg) {
+    Toucher *t = arg;
+    size_t page = pageSize();
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &node_cpus[t->node]);
+    if (t->interleave) {
+        volatile char *data = (char *)((uintptr_t)t->matrix->data & ~(page - 1));
+        size_t bytes = (char *)t->matrix->data + t->matrix->rows * rowBytes(t->matrix) - data;
+        for (size_t offset = t->node * page; offset < bytes; offset += node_count * page) {
+            data[offset] = 0;
+        }
+    } else {
+        char *start, *end;
+        bandPages(t->matrix, t->node, &start, &end);
+        for (volatile char *p = start; p < end; p += page) {
+            *p = 0;
+        }
+    }
+    return NULL;
+}
+
+static void touchAll(const Matrix *matrix, int interleave) {
+    pthread_t threads[NUMA_MAX_NODES];
+    Toucher touchers[NUMA_MAX_NODES];
+    for (int node = 0; node < node_count; ++node) {
+        touchers[node] = (Toucher){matrix, node, interleave};
+        if (pthread_create(&threads[node], NULL, touchPages, &touchers[node]) != 0) {
+            touchPages(&touchers[node]);
+            threads[node] = 0;
+        }
+    }
+    for (int node = 0; node < node_count; ++node) {
+        if (threads[node]) {
+            pthread_join(threads[node], NULL);
+        }
+    }
+}
+
+void numaPlaceRows(const Matrix *matrix) {
+    if (numaNodes() < 2 || matrix->mapping) {
+        return;
+    }
+    for (int node = 0; node < node_count; ++node) {
+        unsigned long mask[MASK_BITS / (8 * sizeof(unsigned long))] = {0};
+        char *start, *end;
+        mask[node_ids[node] / (8 * sizeof(unsigned long))] |= 1UL << node_ids[node] % (8 * sizeof(unsigned long));
+        bandPages(matrix, node, &start, &end);
+        if (!bind(start, end, MPOL_PREFERRED, mask)) {
+            touchAll(matrix, 0);
+            return;
+        }
+    }
+}
+
+void numaInterleave(const Matrix *matrix) {
+    if (numaNodes() < 2 || matrix->mapping) {
+        return;
+    }
+    unsigned long mask[MASK_BITS / (8 * sizeof(unsigned long))] = {0};
+    char *start, *end;
+    for (int node = 0; node < node_count; ++node) {
+        mask[node_ids[node] / (8 * sizeof(unsigned long))] |= 1UL << node_ids[node] % (8 * sizeof(unsigned long));
+    }
+    bandPages(matrix, 0, &start, &end);
+    end = (char *)matrix->data + matrix->rows * rowBytes(matrix);
+    end = (char *)(((uintptr_t)end + pageSize() - 1) & ~(pageSize() - 1));
+    if (!bind(start, end, MPOL_INTERLEAVE, mask)) {
+        touchAll(matrix, 1);
+    }
+}
+
+double numaLocalFraction(const Matrix *matrix, int node) {
+    void *pages[SAMPLE_PAGES];
+    int status[SAMPLE_PAGES];
+    char *start, *end;
+    size_t page = pageSize();
+    if (numaNodes() <= node || !matrix->data) {
+        return -1;
+    }
+    bandPages(matrix, node, &start, &end);
+    size_t count = (end - start) / page;
+    size_t step = count > SAMPLE_PAGES ? count / SAMPLE_PAGES : 1;
+    int sampled = 0, present = 0, local = 0;
+    for (size_t i = 0; i < count && sampled < SAMPLE_PAGES; i += step) {
+        pages[sampled++] = start + i * page;
+    }
+    if (syscall(SYS_move_pages, 0, sampled, pages, NULL, status, 0) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < sampled; ++i) {
+        present += status[i] >= 0;
+        local += status[i] == node_ids[node];
+    }
+    return present ? (double)local / present : -1;
+}
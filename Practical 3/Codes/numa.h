@@ -0,0 +1,48 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include "matrix.h"
+
+/*
+ * NUMA placement without libnuma: the topology comes from sysfs and pages
+ * are placed with mbind(), or by touching them first from a thread on the
+ * right node where mbind() is not allowed. On a single node all of this
+ * does nothing.
+ *
+ * Node N owns the band of rows numaBandStart(rows, N) up to the start of
+ * the next band, of A and C alike, and computes the tiles of C in it. B is
+ * read by every node, so its pages are spread over all of them.
+ */
+
+#define NUMA_MAX_NODES 64
+
+/* Per node figures of one multiplication. */
+typedef struct {
+    long tiles[NUMA_MAX_NODES];
+    long stolen[NUMA_MAX_NODES];    /* Tiles taken from the band of another node. */
+    double bytes[NUMA_MAX_NODES];   /* Of A, B and C streamed through the tiles. */
+} NodeTraffic;
+
+/* Nodes that have CPUs, 1 if the topology cannot be read. */
+int numaNodes(void);
+/* The node of worker WORKER out of WORKERS, which take the nodes in turn by blocks. */
+int numaNodeOf(int worker, int workers);
+int numaBandStart(int rows, int node);
+
+/*
+ * Pins the calling thread, worker WORKER out of WORKERS, to a CPU of its
+ * node, or to the whole node when there are more workers than CPUs. Not
+ * done when $MATRIX_PIN is 0. Returns whether the affinity was changed.
+ */
+int numaPinWorker(int worker, int workers);
+/* Lets the calling thread run anywhere again. */
+void numaUnpin(void);
+
+/* Places the pages of the bands of MATRIX on their nodes, before they are first written. */
+void numaPlaceRows(const Matrix *matrix);
+/* Spreads the pages of MATRIX over all nodes, before they are first written. */
+void numaInterleave(const Matrix *matrix);
+/* The fraction of a sample of the pages of the band of NODE that are on NODE. */
+double numaLocalFraction(const Matrix *matrix, int node);
+
+#endif
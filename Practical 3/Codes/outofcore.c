@@ -0,0 +1,288 @@
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "matrix_io.h"
+#include "outofcore.h"
+#include "scheduler.h"
+
+/* Tiles are a multiple of this on a side, and no smaller. */
+#define TILE_ALIGN 64
+
+/* A tile of A and the matching tile of B, read ahead of the step that uses them. */
+typedef struct {
+    elem_t *a;
+    elem_t *b;
+    int ready;      /* Read and not used yet. */
+} Slot;
+
+/*
+ * The steps go through the tiles of C row by row, and through the K tiles
+ * of each before moving on. Step S uses slot S % 2, so the I/O thread reads
+ * the next step while the current one is computed.
+ */
+typedef struct {
+    int a_fd, b_fd, c_fd;
+    int m, n, k;
+    int tile_m, tile_n, tile_k;
+    int tiles_n, tiles_k;
+    int steps;
+    Slot slots[2];
+    acc_t *pending;     /* A finished tile of C waiting to be written. */
+    int pending_i, pending_j;
+    int finished;       /* No more tiles of C will be pending. */
+    int failed;         /* A read or write failed, both threads stop. */
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} Stream;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int transfer(int fd, void *buffer, size_t bytes, off_t offset, int write) {
+    char *p = buffer;
+    while (bytes > 0) {
+        ssize_t done = write ? pwrite(fd, p, bytes, offset) : pread(fd, p, bytes, offset);
+        if (done < 0 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            return -1;
+        }
+        p += done;
+        bytes -= done;
+        offset += done;
+    }
+    return 0;
+}
+
+/*
+ * Moves the ROWS x COLS block at (ROW, COL) of the WIDTH columns wide
+ * matrix in FD to or from BUFFER, where it is stored densely.
+ */
+static int transferTile(int fd, int width, int size, int row, int col, int rows, int cols,
+                        void *buffer, int write) {
+    off_t offset = MATRIX_HEADER_SIZE + ((off_t)row * width + col) * size;
+    if (cols == width) {
+        return transfer(fd, buffer, (size_t)rows * cols * size, offset, write);
+    }
+    for (int r = 0; r < rows; ++r) {
+        if (transfer(fd, (char *)buffer + (size_t)r * cols * size, (size_t)cols * size,
+                     offset + (off_t)r * width * size, write) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int extent(int total, int tile, int index) {
+    return total - index * tile < tile ? total - index * tile : tile;
+}
+
+static void decode(const Stream *s, int step, int *i, int *j, int *p) {
+    *p = step % s->tiles_k;
+    *j = step / s->tiles_k % s->tiles_n;
+    *i = step / s->tiles_k / s->tiles_n;
+}
+
+static int readStep(Stream *s, int step, Slot *slot) {
+    int i, j, p;
+    decode(s, step, &i, &j, &p);
+    int rows = extent(s->m, s->tile_m, i), cols = extent(s->n, s->tile_n, j);
+    int depth = extent(s->k, s->tile_k, p);
+    if (transferTile(s->a_fd, s->k, sizeof(elem_t), i * s->tile_m, p * s->tile_k, rows, depth,
+                     slot->a, 0) != 0) {
+        return -1;
+    }
+    return transferTile(s->b_fd, s->n, sizeof(elem_t), p * s->tile_k, j * s->tile_n, depth, cols,
+                        slot->b, 0);
+}
+
+/* Writes finished tiles of C as soon as they come, and reads ahead while a slot is free. */
+static void *ioThread(void *arg) {
+    Stream *s = arg;
+    int next = 0;
+    pthread_mutex_lock(&s->lock);
+    while (!s->failed) {
+        if (s->pending) {
+            acc_t *tile = s->pending;
+            int i = s->pending_i, j = s->pending_j;
+            pthread_mutex_unlock(&s->lock);
+            int status = transferTile(s->c_fd, s->n, sizeof(acc_t), i * s->tile_m, j * s->tile_n,
+                                      extent(s->m, s->tile_m, i), extent(s->n, s->tile_n, j), tile, 1);
+            pthread_mutex_lock(&s->lock);
+            s->pending = NULL;
+            s->failed |= status != 0;
+            pthread_cond_broadcast(&s->changed);
+        } else if (next < s->steps && !s->slots[next % 2].ready) {
+            Slot *slot = &s->slots[next % 2];
+            pthread_mutex_unlock(&s->lock);
+            int status = readStep(s, next, slot);
+            pthread_mutex_lock(&s->lock);
+            slot->ready = 1;
+            s->failed |= status != 0;
+            next++;
+            pthread_cond_broadcast(&s->changed);
+        } else if (s->finished) {
+            break;
+        } else {
+            pthread_cond_wait(&s->changed, &s->lock);
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+/* Waits for CONDITION under the lock, adding the time waited to WAITED. */
+#define WAIT_FOR(s, condition, waited) do {                 \
+        if (!(condition)) {                                 \
+            double start_ = now();                          \
+            while (!(condition)) {                          \
+                pthread_cond_wait(&(s)->changed, &(s)->lock); \
+            }                                               \
+            *(waited) += now() - start_;                    \
+        }                                                   \
+    } while (0)
+
+static void compute(Stream *s, const GemmKernel *kernel, int threads, acc_t *c[2], acc_t *partial,
+                    double *waited) {
+    int current = 0;
+    for (int step = 0; step < s->steps; ++step) {
+        Slot *slot = &s->slots[step % 2];
+        pthread_mutex_lock(&s->lock);
+        WAIT_FOR(s, slot->ready || s->failed, waited);
+        pthread_mutex_unlock(&s->lock);
+        if (s->failed) {
+            return;
+        }
+
+        int i, j, p;
+        decode(s, step, &i, &j, &p);
+        int rows = extent(s->m, s->tile_m, i), cols = extent(s->n, s->tile_n, j);
+        int depth = extent(s->k, s->tile_k, p);
+        /* The first product of a tile goes straight into it, later ones are added. */
+        acc_t *out = p == 0 ? c[current] : partial;
+        Multiplication job = {kernel, rows, cols, depth, slot->a, depth, slot->b, cols, out, cols};
+        multiplyParallel(&job, threads);
+        if (p > 0) {
+            for (size_t e = 0; e < (size_t)rows * cols; ++e) {
+                c[current][e] += partial[e];
+            }
+        }
+
+        pthread_mutex_lock(&s->lock);
+        slot->ready = 0;
+        if (p == s->tiles_k - 1) {
+            WAIT_FOR(s, !s->pending || s->failed, waited);
+            s->pending = c[current];
+            s->pending_i = i;
+            s->pending_j = j;
+            current ^= 1;
+        }
+        pthread_cond_broadcast(&s->changed);
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+int multiplyOutOfCore(const GemmKernel *kernel, const char *a_path, const char *b_path,
+                      const char *c_path, int threads, size_t memory, OutOfCoreStats *stats) {
+    Stream s = {-1, -1, -1};
+    int b_rows, status = -1;
+    size_t bytes;
+    acc_t *c[2] = {NULL, NULL}, *partial = NULL;
+    pthread_t io;
+
+    if ((s.a_fd = openBinary(a_path, &s.m, &s.k, &bytes)) < 0 ||
+        (s.b_fd = openBinary(b_path, &b_rows, &s.n, &bytes)) < 0) {
+        goto out;
+    }
+    if (b_rows != s.k) {
+        fprintf(stderr, "Cannot multiply a %dx%d matrix by a %dx%d one\n", s.m, s.k, b_rows, s.n);
+        goto out;
+    }
+    /* Two tiles each of A and B, and three of C: two to be written in turn and a partial product. */
+    int tile = (int)sqrt(memory / (4 * sizeof(elem_t) + 3 * sizeof(acc_t))) / TILE_ALIGN * TILE_ALIGN;
+    if (tile < TILE_ALIGN) {
+        tile = TILE_ALIGN;
+    }
+    s.tile_m = s.m < tile ? s.m : tile;
+    s.tile_n = s.n < tile ? s.n : tile;
+    s.tile_k = s.k < tile ? s.k : tile;
+    s.tiles_n = (s.n + s.tile_n - 1) / s.tile_n;
+    s.tiles_k = (s.k + s.tile_k - 1) / s.tile_k;
+    s.steps = (s.m + s.tile_m - 1) / s.tile_m * s.tiles_n * s.tiles_k;
+    size_t a_tile = (size_t)s.tile_m * s.tile_k, b_tile = (size_t)s.tile_k * s.tile_n;
+    size_t c_tile = (size_t)s.tile_m * s.tile_n;
+    stats->tile = tile;
+    stats->buffer_bytes = 2 * (a_tile + b_tile) * sizeof(elem_t) + 3 * c_tile * sizeof(acc_t);
+    stats->io_wait = 0;
+    /* The tiles cannot be made smaller than TILE_ALIGN, so a smaller budget cannot be kept. */
+    if (stats->buffer_bytes > memory) {
+        fprintf(stderr, "A memory budget of %zu bytes is below the %zu bytes of the smallest tiles\n",
+                memory, stats->buffer_bytes);
+        goto out;
+    }
+    if ((s.c_fd = createBinary(c_path, s.m, s.n, ACC_TYPE)) < 0) {
+        goto out;
+    }
+
+
+    for (int i = 0; i < 2; ++i) {
+        s.slots[i].a = malloc(a_tile * sizeof(elem_t));
+        s.slots[i].b = malloc(b_tile * sizeof(elem_t));
+        c[i] = malloc(c_tile * sizeof(acc_t));
+        if (!s.slots[i].a || !s.slots[i].b || !c[i]) {
+            fprintf(stderr, "Cannot allocate the tiles\n");
+            goto out;
+        }
+    }
+    if (!(partial = malloc(c_tile * sizeof(acc_t)))) {
+        fprintf(stderr, "Cannot allocate the tiles\n");
+        goto out;
+    }
+
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.changed, NULL);
+    if (pthread_create(&io, NULL, ioThread, &s) != 0) {
+        perror("pthread_create");
+        goto out;
+    }
+    compute(&s, kernel, threads, c, partial, &stats->io_wait);
+    pthread_mutex_lock(&s.lock);
+    s.finished = 1;
+    pthread_cond_broadcast(&s.changed);
+    pthread_mutex_unlock(&s.lock);
+    pthread_join(io, NULL);
+    if (s.failed) {
+        fprintf(stderr, "I/O error while multiplying %s by %s into %s\n", a_path, b_path, c_path);
+    } else if (fsync(s.c_fd) != 0) {
+        perror(c_path);
+    } else {
+        status = 0;
+    }
+
+out:
+    for (int i = 0; i < 2; ++i) {
+        free(s.slots[i].a);
+        free(s.slots[i].b);
+        free(c[i]);
+    }
+    free(partial);
+    if (s.a_fd >= 0) {
+        close(s.a_fd);
+    }
+    if (s.b_fd >= 0) {
+        close(s.b_fd);
+    }
+    if (s.c_fd >= 0 && close(s.c_fd) != 0 && status == 0) {
+        perror(c_path);
+        status = -1;
+    }
+    return status;
+}
@@ -0,0 +1,25 @@
+#ifndef OUTOFCORE_H
+#define OUTOFCORE_H
+
+#include <stddef.h>
+#include "gemm.h"
+
+/* What an out-of-core multiplication did, for the report. */
+typedef struct {
+    int tile;               /* Side of the tiles of A, B and C. */
+    size_t buffer_bytes;    /* Memory taken by the tiles. */
+    double io_wait;         /* Seconds the computation waited for tiles. */
+} OutOfCoreStats;
+
+/*
+ * Multiplies the binary matrices in files A_PATH and B_PATH into the binary
+ * file C_PATH, a tile at a time, holding no more than about MEMORY bytes
+ * of tiles. While THREADS threads multiply one pair of tiles of A and B, a
+ * background thread reads the next pair and writes finished tiles of C.
+ * A MEMORY too small for even the smallest tiles is refused.
+ * Returns 0, or -1 after printing what failed.
+ */
+int multiplyOutOfCore(const GemmKernel *kernel, const char *a_path, const char *b_path,
+                      const char *c_path, int threads, size_t memory, OutOfCoreStats *stats);
+
+#endif
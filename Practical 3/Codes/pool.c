@@ -0,0 +1,141 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "pool.h"
+
+typedef struct {
+    pthread_t *threads;
+    int count;              /* Of waiting threads. */
+    int busy;               /* A poolRun() is using them. */
+    int stopping;
+    unsigned generation;    /* Bumped for every call handed to the pool. */
+    void *(*fn)(void *);
+    void **args;
+    int tasks;
+    int remaining;          /* Threads still running the current call. */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+} Pool;
+
+static Pool pool = {NULL, 0, 0, 0, 0, NULL, NULL, 0, 0,
+                    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+/* Thread I of the pool runs task I + 1 of every call, if there is one. */
+static void *poolThread(void *arg) {
+    int index = (int)(long)arg;
+    unsigned seen = 0;
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (pool.generation == seen && !pool.stopping) {
+            pthread_cond_wait(&pool.wake, &pool.lock);
+        }
+        if (pool.stopping) {
+            break;
+        }
+        seen = pool.generation;
+        if (index + 1 < pool.tasks) {
+            void *(*fn)(void *) = pool.fn;
+            void *task = pool.args[index + 1];
+            pthread_mutex_unlock(&pool.lock);
+            fn(task);
+            pthread_mutex_lock(&pool.lock);
+        }
+        if (--pool.remaining == 0) {
+            pthread_cond_signal(&pool.done);
+        }
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+int poolStart(int threads) {
+    pthread_mutex_lock(&pool.lock);
+    if (pool.threads || threads < 2) {
+        pthread_mutex_unlock(&pool.lock);
+        return 0;
+    }
+    pool.threads = malloc((threads - 1) * sizeof(pthread_t));
+    if (!pool.threads) {
+        pthread_mutex_unlock(&pool.lock);
+        return -1;
+    }
+    pool.stopping = 0;
+    while (pool.count < threads - 1) {
+        if (pthread_create(&pool.threads[pool.count], NULL, poolThread, (void *)(long)pool.count) != 0) {
+            perror("pthread_create");
+            break;
+        }
+        pool.count++;
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return 0;
+}
+
+void poolStop(void) {
+    pthread_mutex_lock(&pool.lock);
+    pool.stopping = 1;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 0; i < pool.count; ++i) {
+        pthread_join(pool.threads[i], NULL);
+    }
+    free(pool.threads);
+    pool.threads = NULL;
+    pool.count = 0;
+    /* Threads of the next pool start from generation 0. */
+    pool.generation = 0;
+}
+
+/* Runs the call on threads of its own, as when there was no pool. */
+static void runUnpooled(void *(*fn)(void *), void **args, int count) {
+    pthread_t threads[count];
+    int started = 0;
+    while (started < count - 1) {
+        if (pthread_create(&threads[started], NULL, fn, args[started + 1]) != 0) {
+            perror("pthread_create");
+            break;
+        }
+        started++;
+    }
+    fn(args[0]);
+    for (int i = started + 1; i < count; ++i) {
+        fn(args[i]);
+    }
+    for (int i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+void poolRun(void *(*fn)(void *), void **args, int count) {
+    if (count < 1) {
+        return;
+    }
+    pthread_mutex_lock(&pool.lock);
+    if (count == 1 || pool.busy || pool.count < count - 1) {
+        pthread_mutex_unlock(&pool.lock);
+        if (count == 1) {
+            fn(args[0]);
+        } else {
+            runUnpooled(fn, args, count);
+        }
+        return;
+    }
+    pool.busy = 1;
+    pool.fn = fn;
+    pool.args = args;
+    pool.tasks = count;
+    pool.remaining = pool.count;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+
+    fn(args[0]);
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.remaining > 0) {
+        pthread_cond_wait(&pool.done, &pool.lock);
+    }
+    pool.busy = 0;
+    pthread_mutex_unlock(&pool.lock);
+}
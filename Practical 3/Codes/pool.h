@@ -0,0 +1,23 @@
+#ifndef POOL_H
+#define POOL_H
+
+/*
+ * Threads kept waiting between multiplications, so a long-running process
+ * does not start new ones for every job, and each keeps its packed panels
+ * (see gemm.c) warm from one job to the next.
+ */
+
+/* Starts THREADS - 1 waiting threads, the caller of poolRun() being the last. Returns 0 or -1. */
+int poolStart(int threads);
+void poolStop(void);
+
+/*
+ * Calls FN(ARGS[I]) for every I below COUNT, ARGS[0] on the calling thread
+ * and the others at the same time on the pool, and returns once they all
+ * have. Threads are started for the call instead when there is no pool,
+ * when it is too small or busy, as for nested calls. Any that cannot be
+ * started are run on the calling thread after ARGS[0].
+ */
+void poolRun(void *(*fn)(void *), void **args, int count);
+
+#endif
@@ -0,0 +1,124 @@
+#include <pthread.h>
+#include <stdio.h>
+#include "pool.h"
+#include "scheduler.h"
+
+/*
+ * A tile is sized for the blocking in gemm.c, so a thread reuses its packed
+ * panel of A across the whole tile width. Tiles shrink when there would be
+ * too few of them to keep every thread busy until the end.
+ */
+#define TILE_M 96
+#define TILE_N 512
+#define MIN_TILE 64
+#define TILES_PER_THREAD 4
+
+static pthread_mutex_t traffic_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct {
+    const Multiplication *job;
+    int tile_m;
+    int tile_n;
+    int tiles_per_row;
+    int tiles;
+    int threads;
+    int nodes;
+    int next_tile[NUMA_MAX_NODES];  /* Taken with an atomic add, no locks or syscalls. */
+    int end_tile[NUMA_MAX_NODES];
+} Schedule;
+
+typedef struct {
+    Schedule *schedule;
+    int index;
+} Worker;
+
+/* Computes TILE, adding the bytes of A, B and C it goes through to BYTES. */
+static void computeTile(const Schedule *schedule, int tile, double *bytes) {
+    const Multiplication *job = schedule->job;
+    int i = tile / schedule->tiles_per_row * schedule->tile_m;
+    int j = tile % schedule->tiles_per_row * schedule->tile_n;
+    int rows = job->m - i < schedule->tile_m ? job->m - i : schedule->tile_m;
+    int cols = job->n - j < schedule->tile_n ? job->n - j : schedule->tile_n;
+    const elem_t *a = job->a_transposed ? job->a + i : job->a + (size_t)i * job->lda;
+    const elem_t *b = job->b_transposed ? job->b + (size_t)j * job->ldb : job->b + j;
+    const elem_t *add = job->add ? job->add + (size_t)i * job->ldadd + j : NULL;
+    gemmBlockFused(job->kernel, rows, cols, job->k, a, job->lda, job->a_transposed, b, job->ldb,
+                   job->b_transposed, add, job->ldadd, job->c + (size_t)i * job->ldc + j, job->ldc);
+    *bytes += ((double)rows * job->k + (double)job->k * cols) * sizeof(elem_t) +
+              (double)rows * cols * sizeof(acc_t);
+}
+
+static void *threadFunction(void *arg) {
+    Worker *worker = arg;
+    Schedule *schedule = worker->schedule;
+    NodeTraffic *traffic = schedule->job->traffic;
+    int home = numaNodeOf(worker->index, schedule->threads);
+    long tiles = 0, stolen = 0;
+    double bytes = 0;
+    /* A lone worker may be one of several multiplications running at once. */
+    if (schedule->threads > 1) {
+        numaPinWorker(worker->index, schedule->threads);
+    }
+    for (int other = 0; other < schedule->nodes; ++other) {
+        int node = (home + other) % schedule->nodes;
+        int tile;
+        while ((tile = __atomic_fetch_add(&schedule->next_tile[node], 1, __ATOMIC_RELAXED)) <
+               schedule->end_tile[node]) {
+            computeTile(schedule, tile, &bytes);
+            tiles++;
+            stolen += other > 0;
+        }
+    }
+    if (traffic) {
+        __atomic_fetch_add(&traffic->tiles[home], tiles, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&traffic->stolen[home], stolen, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&traffic_lock);
+        traffic->bytes[home] += bytes;
+        pthread_mutex_unlock(&traffic_lock);
+    }
+    return NULL;
+}
+
+static int countTiles(Schedule *schedule) {
+    const Multiplication *job = schedule->job;
+    schedule->tiles_per_row = (job->n + schedule->tile_n - 1) / schedule->tile_n;
+    schedule->tiles = (job->m + schedule->tile_m - 1) / schedule->tile_m * schedule->tiles_per_row;
+    return schedule->tiles;
+}
+
+void multiplyParallel(const Multiplication *job, int threads) {
+    Schedule schedule = {job, TILE_M, TILE_N};
+    if (threads < 1) {
+        threads = 1;
+    }
+    while (countTiles(&schedule) < TILES_PER_THREAD * threads && schedule.tile_n > MIN_TILE) {
+        schedule.tile_n /= 2;
+    }
+    if (schedule.tiles == 0) {
+        return;
+    }
+    if (threads > schedule.tiles) {
+        threads = schedule.tiles;
+    }
+    schedule.threads = threads;
+    schedule.nodes = numaNodes();
+    /* A row of tiles belongs to the node whose band holds its first row. */
+    for (int node = 0; node < schedule.nodes; ++node) {
+        int first = (numaBandStart(job->m, node) + schedule.tile_m - 1) / schedule.tile_m;
+        int last = (numaBandStart(job->m, node + 1) + schedule.tile_m - 1) / schedule.tile_m;
+        schedule.next_tile[node] = first * schedule.tiles_per_row;
+        schedule.end_tile[node] = node == schedule.nodes - 1 ? schedule.tiles : last * schedule.tiles_per_row;
+    }
+
+    /* The calling thread computes tiles as well, as worker 0. */
+    Worker workers[threads];
+    void *args[threads];
+    for (int i = 0; i < threads; ++i) {
+        workers[i] = (Worker){&schedule, i};
+        args[i] = &workers[i];
+    }
+    poolRun(threadFunction, args, threads);
+    if (threads > 1) {
+        numaUnpin();
+    }
+}
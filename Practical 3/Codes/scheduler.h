@@ -0,0 +1,40 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "gemm.h"
+#include "numa.h"
+
+/*
+ * C = A * B, with A being M x K and B being K x N, all row-major, or C =
+ * A * B + ADD when ADD is set. A transposed operand is stored the other
+ * way round, as K x M or N x K, and read in place (see gemmBlockFused()).
+ */
+typedef struct {
+    const GemmKernel *kernel;
+    int m, n, k;
+    const elem_t *a;
+    int lda;
+    const elem_t *b;
+    int ldb;
+    acc_t *c;
+    int ldc;
+    NodeTraffic *traffic;   /* Added to when not NULL. */
+    int a_transposed;
+    int b_transposed;
+    const elem_t *add;
+    int ldadd;
+} Multiplication;
+
+/*
+ * Splits C into tiles and has THREADS threads compute them, each taking the
+ * next tile from a shared counter until none are left. The calling thread
+ * is one of them, so C is complete even if no other thread can be started.
+ * The others come from the pool (see pool.h) when one is running.
+ *
+ * Every NUMA node has a counter of its own over the tiles in its band of
+ * rows (see numa.h). The threads are pinned to the nodes in turn and take
+ * tiles from their own node first, then from the others once it has none.
+ */
+void multiplyParallel(const Multiplication *job, int threads);
+
+#endif
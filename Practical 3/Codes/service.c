@@ -0,0 +1,320 @@
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include "matrix_io.h"
+#include "pool.h"
+#include "scheduler.h"
+#include "service.h"
+
+/* Longest job line, longer ones are cut and fail to load. */
+#define JOB_LINE 8192
+#define READ_BUFFER 65536
+
+typedef struct {
+    int fd;
+    size_t length;
+    int ended;
+    char buffer[READ_BUFFER];
+} Reader;
+
+typedef struct {
+    char line[JOB_LINE];
+    char *paths[3];
+    int binary;
+    Matrix a, b, c;
+    int small;
+    int failed;
+    double seconds;
+} Job;
+
+typedef struct {
+    const GemmKernel *kernel;
+    Job *jobs;
+    int count;
+    int next;       /* Taken with an atomic add. */
+} Batch;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Copies the next line of R to LINE without its newline. Returns 1 for a
+ * line, 0 at the end or, unless WAIT, when no whole line has arrived yet,
+ * and -1 on a read error.
+ */
+static int readLine(Reader *r, char *line, int wait) {
+    for (;;) {
+        char *newline = memchr(r->buffer, '\n', r->length);
+        if (newline || (r->ended && r->length > 0) || r->length == sizeof(r->buffer)) {
+            size_t length = newline ? (size_t)(newline - r->buffer) : r->length;
+            size_t used = newline ? length + 1 : length;
+            if (length >= JOB_LINE) {
+                length = JOB_LINE - 1;
+            }
+            memcpy(line, r->buffer, length);
+            line[length] = '\0';
+            memmove(r->buffer, r->buffer + used, r->length - used);
+            r->length -= used;
+            return 1;
+        }
+        if (r->ended) {
+            return 0;
+        }
+        struct pollfd ready = {r->fd, POLLIN, 0};
+        if (!wait && poll(&ready, 1, 0) <= 0) {
+            return 0;
+        }
+        ssize_t got = read(r->fd, r->buffer + r->length, sizeof(r->buffer) - r->length);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got < 0) {
+            return -1;
+        }
+        r->ended = got == 0;
+        r->length += got;
+    }
+}
+
+static int splitJob(Job *job) {
+    char *rest = job->line, *field;
+    int count = 0;
+    while ((field = strtok_r(rest, " \t\r", &rest))) {
+        if (count == 3) {
+            return 0;
+        }
+        job->paths[count++] = field;
+    }
+    job->binary = count == 3;
+    return count >= 2;
+}
+
+static int loadJob(Job *job) {
+    int ignored;
+    if (!splitJob(job)) {
+        fprintf(stderr, "Not a job: %s\n", job->line);
+        return -1;
+    }
+    if (!job->binary) {
+        return loadText(job->paths[0], 1, &ignored, &job->a, &job->b);
+    }
+    if (loadBinary(job->paths[0], &job->a) != 0) {
+        return -1;
+    }
+    if (loadBinary(job->paths[1], &job->b) != 0) {
+        matrixDestroy(&job->a);
+        return -1;
+    }
+    if (job->a.cols != job->b.rows) {
+        fprintf(stderr, "Cannot multiply a %dx%d matrix by a %dx%d one\n",
+                job->a.rows, job->a.cols, job->b.rows, job->b.cols);
+        matrixDestroy(&job->a);
+        matrixDestroy(&job->b);
+        return -1;
+    }
+    return 0;
+}
+
+static int storeJob(const Job *job) {
+    const char *path = job->paths[job->binary ? 2 : 1];
+    if (job->binary) {
+        return storeBinary(path, &job->c);
+    }
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        perror(path);
+        return -1;
+    }
+    int status = storeText(file, &job->c);
+    if (fclose(file) != 0) {
+        status = -1;
+    }
+    if (status != 0) {
+        fprintf(stderr, "Cannot write %s\n", path);
+    }
+    return status;
+}
+
+static void finishJob(Job *job) {
+    job->failed = storeJob(job) != 0;
+    matrixDestroy(&job->a);
+    matrixDestroy(&job->b);
+    matrixDestroy(&job->c);
+}
+
+/* Loads the jobs of a batch, and multiplies and stores the small ones while at it. */
+static void *prepareJobs(void *arg) {
+    Batch *batch = arg;
+    int i;
+    while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < batch->count) {
+        Job *job = &batch->jobs[i];
+        if (loadJob(job) != 0) {
+            job->failed = 1;
+            continue;
+        }
+        int m = job->a.rows, n = job->b.cols, k = job->a.cols;
+        if (matrixCreate(&job->c, m, n, ACC_TYPE) != 0) {
+            fprintf(stderr, "Cannot allocate a %dx%d matrix\n", m, n);
+            matrixDestroy(&job->a);
+            matrixDestroy(&job->b);
+            job->failed = 1;
+            continue;
+        }
+        job->small = (double)m * n * k <= SMALL_WORK;
+        if (job->small) {
+            double start = now();
+            gemmBlock(batch->kernel, m, n, k, job->a.data, job->a.stride,
+                      job->b.data, job->b.stride, job->c.data, job->c.stride);
+            job->seconds = now() - start;
+            finishJob(job);
+        }
+    }
+    return NULL;
+}
+
+static int writeAll(int fd, const char *text, size_t length) {
+    while (length > 0) {
+        ssize_t done = write(fd, text, length);
+        if (done < 0 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            return -1;
+        }
+        text += done;
+        length -= done;
+    }
+    return 0;
+}
+
+static int runBatch(const GemmKernel *kernel, Job *jobs, int count, int threads, int out) {
+    Batch batch = {kernel, jobs, count, 0};
+    int tasks = threads < count ? threads : count;
+    void *args[tasks];
+    for (int i = 0; i < tasks; ++i) {
+        args[i] = &batch;
+    }
+    poolRun(prepareJobs, args, tasks);
+
+    for (int i = 0; i < count; ++i) {
+        Job *job = &jobs[i];
+        if (job->failed || job->small) {
+            continue;
+        }
+        Multiplication multiplication = {kernel, job->a.rows, job->b.cols, job->a.cols,
+                                         job->a.data, job->a.stride, job->b.data, job->b.stride,
+                                         job->c.data, job->c.stride};
+        double start = now();
+        multiplyParallel(&multiplication, threads);
+        job->seconds = now() - start;
+        finishJob(job);
+    }
+
+    /* Answered together, in one write for a batch of small jobs. */
+    size_t size = (size_t)count * (JOB_LINE + 32), length = 0;
+    char *answers = malloc(size);
+    if (!answers) {
+        return -1;
+    }
+    for (int i = 0; i < count; ++i) {
+        const char *path = jobs[i].paths[jobs[i].binary ? 2 : 1];
+        if (!path) {
+            path = jobs[i].line;
+        }
+        if (jobs[i].failed) {
+            length += snprintf(answers + length, size - length, "%s error\n", path);
+        } else {
+            length += snprintf(answers + length, size - length, "%s ok %.6f\n", path, jobs[i].seconds);
+        }
+    }
+    int status = writeAll(out, answers, length);
+    free(answers);
+    return status;
+}
+
+int serveStream(int in, int out, int threads) {
+    Reader *reader = malloc(sizeof(Reader));
+    Job *jobs = malloc(SERVICE_BATCH * sizeof(Job));
+    const GemmKernel *kernel = selectKernel();
+    int status = 0;
+    if (!reader || !jobs) {
+        fprintf(stderr, "Cannot allocate the job buffers\n");
+        free(reader);
+        free(jobs);
+        return -1;
+    }
+    reader->fd = in;
+    reader->length = 0;
+    reader->ended = 0;
+    signal(SIGPIPE, SIG_IGN);
+
+    for (;;) {
+        int count = 0, got;
+        /* Waits for one job, then takes whatever else is already there. */
+        while (count < SERVICE_BATCH && (got = readLine(reader, jobs[count].line, count == 0)) > 0) {
+            if (strspn(jobs[count].line, " \t\r") == strlen(jobs[count].line)) {
+                continue;
+            }
+            memset(jobs[count].paths, 0, sizeof(jobs[count].paths));
+            jobs[count].failed = jobs[count].small = 0;
+            jobs[count].seconds = 0;
+            count++;
+        }
+        if (count > 0 && runBatch(kernel, jobs, count, threads, out) != 0) {
+            status = -1;
+            break;
+        }
+        if (got < 0) {
+            perror("read");
+            status = -1;
+            break;
+        }
+        if (count == 0 && got == 0) {
+            break;
+        }
+    }
+    free(reader);
+    free(jobs);
+    return status;
+}
+
+int serveSocket(const char *path, int threads) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "%s: too long for a socket\n", path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0) {
+        perror("socket");
+        return -1;
+    }
+    unlink(path);
+    if (bind(server, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(server, SOMAXCONN) != 0) {
+        perror(path);
+        close(server);
+        return -1;
+    }
+    for (;;) {
+        int client = accept(server, NULL, NULL);
+        if (client < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                perror("accept");
+            }
+            continue;
+        }
+        serveStream(client, client, threads);
+        close(client);
+    }
+}
@@ -0,0 +1,36 @@
+#ifndef SERVICE_H
+#define SERVICE_H
+
+/*
+ * Service mode: multiplies a stream of jobs, one per line, with the same
+ * threads from start to end (see pool.h).
+ *
+ *     INPUT OUTPUT    the two matrices of the text file INPUT, the
+ *                     result written as text to OUTPUT
+ *     A B OUTPUT      the binary files A and B, the result written in
+ *                     the binary format to OUTPUT
+ *
+ * Each job is answered with a line "OUTPUT ok SECONDS", SECONDS being the
+ * time taken to multiply, or "OUTPUT error" after saying why on standard
+ * error. Answers come in the order of the jobs.
+ *
+ * The jobs that have already arrived when one is read are taken together,
+ * up to SERVICE_BATCH of them. The matrices of a batch are loaded at the
+ * same time, and the small jobs, of at most SMALL_WORK multiply-adds, are
+ * spread over the threads a whole job each. The others are then split
+ * over all threads one after the other.
+ */
+#define SERVICE_BATCH 64
+#define SMALL_WORK (128 * 128 * 128)
+
+/* Runs the jobs read from IN, answering on OUT, until IN ends. Returns 0, or -1 on a read or write error. */
+int serveStream(int in, int out, int threads);
+
+/*
+ * Listens on the UNIX socket PATH, replacing any file there, and serves
+ * one connection at a time as a stream of jobs. Returns -1 if the socket
+ * cannot be set up, and does not return otherwise.
+ */
+int serveSocket(const char *path, int threads);
+
+#endif
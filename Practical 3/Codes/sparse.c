@@ -0,0 +1,187 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sparse.h"
+
+/* Rows of C taken from the counter at a time. */
+#define ROW_CHUNK 16
+
+typedef struct SparseJob {
+    const Sparse *sa;
+    const Matrix *da;
+    const Sparse *sb;
+    const Matrix *db;
+    Matrix *c;
+    void (*row)(const struct SparseJob *job, int i, acc_t *c);
+    int next_row;   /* Taken with an atomic add. */
+} SparseJob;
+
+int sparseCreate(Sparse *sparse, int rows, int cols, size_t nnz) {
+    sparse->offsets = NULL;
+    sparse->indices = NULL;
+    sparse->values = NULL;
+    if (!matrixDimsValid(rows, cols)) {
+        return -1;
+    }
+    sparse->rows = rows;
+    sparse->cols = cols;
+    sparse->nnz = nnz;
+    sparse->offsets = calloc((size_t)rows + 1, sizeof(size_t));
+    /* One extra element, so that an empty matrix still gets its arrays. */
+    sparse->indices = malloc((nnz + 1) * sizeof(int));
+    sparse->values = malloc((nnz + 1) * sizeof(elem_t));
+    if (!sparse->offsets || !sparse->indices || !sparse->values) {
+        sparseDestroy(sparse);
+        return -1;
+    }
+    return 0;
+}
+
+void sparseDestroy(Sparse *sparse) {
+    free(sparse->offsets);
+    free(sparse->indices);
+    free(sparse->values);
+    sparse->offsets = NULL;
+    sparse->indices = NULL;
+    sparse->values = NULL;
+}
+
+size_t countNonzeros(const Matrix *dense) {
+    size_t nnz = 0;
+    for (int i = 0; i < dense->rows; ++i) {
+        const elem_t *row = matrixRow(dense, i);
+        for (int j = 0; j < dense->cols; ++j) {
+            nnz += row[j] != 0;
+        }
+    }
+    return nnz;
+}
+
+int sparseFromDense(Sparse *sparse, const Matrix *dense) {
+    if (sparseCreate(sparse, dense->rows, dense->cols, countNonzeros(dense)) != 0) {
+        return -1;
+    }
+    size_t nnz = 0;
+    for (int i = 0; i < dense->rows; ++i) {
+        const elem_t *row = matrixRow(dense, i);
+        for (int j = 0; j < dense->cols; ++j) {
+            if (row[j] != 0) {
+                sparse->indices[nnz] = j;
+                sparse->values[nnz++] = row[j];
+            }
+        }
+        sparse->offsets[i + 1] = nnz;
+    }
+    return 0;
+}
+
+int sparseToDense(Matrix *dense, const Sparse *sparse) {
+    if (matrixCreate(dense, sparse->rows, sparse->cols, ELEM_TYPE) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < sparse->rows; ++i) {
+        elem_t *row = matrixRow(dense, i);
+        memset(row, 0, sparse->cols * sizeof(elem_t));
+        for (size_t p = sparse->offsets[i]; p < sparse->offsets[i + 1]; ++p) {
+            row[sparse->indices[p]] += sparse->values[p];
+        }
+    }
+    return 0;
+}
+
+/* C += V * B over N elements, the one loop worth vectorizing here. */
+__attribute__((target_clones("avx512f", "avx2", "default")))
+static void addScaled(int n, acc_t v, const elem_t *restrict b, acc_t *restrict c) {
+    for (int j = 0; j < n; ++j) {
+        c[j] += v * b[j];
+    }
+}
+
+static void sparseDenseRow(const SparseJob *job, int i, acc_t *c) {
+    const Sparse *a = job->sa;
+    for (size_t p = a->offsets[i]; p < a->offsets[i + 1]; ++p) {
+        addScaled(job->db->cols, a->values[p], matrixRow(job->db, a->indices[p]), c);
+    }
+}
+
+static void denseSparseRow(const SparseJob *job, int i, acc_t *c) {
+    const elem_t *a = matrixRow(job->da, i);
+    const Sparse *b = job->sb;
+    for (int k = 0; k < job->da->cols; ++k) {
+        acc_t v = a[k];
+        if (v == 0) {
+            continue;
+        }
+        for (size_t p = b->offsets[k]; p < b->offsets[k + 1]; ++p) {
+            c[b->indices[p]] += v * b->values[p];
+        }
+    }
+}
+
+/* Gustavson's algorithm, with the dense row of C as the accumulator. */
+static void sparseSparseRow(const SparseJob *job, int i, acc_t *c) {
+    const Sparse *a = job->sa, *b = job->sb;
+    for (size_t p = a->offsets[i]; p < a->offsets[i + 1]; ++p) {
+        acc_t v = a->values[p];
+        int k = a->indices[p];
+        for (size_t q = b->offsets[k]; q < b->offsets[k + 1]; ++q) {
+            c[b->indices[q]] += v * b->values[q];
+        }
+    }
+}
+
+static void *threadFunction(void *arg) {
+    SparseJob *job = arg;
+    int first;
+    while ((first = __atomic_fetch_add(&job->next_row, ROW_CHUNK, __ATOMIC_RELAXED)) < job->c->rows) {
+        int last = first + ROW_CHUNK < job->c->rows ? first + ROW_CHUNK : job->c->rows;
+        for (int i = first; i < last; ++i) {
+            acc_t *c = matrixRow(job->c, i);
+            memset(c, 0, job->c->cols * sizeof(acc_t));
+            job->row(job, i, c);
+        }
+    }
+    return NULL;
+}
+
+static void runRows(SparseJob *job, int threads) {
+    int chunks = (job->c->rows + ROW_CHUNK - 1) / ROW_CHUNK;
+    if (threads > chunks) {
+        threads = chunks;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+
+    /* The calling thread computes rows as well. */
+    pthread_t workers[threads];
+    int started = 0;
+    job->next_row = 0;
+    while (started < threads - 1) {
+        if (pthread_create(&workers[started], NULL, threadFunction, job) != 0) {
+            perror("pthread_create");
+            break;
+        }
+        started++;
+    }
+    threadFunction(job);
+    for (int i = 0; i < started; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+}
+
+void multiplySparseDense(const Sparse *a, const Matrix *b, Matrix *c, int threads) {
+    SparseJob job = {a, NULL, NULL, b, c, sparseDenseRow, 0};
+    runRows(&job, threads);
+}
+
+void multiplyDenseSparse(const Matrix *a, const Sparse *b, Matrix *c, int threads) {
+    SparseJob job = {NULL, a, b, NULL, c, denseSparseRow, 0};
+    runRows(&job, threads);
+}
+
+void multiplySparseSparse(const Sparse *a, const Sparse *b, Matrix *c, int threads) {
+    SparseJob job = {a, NULL, b, NULL, c, sparseSparseRow, 0};
+    runRows(&job, threads);
+}
@@ -0,0 +1,47 @@
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include "matrix.h"
+
+/*
+ * An operand with at most this fraction of nonzeros is multiplied by the
+ * sparse kernels rather than the blocked one, see matrix_bench -p.
+ */
+#define SPARSE_DENSITY 0.1
+
+/*
+ * A matrix of elem_t in compressed sparse row form: row I has the nonzeros
+ * values[offsets[I]] up to values[offsets[I + 1]], in the columns given by
+ * the same range of indices, in no particular order.
+ */
+typedef struct {
+    int rows;
+    int cols;
+    size_t nnz;
+    size_t *offsets;
+    int *indices;
+    elem_t *values;
+} Sparse;
+
+/* Allocates a ROWS x COLS matrix with room for NNZ nonzeros. Returns 0 or -1. */
+int sparseCreate(Sparse *sparse, int rows, int cols, size_t nnz);
+void sparseDestroy(Sparse *sparse);
+
+/* Converts between the forms, the destination is created. Return 0 or -1. */
+int sparseFromDense(Sparse *sparse, const Matrix *dense);
+int sparseToDense(Matrix *dense, const Sparse *sparse);
+
+/* The number of nonzero elements of a dense matrix of elem_t. */
+size_t countNonzeros(const Matrix *dense);
+
+/*
+ * C = A * B, C being a dense matrix of acc_t of the right size. THREADS
+ * threads compute C, each taking the next few rows from a shared counter.
+ * Sparse times dense adds whole rows of B, scaled, to the rows of C; the
+ * others scatter products into the rows of C.
+ */
+void multiplySparseDense(const Sparse *a, const Matrix *b, Matrix *c, int threads);
+void multiplyDenseSparse(const Matrix *a, const Sparse *b, Matrix *c, int threads);
+void multiplySparseSparse(const Sparse *a, const Sparse *b, Matrix *c, int threads);
+
+#endif
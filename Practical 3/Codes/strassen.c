@@ -0,0 +1,195 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "strassen.h"
+
+#if ELEM_IS_ACC
+
+/* Leading dimensions of temporaries are rounded up to whole cache lines. */
+#define LINE_ELEMS (64 / (int)sizeof(elem_t))
+
+/* Integer sums are taken unsigned so that overflow wraps. */
+#if ELEM_IS_FLOAT
+typedef elem_t wrap_t;
+#else
+typedef uint32_t wrap_t;
+#endif
+
+typedef struct {
+    const elem_t *x;
+    int ldx;
+    const elem_t *y;
+    int ldy;
+    elem_t *p;
+} Product;
+
+typedef struct {
+    const GemmKernel *kernel;
+    int cutoff;
+    int m, n, k;        /* Of each of the seven products. */
+    int ldp;
+    Product products[7];
+    int threads;        /* For each product. */
+    int next_product;
+} Products;
+
+static void strassen(const GemmKernel *kernel, int threads, int cutoff, int m, int n, int k,
+                     const elem_t *a, int lda, const elem_t *b, int ldb, elem_t *c, int ldc);
+
+/* Z = X + SIGN * Y. */
+static void addBlocks(int m, int n, const elem_t *x, int ldx, const elem_t *y, int ldy,
+                      elem_t *z, int ldz, int sign) {
+    for (int i = 0; i < m; ++i) {
+        const wrap_t *xr = (const wrap_t *)x + (size_t)i * ldx;
+        const wrap_t *yr = (const wrap_t *)y + (size_t)i * ldy;
+        wrap_t *zr = (wrap_t *)z + (size_t)i * ldz;
+        if (sign > 0) {
+            for (int j = 0; j < n; ++j) {
+                zr[j] = xr[j] + yr[j];
+            }
+        } else {
+            for (int j = 0; j < n; ++j) {
+                zr[j] = xr[j] - yr[j];
+            }
+        }
+    }
+}
+
+static elem_t *allocateBlocks(int count, int rows, int ld) {
+    void *p;
+    if (posix_memalign(&p, 64, (size_t)count * rows * ld * sizeof(elem_t)) != 0) {
+        abort();
+    }
+    return p;
+}
+
+static void *productThread(void *arg) {
+    Products *work = arg;
+    int i;
+    while ((i = __atomic_fetch_add(&work->next_product, 1, __ATOMIC_RELAXED)) < 7) {
+        Product *p = &work->products[i];
+        strassen(work->kernel, work->threads, work->cutoff, work->m, work->n, work->k,
+                 p->x, p->ldx, p->y, p->ldy, p->p, work->ldp);
+    }
+    return NULL;
+}
+
+static void computeProducts(Products *work, int threads) {
+    int workers = threads < 7 ? threads : 7;
+    pthread_t ids[7];
+    int started = 0;
+    work->threads = threads / workers;
+    work->next_product = 0;
+    while (started < workers - 1 && pthread_create(&ids[started], NULL, productThread, work) == 0) {
+        started++;
+    }
+    productThread(work);
+    for (int i = 0; i < started; ++i) {
+        pthread_join(ids[i], NULL);
+    }
+}
+
+/* C = A * B for even M, N and K, seven products of the quadrants. */
+static void winograd(const GemmKernel *kernel, int threads, int cutoff, int m, int n, int k,
+                     const elem_t *a, int lda, const elem_t *b, int ldb, elem_t *c, int ldc) {
+    int m2 = m / 2, n2 = n / 2, k2 = k / 2;
+    const elem_t *a11 = a, *a12 = a + k2, *a21 = a + (size_t)m2 * lda, *a22 = a21 + k2;
+    const elem_t *b11 = b, *b12 = b + n2, *b21 = b + (size_t)k2 * ldb, *b22 = b21 + n2;
+    elem_t *c11 = c, *c12 = c + n2, *c21 = c + (size_t)m2 * ldc, *c22 = c21 + n2;
+
+    int lds = (k2 + LINE_ELEMS - 1) / LINE_ELEMS * LINE_ELEMS;
+    int ldt = (n2 + LINE_ELEMS - 1) / LINE_ELEMS * LINE_ELEMS;
+    int ldp = ldt;
+    elem_t *s = allocateBlocks(4, m2, lds);
+    elem_t *t = allocateBlocks(4, k2, ldt);
+    elem_t *p = allocateBlocks(7, m2, ldp);
+    elem_t *s1 = s, *s2 = s1 + (size_t)m2 * lds, *s3 = s2 + (size_t)m2 * lds, *s4 = s3 + (size_t)m2 * lds;
+    elem_t *t1 = t, *t2 = t1 + (size_t)k2 * ldt, *t3 = t2 + (size_t)k2 * ldt, *t4 = t3 + (size_t)k2 * ldt;
+    elem_t *pi[7];
+    for (int i = 0; i < 7; ++i) {
+        pi[i] = p + (size_t)i * m2 * ldp;
+    }
+
+    addBlocks(m2, k2, a21, lda, a22, lda, s1, lds, 1);
+    addBlocks(m2, k2, s1, lds, a11, lda, s2, lds, -1);
+    addBlocks(m2, k2, a11, lda, a21, lda, s3, lds, -1);
+    addBlocks(m2, k2, a12, lda, s2, lds, s4, lds, -1);
+    addBlocks(k2, n2, b12, ldb, b11, ldb, t1, ldt, -1);
+    addBlocks(k2, n2, b22, ldb, t1, ldt, t2, ldt, -1);
+    addBlocks(k2, n2, b22, ldb, b12, ldb, t3, ldt, -1);
+    addBlocks(k2, n2, t2, ldt, b21, ldb, t4, ldt, -1);
+
+    Products work = {kernel, cutoff, m2, n2, k2, ldp, {
+        {a11, lda, b11, ldb, pi[0]},
+        {a12, lda, b21, ldb, pi[1]},
+        {s4, lds, b22, ldb, pi[2]},
+        {a22, lda, t4, ldt, pi[3]},
+        {s1, lds, t1, ldt, pi[4]},
+        {s2, lds, t2, ldt, pi[5]},
+        {s3, lds, t3, ldt, pi[6]},
+    }, 1, 0};
+    computeProducts(&work, threads);
+
+    /* U2 = P1 + P6, U3 = U2 + P7, U4 = U2 + P5, all in place. */
+    addBlocks(m2, n2, pi[0], ldp, pi[1], ldp, c11, ldc, 1);
+    addBlocks(m2, n2, pi[0], ldp, pi[5], ldp, pi[5], ldp, 1);
+    addBlocks(m2, n2, pi[5], ldp, pi[6], ldp, pi[6], ldp, 1);
+    addBlocks(m2, n2, pi[5], ldp, pi[4], ldp, pi[5], ldp, 1);
+    addBlocks(m2, n2, pi[5], ldp, pi[2], ldp, c12, ldc, 1);
+    addBlocks(m2, n2, pi[6], ldp, pi[3], ldp, c21, ldc, -1);
+    addBlocks(m2, n2, pi[6], ldp, pi[4], ldp, c22, ldc, 1);
+
+    free(s);
+    free(t);
+    free(p);
+}
+
+static void strassen(const GemmKernel *kernel, int threads, int cutoff, int m, int n, int k,
+                     const elem_t *a, int lda, const elem_t *b, int ldb, elem_t *c, int ldc) {
+    if (m <= cutoff || n <= cutoff || k <= cutoff) {
+        Multiplication job = {kernel, m, n, k, a, lda, b, ldb, c, ldc};
+        multiplyParallel(&job, threads);
+        return;
+    }
+
+    int me = m & ~1, ne = n & ~1, ke = k & ~1;
+    winograd(kernel, threads, cutoff, me, ne, ke, a, lda, b, ldb, c, ldc);
+
+    /* The odd row, column and inner index are peeled off. */
+    if (ke < k) {
+        for (int i = 0; i < me; ++i) {
+            wrap_t x = a[(size_t)i * lda + ke];
+            const wrap_t *y = (const wrap_t *)b + (size_t)ke * ldb;
+            wrap_t *z = (wrap_t *)c + (size_t)i * ldc;
+            for (int j = 0; j < ne; ++j) {
+                z[j] += x * y[j];
+            }
+        }
+    }
+    if (ne < n) {
+        gemmBlock(kernel, me, 1, k, a, lda, b + ne, ldb, c + ne, ldc);
+    }
+    if (me < m) {
+        gemmBlock(kernel, 1, n, k, a + (size_t)me * lda, lda, b, ldb, c + (size_t)me * ldc, ldc);
+    }
+}
+
+void multiplyStrassen(const Multiplication *job, int threads, int cutoff) {
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (cutoff < 1) {
+        cutoff = 1;
+    }
+    strassen(job->kernel, threads, cutoff, job->m, job->n, job->k,
+             job->a, job->lda, job->b, job->ldb, job->c, job->ldc);
+}
+
+#else
+
+/* The sums of inputs could overflow them, so the blocked kernel does it all. */
+void multiplyStrassen(const Multiplication *job, int threads, int cutoff) {
+    multiplyParallel(job, threads);
+}
+
+#endif
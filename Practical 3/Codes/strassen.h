@@ -0,0 +1,21 @@
+#ifndef STRASSEN_H
+#define STRASSEN_H
+
+#include "scheduler.h"
+
+/* Blocks this small or smaller are left to the blocked kernel, see matrix_bench -c. */
+#define STRASSEN_CUTOFF 2048
+
+/*
+ * Multiplies with the Winograd form of Strassen's algorithm: seven half-size
+ * products instead of eight, applied recursively until a block has a side
+ * of CUTOFF or less, which goes to the blocked kernel. Odd sides are peeled
+ * off and done directly. The seven products of the top level are computed
+ * by up to THREADS threads. Integer results are exact, the arithmetic wraps
+ * just as in the blocked kernel, floating-point ones round differently.
+ * Inputs narrower than the result could overflow in the sums, so for those
+ * type sets the blocked kernel does the whole multiplication instead.
+ */
+void multiplyStrassen(const Multiplication *job, int threads, int cutoff);
+
+#endif
@@ -1,52 +1,691 @@
+#define _GNU_SOURCE
 #include "mm_alloc.h"
+#include <pthread.h>
 #include <sys/sysinfo.h>
 #include <sys/mman.h>
 #include <unistd.h>
+#include <stdint.h>
 #include <stdlib.h>
-#include <string.h> 
+#include <string.h>
 
 /* Your final implementation should comment out this macro. */
 
-s_block_ptr base = NULL;
+/* Requests up to this size are served from per-class slabs. */
+#define SMALL_MAX 1024
+#define SLAB_SIZE (64 * 1024)
+#define REGION_SIZE (1UL << 32)
+
+/* Requests from this size on get their own mapping. */
+#define MMAP_THRESHOLD (128 * 1024)
+/* Heaps of arenas other than the main one grow by segments of this size. */
+#define SEGMENT_SIZE (1024 * 1024)
+#define SEGMENT_HEADER_SIZE 64
+
+/* Every pointer handed out is aligned to this, as malloc's are. */
+#define ALIGNMENT 16
+/* Anything larger cannot be rounded up or given a header without overflowing. */
+#define MAX_REQUEST (SIZE_MAX / 2)
+
+#define MAX_ARENAS 8
+/* Objects a thread may hold per size class before returning them to slabs. */
+#define TCACHE_MAX 32
+
 size_t available_memory;
 size_t total_allocated_memory = 0;
 size_t max_memory_limit;
+static size_t page_size;
+
+/*
+ * Live allocations, in usable bytes. Slab objects count from the moment
+ * they leave their slab, so objects parked in thread caches are included.
+ */
+static size_t live_bytes;
+static size_t peak_live_bytes;
+static size_t live_objects;
+static size_t mmapped_blocks;
+static size_t mmapped_bytes;
+
+/* A range of reserved address space that chunks are carved from, never returned. */
+typedef struct region {
+    char *start;
+    char *end;
+    char *top;
+} region_t;
+
+/* All slabs and segments live in their own regions so mm_free can tell them apart. */
+static region_t slab_region;
+static region_t segment_region;
+
+/*
+ * A slab is a SLAB_SIZE-aligned chunk carved into equal objects of one size
+ * class. Free objects are chained through their first word.
+ */
+typedef struct slab {
+    struct slab *next;
+    struct slab *prev;
+    void *free_list;
+    char *unused;       /* Objects from here on have never been handed out. */
+    size_t object_size;
+    struct arena *arena;
+    int size_class;
+    int in_use;
+    int capacity;
+} slab_t;
+
+#define SLAB_HEADER_SIZE ((sizeof(slab_t) + 15) & ~(size_t)15)
+
+static const size_t class_sizes[] = {
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256, 320, 384, 448, 512,
+    640, 768, 896, 1024,
+};
+#define NUM_CLASSES (sizeof(class_sizes) / sizeof(class_sizes[0]))
+_Static_assert(NUM_CLASSES == MM_NUM_CLASSES, "mm_stats_t needs a slot per class");
+
+/*
+ * Free blocks are kept in bins, TLSF style: blocks below 1 << FL_SHIFT share
+ * the first row, every larger power of two gets a row of its own, and each
+ * row is split into SL_COUNT equal bins. Bitmaps of the non-empty rows and
+ * bins find the next populated bin with a couple of bit scans.
+ */
+#define SL_BITS 3
+#define SL_COUNT (1 << SL_BITS)
+#define FL_SHIFT 8
+#define FL_COUNT 26
+
+/* Blocks in the bin of the requested size that are checked for a best fit. */
+#define BEST_FIT_SCAN 8
+/* Smallest remainder worth splitting off as a block of its own. */
+#define MIN_SPLIT (BLOCK_SIZE + 16)
+/* Free space at the top of the main heap beyond this goes back with brk(). */
+#define TRIM_THRESHOLD (128 * 1024)
+/* Extra room taken when a block at the top grows, so the next step needs no brk(). */
+#define TOP_PAD (64 * 1024)
+
+/* prev_size of the first block of a segment or of a contiguous sbrk run. */
+#define NO_PREV ((size_t)-1)
+
+/*
+ * A block heap. The main heap grows with sbrk() in runs, each starting with
+ * a run_t; the others are made of SEGMENT_SIZE-aligned segments, each
+ * starting with a segment_t. Every run of blocks ends in a fence, an in-use
+ * header of size 0, so a block always has a header right after it.
+ */
+struct heap {
+    pthread_mutex_t lock;
+    struct segment *segments;   /* Newest first. */
+    struct run *runs;           /* Newest first. */
+    s_block_ptr fence;          /* Fence of the run the main heap grows. */
+    int is_main;
+    unsigned int fl_bitmap;
+    unsigned char sl_bitmap[FL_COUNT];
+    s_block_ptr bins[FL_COUNT][SL_COUNT];
+    size_t heap_bytes;
+    size_t free_bytes;
+    size_t free_blocks;
+    size_t live_blocks;
+    unsigned long searches;
+    unsigned long search_steps;
+};
+
+typedef struct segment {
+    struct segment *next;
+    heap_t *heap;
+} segment_t;
+
+/* Starts a contiguous sbrk run of the main heap, so mm_walk can find it. */
+typedef struct run {
+    struct run *next;
+    size_t unused;
+} run_t;
+
+#define RUN_HEADER_SIZE sizeof(run_t)
+
+static heap_t main_heap = {.lock = PTHREAD_MUTEX_INITIALIZER, .is_main = 1};
+static heap_t segment_heaps[MAX_ARENAS];
+/* Lowest address the main heap ever started at. */
+static char *heap_start;
+
+/*
+ * Threads are spread over arenas so that refilling their caches and
+ * allocating medium blocks does not contend on a single lock. Every slab
+ * belongs to exactly one arena.
+ */
+typedef struct arena {
+    pthread_mutex_t lock;
+    slab_t *partial_slabs[NUM_CLASSES];  /* Slabs with at least one free object. */
+    slab_t *empty_slabs;                 /* Fully free slabs kept for reuse. */
+    size_t class_objects[NUM_CLASSES];   /* Objects handed out of its slabs. */
+    heap_t *heap;
+} arena_t;
 
-s_block_ptr find_block(s_block_ptr *last, size_t size) {
-    s_block_ptr b = base;
-    while (b && !(b->free && b->size >= size)) {
-        *last = b;
-        b = b->next;
+/* Per-thread stacks of free small objects, used without any locking. */
+typedef struct tcache {
+    void *bins[NUM_CLASSES];
+    int counts[NUM_CLASSES];
+} tcache_t;
+
+static unsigned char class_index[SMALL_MAX / 16 + 1];
+static arena_t arenas[MAX_ARENAS];
+static int num_arenas;
+static unsigned int next_arena;
+static int slabs_enabled;
+
+static __thread tcache_t tcache;
+static __thread arena_t *thread_arena;
+static pthread_key_t tcache_key;
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Allocation-site tags, kept aside in an open addressing table of their
+ * own. Nothing is looked up until the first tagged allocation.
+ */
+typedef struct tag_entry {
+    void *ptr;
+    const char *tag;
+    size_t size;
+} tag_entry_t;
+
+static pthread_mutex_t tag_lock = PTHREAD_MUTEX_INITIALIZER;
+static tag_entry_t *tag_table;
+static size_t tag_mask;
+static size_t tag_count;
+static int tags_used;
+
+/* Adds BYTES and OBJECTS, either may be negative, to the live totals. */
+static void count_live(long bytes, long objects) {
+    size_t live = __atomic_add_fetch(&live_bytes, (size_t)bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&live_objects, (size_t)objects, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&peak_live_bytes, __ATOMIC_RELAXED);
+    while (bytes > 0 && live > peak &&
+           !__atomic_compare_exchange_n(&peak_live_bytes, &peak, live, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static int region_reserve(region_t *r, size_t align) {
+    /* Only address space is reserved here, pages are faulted in on use. */
+    size_t size = REGION_SIZE;
+    void *map = MAP_FAILED;
+    while (map == MAP_FAILED && size >= 16 * align) {
+        map = mmap(NULL, size + align, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (map == MAP_FAILED)
+            size /= 4;
+    }
+    if (map == MAP_FAILED)
+        return 0;
+
+    r->start = (char *)(((size_t)map + align - 1) & ~(align - 1));
+    r->end = r->start + size;
+    r->top = r->start;
+    return 1;
+}
+
+/* Lock free, the top only ever moves up. */
+static void *region_carve(region_t *r, size_t size) {
+    char *top = __atomic_load_n(&r->top, __ATOMIC_RELAXED);
+    do {
+        if (!top || top + size > r->end)
+            return NULL;
+    } while (!__atomic_compare_exchange_n(&r->top, &top, top + size, 1,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    return top;
+}
+
+static int region_contains(region_t *r, void *p) {
+    return (char *)p >= r->start && (char *)p < __atomic_load_n(&r->top, __ATOMIC_ACQUIRE);
+}
+
+/* Gives the pages in [start, end) back to the kernel, keeping the mapping. */
+static void release_pages(char *start, char *end) {
+    start = (char *)(((size_t)start + page_size - 1) & ~(page_size - 1));
+    end = (char *)((size_t)end & ~(page_size - 1));
+    if (start < end)
+        madvise(start, end - start, MADV_DONTNEED);
+}
+
+/* Bin links, kept in the data of free blocks only. */
+typedef struct free_links {
+    s_block_ptr next;
+    s_block_ptr prev;
+} free_links_t;
+
+static free_links_t *links(s_block_ptr b) {
+    return (free_links_t *)b->data;
+}
+
+/* Header sizes carry the BLOCK_ flags in their low bits. */
+static size_t size_of(s_block_ptr b) {
+    return b->size & ~(size_t)BLOCK_FLAGS;
+}
+
+static int is_free(s_block_ptr b) {
+    return b->size & BLOCK_FREE;
+}
+
+static void set_size(s_block_ptr b, size_t size) {
+    b->size = size | (b->size & BLOCK_FLAGS);
+}
+
+static s_block_ptr next_block(s_block_ptr b) {
+    return (s_block_ptr)(b->data + size_of(b));
+}
+
+static s_block_ptr prev_block(s_block_ptr b) {
+    if (b->prev_size == NO_PREV)
+        return NULL;
+    return (s_block_ptr)((char *)b - b->prev_size - BLOCK_SIZE);
+}
+
+/* Sets the size of B and the boundary tag of the block after it. */
+static void resize_block(s_block_ptr b, size_t size) {
+    set_size(b, size);
+    next_block(b)->prev_size = size;
+}
+
+static void make_fence(s_block_ptr f, size_t prev_size) {
+    f->prev_size = prev_size;
+    f->size = 0;
+}
+
+/* Rounds a request up to what a block can hold, links included. */
+static size_t request_size(size_t size) {
+    if (size < sizeof(free_links_t))
+        return sizeof(free_links_t);
+    return (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+}
+
+static void bin_mapping(size_t size, int *fl, int *sl) {
+    if (size < (1 << FL_SHIFT)) {
+        *fl = 0;
+        *sl = size / ((1 << FL_SHIFT) / SL_COUNT);
+        return;
+    }
+    int log2 = 63 - __builtin_clzl(size);
+    *fl = log2 - FL_SHIFT + 1;
+    *sl = (size >> (log2 - SL_BITS)) & (SL_COUNT - 1);
+    if (*fl >= FL_COUNT) {
+        *fl = FL_COUNT - 1;
+        *sl = SL_COUNT - 1;
+    }
+}
+
+static void bin_insert(heap_t *heap, s_block_ptr b) {
+    int fl, sl;
+    size_t size = size_of(b);
+    bin_mapping(size, &fl, &sl);
+    b->size = size | BLOCK_FREE;
+    links(b)->prev = NULL;
+    links(b)->next = heap->bins[fl][sl];
+    if (links(b)->next)
+        links(links(b)->next)->prev = b;
+    heap->bins[fl][sl] = b;
+    heap->fl_bitmap |= 1U << fl;
+    heap->sl_bitmap[fl] |= 1U << sl;
+    heap->free_bytes += size;
+    heap->free_blocks++;
+}
+
+/* Takes B out of its bin, leaving it marked in use. */
+static void bin_remove(heap_t *heap, s_block_ptr b) {
+    int fl, sl;
+    size_t size = size_of(b);
+    free_links_t *l = links(b);
+    bin_mapping(size, &fl, &sl);
+    if (l->prev)
+        links(l->prev)->next = l->next;
+    else
+        heap->bins[fl][sl] = l->next;
+    if (l->next)
+        links(l->next)->prev = l->prev;
+    if (!heap->bins[fl][sl]) {
+        heap->sl_bitmap[fl] &= ~(1U << sl);
+        if (!heap->sl_bitmap[fl])
+            heap->fl_bitmap &= ~(1U << fl);
+    }
+    b->size = size | BLOCK_INUSE;
+    heap->free_bytes -= size;
+    heap->free_blocks--;
+}
+
+/*
+ * Looks for a best fit among the first few blocks of SIZE's own bin, which
+ * may hold blocks that are too small. Failing that, any block of the next
+ * populated bin is large enough. Called with heap->lock held.
+ */
+s_block_ptr find_block(heap_t *heap, size_t size) {
+    s_block_ptr b, best = NULL;
+    int fl, sl, scanned = 0;
+
+    heap->searches++;
+    bin_mapping(size, &fl, &sl);
+    /* The last bin is open ended, so it is searched through. */
+    for (b = heap->bins[fl][sl]; b; b = links(b)->next) {
+        if (++scanned > BEST_FIT_SCAN && fl < FL_COUNT - 1)
+            break;
+        heap->search_steps++;
+        if (size_of(b) >= size && (!best || size_of(b) < size_of(best))) {
+            best = b;
+            if (size_of(b) == size)
+                break;
+        }
+    }
+    if (best)
+        return best;
+
+    heap->search_steps++;
+    unsigned int sl_map = sl + 1 < SL_COUNT ? heap->sl_bitmap[fl] & (~0U << (sl + 1)) : 0;
+    if (!sl_map) {
+        unsigned int fl_map = fl + 1 < FL_COUNT ? heap->fl_bitmap & (~0U << (fl + 1)) : 0;
+        if (!fl_map)
+            return NULL;
+        fl = __builtin_ctz(fl_map);
+        sl_map = heap->sl_bitmap[fl];
+    }
+    sl = __builtin_ctz(sl_map);
+    b = heap->bins[fl][sl];
+    while (b && size_of(b) < size) {
+        heap->search_steps++;
+        b = links(b)->next;
     }
     return b;
 }
 
+static void tcache_flush_all(void *unused);
+
+void init_arenas() {
+    size_t c = 0;
+    for (size_t i = 0; i <= SMALL_MAX / 16; i++) {
+        while (class_sizes[c] < i * 16)
+            c++;
+        class_index[i] = c;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    num_arenas = cpus > 0 ? 2 * cpus : 1;
+    if (num_arenas > MAX_ARENAS)
+        num_arenas = MAX_ARENAS;
+
+    /* Arena 0 shares the sbrk heap, the others grow heaps out of segments. */
+    int have_segments = region_reserve(&segment_region, SEGMENT_SIZE);
+    for (int i = 0; i < num_arenas; i++) {
+        pthread_mutex_init(&arenas[i].lock, NULL);
+        pthread_mutex_init(&segment_heaps[i].lock, NULL);
+        arenas[i].heap = (i > 0 && have_segments) ? &segment_heaps[i] : &main_heap;
+    }
+
+    if (getenv("MM_DISABLE_SLABS"))
+        return;
+    if (pthread_key_create(&tcache_key, tcache_flush_all) != 0)
+        return;
+    slabs_enabled = region_reserve(&slab_region, SLAB_SIZE);
+}
+
+/*
+ * A child of a threaded process must not inherit a lock some other thread
+ * was holding, so every lock is taken around fork().
+ */
+static void atfork_prepare() {
+    pthread_mutex_lock(&tag_lock);
+    for (int i = 0; i < num_arenas; i++) {
+        pthread_mutex_lock(&arenas[i].lock);
+        pthread_mutex_lock(&segment_heaps[i].lock);
+    }
+    pthread_mutex_lock(&main_heap.lock);
+}
+
+static void atfork_release() {
+    pthread_mutex_unlock(&main_heap.lock);
+    for (int i = num_arenas - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&segment_heaps[i].lock);
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+    pthread_mutex_unlock(&tag_lock);
+}
+
+/* Parses a byte count with an optional K, M or G suffix, 0 if malformed. */
+static size_t parse_size(const char *s) {
+    char *end;
+    size_t v = strtoull(s, &end, 10);
+    if (end == s)
+        return 0;
+    switch (*end) {
+    case 'G': case 'g':
+        return v << 30;
+    case 'M': case 'm':
+        return v << 20;
+    case 'K': case 'k':
+        return v << 10;
+    case '\0':
+        return v;
+    }
+    return 0;
+}
+
 void init_allocator() {
     struct sysinfo info;
     sysinfo(&info);
-    available_memory = info.freeram; 
-    max_memory_limit = info.freeram; 
+    available_memory = info.freeram;
+    max_memory_limit = info.freeram;
+    /* Free RAM at startup is a poor cap for a long running process. */
+    const char *limit = getenv("MM_MEMORY_LIMIT");
+    if (limit && parse_size(limit))
+        max_memory_limit = parse_size(limit);
+    page_size = sysconf(_SC_PAGESIZE);
+    init_arenas();
+    pthread_atfork(atfork_prepare, atfork_release, atfork_release);
+}
+
+static slab_t *slab_of(void *p) {
+    return (slab_t *)((size_t)p & ~(size_t)(SLAB_SIZE - 1));
+}
+
+static segment_t *segment_of(void *p) {
+    return (segment_t *)((size_t)p & ~(size_t)(SEGMENT_SIZE - 1));
+}
+
+static int size_class_of(size_t size) {
+    return class_index[(size + 15) / 16];
+}
+
+static void slab_list_push(slab_t **head, slab_t *s) {
+    s->prev = NULL;
+    s->next = *head;
+    if (*head)
+        (*head)->prev = s;
+    *head = s;
+}
+
+static void slab_list_remove(slab_t **head, slab_t *s) {
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        *head = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+    s->next = s->prev = NULL;
+}
+
+/* Called with a->lock held. */
+static slab_t *slab_create(arena_t *a, int size_class) {
+    slab_t *s = a->empty_slabs;
+    if (s)
+        a->empty_slabs = s->next;
+    else if (!(s = region_carve(&slab_region, SLAB_SIZE)))
+        return NULL;
+
+    s->arena = a;
+    s->size_class = size_class;
+    s->object_size = class_sizes[size_class];
+    s->capacity = (SLAB_SIZE - SLAB_HEADER_SIZE) / s->object_size;
+    s->in_use = 0;
+    s->free_list = NULL;
+    s->unused = (char *)s + SLAB_HEADER_SIZE;
+    slab_list_push(&a->partial_slabs[size_class], s);
+    return s;
+}
+
+/* Called with a->lock held. */
+static void *slab_alloc(arena_t *a, int c) {
+    slab_t *s = a->partial_slabs[c];
+    if (!s && !(s = slab_create(a, c)))
+        return NULL;
+
+    void *obj;
+    if (s->free_list) {
+        obj = s->free_list;
+        s->free_list = *(void **)obj;
+    } else {
+        obj = s->unused;
+        s->unused += s->object_size;
+    }
+    if (++s->in_use == s->capacity)
+        slab_list_remove(&a->partial_slabs[c], s);
+    a->class_objects[c]++;
+    return obj;
+}
+
+/* Called with the lock of the slab's arena held. */
+static void slab_free(void *p) {
+    slab_t *s = slab_of(p);
+    arena_t *a = s->arena;
+
+    *(void **)p = s->free_list;
+    s->free_list = p;
+    a->class_objects[s->size_class]--;
+    if (s->in_use-- == s->capacity)
+        slab_list_push(&a->partial_slabs[s->size_class], s);
+
+    /*
+     * Keep one empty slab per class around. The rest go back to the arena
+     * with their object pages released, only the header stays resident.
+     */
+    if (s->in_use == 0 && (a->partial_slabs[s->size_class] != s || s->next)) {
+        slab_list_remove(&a->partial_slabs[s->size_class], s);
+        release_pages((char *)s + SLAB_HEADER_SIZE, (char *)s + SLAB_SIZE);
+        s->next = a->empty_slabs;
+        a->empty_slabs = s;
+    }
+}
+
+static int is_valid_object(void *p) {
+    slab_t *s = slab_of(p);
+    char *first = (char *)s + SLAB_HEADER_SIZE;
+    return (char *)p >= first && (char *)p < s->unused &&
+           ((char *)p - first) % s->object_size == 0;
 }
 
-void split_block(s_block_ptr b, size_t size) {
+static arena_t *get_thread_arena() {
+    if (!thread_arena) {
+        unsigned int i = __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED);
+        thread_arena = &arenas[i % num_arenas];
+        /* Any non-NULL value makes the key's destructor run at thread exit. */
+        if (slabs_enabled)
+            pthread_setspecific(tcache_key, &tcache);
+    }
+    return thread_arena;
+}
+
+/* Returns COUNT objects from the thread cache of class C to their slabs. */
+static void tcache_flush(int c, int count) {
+    arena_t *locked = NULL;
+    int flushed = 0;
+    for (; flushed < count && tcache.bins[c]; flushed++) {
+        void *obj = tcache.bins[c];
+        tcache.bins[c] = *(void **)obj;
+        tcache.counts[c]--;
+
+        /* Objects freed by this thread may come from any arena. */
+        arena_t *a = slab_of(obj)->arena;
+        if (a != locked) {
+            if (locked)
+                pthread_mutex_unlock(&locked->lock);
+            pthread_mutex_lock(&a->lock);
+            locked = a;
+        }
+        slab_free(obj);
+    }
+    if (locked)
+        pthread_mutex_unlock(&locked->lock);
+    if (flushed)
+        count_live(-(long)(flushed * class_sizes[c]), -flushed);
+}
+
+static void tcache_flush_all(void *unused) {
+    for (int c = 0; c < NUM_CLASSES; c++)
+        tcache_flush(c, tcache.counts[c]);
+}
+
+static void *tcache_alloc(size_t size) {
+    int c = size_class_of(size);
+    void *obj = tcache.bins[c];
+    if (obj) {
+        tcache.bins[c] = *(void **)obj;
+        tcache.counts[c]--;
+        return obj;
+    }
+
+    /* Refill half the cache in one trip to the arena. */
+    arena_t *a = get_thread_arena();
+    int taken = 0;
+    pthread_mutex_lock(&a->lock);
+    obj = slab_alloc(a, c);
+    while (obj && tcache.counts[c] < TCACHE_MAX / 2) {
+        void *extra = slab_alloc(a, c);
+        if (!extra)
+            break;
+        *(void **)extra = tcache.bins[c];
+        tcache.bins[c] = extra;
+        tcache.counts[c]++;
+        taken++;
+    }
+    pthread_mutex_unlock(&a->lock);
+    if (obj)
+        count_live((taken + 1) * class_sizes[c], taken + 1);
+    return obj;
+}
+
+static void tcache_free(void *p) {
+    if (!is_valid_object(p))
+        return;
+    /* A thread that only frees still needs its cache flushed at exit. */
+    get_thread_arena();
+    int c = slab_of(p)->size_class;
+    if (tcache.counts[c] >= TCACHE_MAX)
+        tcache_flush(c, TCACHE_MAX / 2);
+    *(void **)p = tcache.bins[c];
+    tcache.bins[c] = p;
+    tcache.counts[c]++;
+}
+
+/* Splits the tail of B off into a free block. Called with heap->lock held. */
+void split_block(heap_t *heap, s_block_ptr b, size_t size) {
     s_block_ptr newb;
     newb = (s_block_ptr)(b->data + size);
-    newb->size = b->size - size - BLOCK_SIZE;
-    newb->next = b->next;
-    newb->free = 1;
-    newb->ptr = newb->data;
-    b->size = size;
-    b->next = newb;
-    if (newb->next)
-        newb->next->prev = newb;
-}
-
-s_block_ptr fusion(s_block_ptr b) {
-    if (b->next && b->next->free) {
-        b->size += BLOCK_SIZE + b->next->size;
-        b->next = b->next->next;
-        if (b->next)
-            b->next->prev = b;
+    newb->prev_size = size;
+    newb->size = (size_of(b) - size - BLOCK_SIZE) | BLOCK_INUSE;
+    next_block(newb)->prev_size = size_of(newb);
+    set_size(b, size);
+    bin_insert(heap, fusion(heap, newb));
+}
+
+/*
+ * Merges B, which is not in a bin, with whichever neighbours are free and
+ * returns the merged block. The boundary tags make both neighbours O(1).
+ */
+s_block_ptr fusion(heap_t *heap, s_block_ptr b) {
+    s_block_ptr next = next_block(b);
+    s_block_ptr prev = prev_block(b);
+    if (is_free(next)) {
+        bin_remove(heap, next);
+        resize_block(b, size_of(b) + BLOCK_SIZE + size_of(next));
+    }
+    if (prev && is_free(prev)) {
+        bin_remove(heap, prev);
+        resize_block(prev, size_of(prev) + BLOCK_SIZE + size_of(b));
+        b = prev;
     }
     return b;
 }
@@ -57,120 +696,705 @@ s_block_ptr get_block(void *p) {
     return (p = tmp -= BLOCK_SIZE);
 }
 
-s_block_ptr extend_heap(s_block_ptr last, size_t size) {
-    if (total_allocated_memory + size + BLOCK_SIZE > max_memory_limit) {
+/* Adds a fresh segment to HEAP and returns it as one in-use block. */
+static s_block_ptr extend_segments(heap_t *heap) {
+    segment_t *seg = region_carve(&segment_region, SEGMENT_SIZE);
+    if (!seg)
         return NULL;
+    seg->heap = heap;
+    seg->next = heap->segments;
+    heap->segments = seg;
+    heap->heap_bytes += SEGMENT_SIZE;
+
+    s_block_ptr b = (s_block_ptr)((char *)seg + SEGMENT_HEADER_SIZE);
+    b->prev_size = NO_PREV;
+    b->size = (SEGMENT_SIZE - SEGMENT_HEADER_SIZE - 2 * BLOCK_SIZE) | BLOCK_INUSE;
+    make_fence(next_block(b), size_of(b));
+    return b;
+}
+
+/* Returns an in-use block of at least SIZE bytes made of new memory. */
+s_block_ptr extend_heap(heap_t *heap, size_t size) {
+    s_block_ptr b;
+    if (!heap->is_main) {
+        if (size > SEGMENT_SIZE - SEGMENT_HEADER_SIZE - 2 * BLOCK_SIZE)
+            return NULL;
+        return extend_segments(heap);
     }
 
-    void* ptr = sbrk(0);
-    if (sbrk(BLOCK_SIZE + size) == (void*)-1) {
+    if (total_allocated_memory + size + BLOCK_SIZE > max_memory_limit) {
         return NULL;
     }
 
-    total_allocated_memory += size + BLOCK_SIZE; // Update allocated memory
+    char *top = sbrk(0);
+    if (heap->fence && (char *)heap->fence + BLOCK_SIZE == top) {
+        /* Nobody moved the break, so the run continues where its fence is. */
+        s_block_ptr last = prev_block(heap->fence);
+        if (last && is_free(last)) {
+            /* Grow the free block at the top instead of starting a new one. */
+            if (size_of(last) < size) {
+                if (sbrk(size - size_of(last)) == (void*)-1)
+                    return NULL;
+                heap->heap_bytes += size - size_of(last);
+            } else {
+                size = size_of(last);
+            }
+            bin_remove(heap, last);
+            b = last;
+        } else {
+            if (sbrk(BLOCK_SIZE + size) == (void*)-1)
+                return NULL;
+            heap->heap_bytes += BLOCK_SIZE + size;
+            b = heap->fence;
+        }
+    } else {
+        /* Someone else may have left the break unaligned. */
+        size_t pad = -(size_t)top & (ALIGNMENT - 1);
+        if (sbrk(pad + RUN_HEADER_SIZE + 2 * BLOCK_SIZE + size) == (void*)-1)
+            return NULL;
+        heap->heap_bytes += pad + RUN_HEADER_SIZE + 2 * BLOCK_SIZE + size;
+        if (!heap_start)
+            heap_start = top;
+        run_t *run = (run_t *)(top + pad);
+        run->next = heap->runs;
+        heap->runs = run;
+        b = (s_block_ptr)((char *)run + RUN_HEADER_SIZE);
+        b->prev_size = NO_PREV;
+    }
 
-    s_block_ptr b = (s_block_ptr)ptr;
-    b->size = size;
-    b->next = NULL;
-    b->prev = last;
-    b->ptr = b->data;
-    if (last)
-        last->next = b;
-    b->free = 0;
+    b->size = size | BLOCK_INUSE;
+    heap->fence = next_block(b);
+    make_fence(heap->fence, size);
     return b;
 }
 
-int valid_addr(void *p) {
-    if (base) {
-        if (p > base && p < sbrk(0)) {
-            return p == (get_block(p))->ptr;
+/* Returns the heap a block pointer would belong to, without validating it. */
+static heap_t *heap_of(void *p) {
+    if (region_contains(&segment_region, p))
+        return segment_of(p)->heap;
+    if (heap_start && (char *)p > heap_start && p < sbrk(0))
+        return &main_heap;
+    return NULL;
+}
+
+/* Called with heap->lock held. */
+int valid_addr(heap_t *heap, void *p) {
+    if ((size_t)p & (ALIGNMENT - 1))
+        return 0;
+    if (heap->is_main && ((char *)p < heap_start + BLOCK_SIZE || p >= sbrk(0)))
+        return 0;
+    return (get_block(p)->size & (BLOCK_FREE | BLOCK_MMAPPED | BLOCK_INUSE)) == BLOCK_INUSE;
+}
+
+/*
+ * Mappings of their own keep the header on the same page as the data, or
+ * on the page before for page-aligned data.
+ */
+static int is_mmapped_chunk(void *p) {
+    size_t offset = (size_t)p & (page_size - 1);
+    if ((offset < BLOCK_SIZE && offset != 0) || offset % ALIGNMENT != 0)
+        return 0;
+    return (get_block(p)->size & (BLOCK_FREE | BLOCK_MMAPPED | BLOCK_INUSE)) ==
+           (BLOCK_MMAPPED | BLOCK_INUSE);
+}
+
+/* The header of an mmapped chunk keeps its distance from the mapping start in prev_size. */
+static void *mmap_chunk_alloc(size_t size, size_t alignment) {
+    size_t slack = alignment > ALIGNMENT ? alignment : 0;
+    size_t length = (size + BLOCK_SIZE + slack + page_size - 1) & ~(page_size - 1);
+    char *map = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+    char *data = (char *)(((size_t)map + BLOCK_SIZE + alignment - 1) & ~(alignment - 1));
+    s_block_ptr b = get_block(data);
+    b->prev_size = (char *)b - map;
+    b->size = (map + length - data) | BLOCK_MMAPPED | BLOCK_INUSE;
+    __atomic_add_fetch(&mmapped_blocks, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&mmapped_bytes, length, __ATOMIC_RELAXED);
+    count_live(size_of(b), 1);
+    return b->data;
+}
+
+/* Block heap allocation. Called with heap->lock held. */
+static void *block_malloc(heap_t *heap, size_t size) {
+    s_block_ptr b = find_block(heap, size);
+    if (b)
+        bin_remove(heap, b);
+    else if (!(b = extend_heap(heap, size)))
+        return NULL;
+    if (size_of(b) - size >= MIN_SPLIT)
+        split_block(heap, b, size);
+    __atomic_fetch_add(&total_allocated_memory, size_of(b) + BLOCK_SIZE, __ATOMIC_RELAXED);
+    heap->live_blocks++;
+    count_live(size_of(b), 1);
+    return b->data;
+}
+
+/*
+ * Releases the pages of a segment that is now one free block. The newest
+ * segment is kept resident so a single alloc/free pair does not thrash.
+ */
+static void release_empty_segment(heap_t *heap, s_block_ptr b) {
+    segment_t *seg = segment_of(b);
+    if (b->prev_size == NO_PREV &&
+        (char *)next_block(b) == (char *)seg + SEGMENT_SIZE - BLOCK_SIZE &&
+        seg != heap->segments)
+        release_pages(b->data + sizeof(free_links_t), b->data + size_of(b));
+}
+
+/* Called with heap->lock held. */
+static void block_free(heap_t *heap, void *ptr) {
+    s_block_ptr b;
+    if (!valid_addr(heap, ptr))
+        return;
+    b = get_block(ptr);
+    __atomic_fetch_sub(&total_allocated_memory, size_of(b) + BLOCK_SIZE, __ATOMIC_RELAXED);
+    heap->live_blocks--;
+    count_live(-(long)size_of(b), -1);
+    b = fusion(heap, b);
+
+    /* A large enough free top of the main heap becomes its new fence. */
+    if (heap->is_main && next_block(b) == heap->fence && size_of(b) >= TRIM_THRESHOLD &&
+        (char *)heap->fence + BLOCK_SIZE == (char *)sbrk(0)) {
+        heap->heap_bytes -= size_of(b) + BLOCK_SIZE;
+        make_fence(b, b->prev_size);
+        heap->fence = b;
+        brk(b->data);
+        return;
+    }
+    bin_insert(heap, b);
+    if (!heap->is_main)
+        release_empty_segment(heap, b);
+}
+
+/* Collects the stats of one heap. Called with heap->lock held. */
+static void heap_stats(heap_t *heap, mm_stats_t *stats) {
+    stats->heap_bytes += heap->heap_bytes;
+    stats->free_bytes += heap->free_bytes;
+    stats->free_blocks += heap->free_blocks;
+    stats->heap_blocks += heap->live_blocks;
+    stats->searches += heap->searches;
+    stats->search_steps += heap->search_steps;
+
+    /* The largest block is in the highest populated bin. */
+    if (heap->fl_bitmap) {
+        int fl = 31 - __builtin_clz(heap->fl_bitmap);
+        int sl = 31 - __builtin_clz(heap->sl_bitmap[fl]);
+        for (s_block_ptr b = heap->bins[fl][sl]; b; b = links(b)->next) {
+            if (size_of(b) > stats->largest_free)
+                stats->largest_free = size_of(b);
         }
     }
-    return 0;
 }
 
-void* mm_malloc(size_t size) {
-    static int is_initialized = 0;
-
-    if (!is_initialized) {
-        init_allocator();
-        is_initialized = 1;
-    }
-
-    s_block_ptr b, last;
-    size_t s;
-    
-    s = size;
-    if (base) {
-        last = base;
-        b = find_block(&last, s);
-        if (b) {
-            if ((b->size - s) >= (BLOCK_SIZE + 4))
-                split_block(b, s);
-            b->free = 0;
-        } else {
-            b = extend_heap(last, s);
-            if (!b)
-                return NULL;
+/* The I-th distinct block heap, or NULL past the last one. */
+static heap_t *nth_heap(int i) {
+    if (i == 0)
+        return &main_heap;
+    if (i >= num_arenas || arenas[i].heap == &main_heap)
+        return NULL;
+    return arenas[i].heap;
+}
+
+static void set_fragmentation(mm_stats_t *stats) {
+    stats->fragmentation = 0;
+    if (stats->free_bytes)
+        stats->fragmentation = 1.0 - (double)stats->largest_free / stats->free_bytes;
+}
+
+void mm_stats(mm_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    heap_t *heap;
+    for (int i = 0; (heap = nth_heap(i)); i++) {
+        pthread_mutex_lock(&heap->lock);
+        heap_stats(heap, stats);
+        pthread_mutex_unlock(&heap->lock);
+    }
+    set_fragmentation(stats);
+
+    for (int c = 0; c < NUM_CLASSES; c++)
+        stats->class_size[c] = class_sizes[c];
+    for (int i = 0; i < num_arenas; i++) {
+        pthread_mutex_lock(&arenas[i].lock);
+        for (int c = 0; c < NUM_CLASSES; c++)
+            stats->class_objects[c] += arenas[i].class_objects[c];
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+    if (slabs_enabled)
+        stats->slab_bytes = __atomic_load_n(&slab_region.top, __ATOMIC_RELAXED) - slab_region.start;
+
+    /* The caller's own cache is known to be free. Other threads' caches are not. */
+    size_t cached_bytes = 0, cached_objects = 0;
+    for (int c = 0; c < NUM_CLASSES; c++) {
+        stats->class_objects[c] -= tcache.counts[c];
+        cached_bytes += tcache.counts[c] * class_sizes[c];
+        cached_objects += tcache.counts[c];
+    }
+    stats->live_bytes = __atomic_load_n(&live_bytes, __ATOMIC_RELAXED) - cached_bytes;
+    stats->live_objects = __atomic_load_n(&live_objects, __ATOMIC_RELAXED) - cached_objects;
+    stats->peak_live_bytes = __atomic_load_n(&peak_live_bytes, __ATOMIC_RELAXED);
+    stats->mmapped_blocks = __atomic_load_n(&mmapped_blocks, __ATOMIC_RELAXED);
+    stats->mmapped_bytes = __atomic_load_n(&mmapped_bytes, __ATOMIC_RELAXED);
+    stats->memory_limit = max_memory_limit;
+}
+
+/* Calls FN on every block from B up to the fence of its run. */
+static void walk_run(s_block_ptr b, mm_walk_fn fn, void *arg) {
+    for (; size_of(b); b = next_block(b))
+        fn(b->data, size_of(b), !is_free(b), arg);
+}
+
+void mm_walk(mm_walk_fn fn, void *arg) {
+    heap_t *heap;
+    for (int i = 0; (heap = nth_heap(i)); i++) {
+        pthread_mutex_lock(&heap->lock);
+        for (run_t *run = heap->runs; run; run = run->next)
+            walk_run((s_block_ptr)((char *)run + RUN_HEADER_SIZE), fn, arg);
+        for (segment_t *seg = heap->segments; seg; seg = seg->next)
+            walk_run((s_block_ptr)((char *)seg + SEGMENT_HEADER_SIZE), fn, arg);
+        pthread_mutex_unlock(&heap->lock);
+    }
+}
+
+static size_t tag_hash(void *p) {
+    return ((size_t)p >> 4) * 0x9E3779B97F4A7C15ULL >> 20 & tag_mask;
+}
+
+static tag_entry_t *tag_find(void *p) {
+    for (size_t i = tag_hash(p);; i = (i + 1) & tag_mask) {
+        if (tag_table[i].ptr == p || !tag_table[i].ptr)
+            return &tag_table[i];
+    }
+}
+
+/* Doubles the table, which is mapped directly so tagging never recurses. */
+static int tag_grow() {
+    size_t capacity = tag_table ? 2 * (tag_mask + 1) : 1024;
+    tag_entry_t *old = tag_table;
+    size_t old_capacity = old ? tag_mask + 1 : 0;
+    tag_entry_t *table = mmap(NULL, capacity * sizeof(tag_entry_t), PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (table == MAP_FAILED)
+        return 0;
+    tag_table = table;
+    tag_mask = capacity - 1;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i].ptr)
+            *tag_find(old[i].ptr) = old[i];
+    }
+    if (old)
+        munmap(old, old_capacity * sizeof(tag_entry_t));
+    return 1;
+}
+
+/* Called with tag_lock held. */
+static void tag_set(void *p, const char *tag, size_t size) {
+    if ((!tag_table || 2 * (tag_count + 1) > tag_mask + 1) && !tag_grow())
+        return;
+    tag_entry_t *e = tag_find(p);
+    if (!e->ptr)
+        tag_count++;
+    e->ptr = p;
+    e->tag = tag;
+    e->size = size;
+}
+
+/* Removes the tag of P and returns it. Called with tag_lock held. */
+static const char *tag_take(void *p) {
+    if (!tag_table)
+        return NULL;
+    tag_entry_t *e = tag_find(p);
+    if (!e->ptr)
+        return NULL;
+    const char *tag = e->tag;
+
+    /* Linear probing, so later entries of the cluster shift back into the hole. */
+    size_t hole = e - tag_table;
+    for (size_t i = (hole + 1) & tag_mask; tag_table[i].ptr; i = (i + 1) & tag_mask) {
+        size_t home = tag_hash(tag_table[i].ptr);
+        if (((i - home) & tag_mask) >= ((i - hole) & tag_mask)) {
+            tag_table[hole] = tag_table[i];
+            hole = i;
         }
+    }
+    tag_table[hole].ptr = NULL;
+    tag_count--;
+    return tag;
+}
+
+void* mm_malloc_tagged(size_t size, const char *tag) {
+    void *p = mm_malloc(size);
+    if (p && tag) {
+        pthread_mutex_lock(&tag_lock);
+        tags_used = 1;
+        tag_set(p, tag, mm_usable_size(p));
+        pthread_mutex_unlock(&tag_lock);
+    }
+    return p;
+}
+
+const char *mm_tag_of(void *ptr) {
+    const char *tag = NULL;
+    if (!ptr || !__atomic_load_n(&tags_used, __ATOMIC_RELAXED))
+        return NULL;
+    pthread_mutex_lock(&tag_lock);
+    tag_entry_t *e = tag_table ? tag_find(ptr) : NULL;
+    if (e && e->ptr)
+        tag = e->tag;
+    pthread_mutex_unlock(&tag_lock);
+    return tag;
+}
+
+/* Distinct tags listed by mm_malloc_info, the rest are summed up as one. */
+#define MAX_REPORTED_TAGS 64
+
+typedef struct tag_total {
+    const char *tag;
+    size_t bytes;
+    size_t objects;
+} tag_total_t;
+
+/* Sums the live tagged allocations per tag, largest first. Returns the number of tags. */
+static int tag_totals(tag_total_t *totals, tag_total_t *rest) {
+    int n = 0;
+    pthread_mutex_lock(&tag_lock);
+    for (size_t i = 0; tag_table && i <= tag_mask; i++) {
+        tag_entry_t *e = &tag_table[i];
+        if (!e->ptr)
+            continue;
+        int t = 0;
+        while (t < n && totals[t].tag != e->tag && strcmp(totals[t].tag, e->tag) != 0)
+            t++;
+        tag_total_t *total = t < n ? &totals[t] : n < MAX_REPORTED_TAGS ? &totals[n++] : rest;
+        total->tag = e->tag;
+        total->bytes += e->size;
+        total->objects++;
+    }
+    pthread_mutex_unlock(&tag_lock);
+
+    for (int i = 1; i < n; i++) {
+        tag_total_t t = totals[i];
+        int j = i;
+        for (; j > 0 && totals[j - 1].bytes < t.bytes; j--)
+            totals[j] = totals[j - 1];
+        totals[j] = t;
+    }
+    return n;
+}
+
+/*
+ * Everything is gathered with the locks held and printed after they are
+ * released, since stdio may allocate through mm_malloc itself.
+ */
+int mm_malloc_info(FILE *fp) {
+    mm_stats_t stats;
+    tag_total_t totals[MAX_REPORTED_TAGS] = {{0}}, rest = {0};
+    heap_t *heap;
+
+    mm_stats(&stats);
+    fprintf(fp, "<malloc version=\"mm-1\">\n");
+    fprintf(fp, "<live bytes=\"%zu\" peak=\"%zu\" objects=\"%zu\" limit=\"%zu\"/>\n",
+            stats.live_bytes, stats.peak_live_bytes, stats.live_objects, stats.memory_limit);
+
+    fprintf(fp, "<slabs bytes=\"%zu\">\n", stats.slab_bytes);
+    for (int c = 0; c < NUM_CLASSES; c++) {
+        if (stats.class_objects[c])
+            fprintf(fp, "  <class size=\"%zu\" objects=\"%zu\"/>\n",
+                    stats.class_size[c], stats.class_objects[c]);
+    }
+    fprintf(fp, "</slabs>\n");
+
+    fprintf(fp, "<heaps bytes=\"%zu\" blocks=\"%zu\" free=\"%zu\" free_blocks=\"%zu\" "
+            "largest_free=\"%zu\" fragmentation=\"%.3f\">\n",
+            stats.heap_bytes, stats.heap_blocks, stats.free_bytes, stats.free_blocks,
+            stats.largest_free, stats.fragmentation);
+    for (int i = 0; (heap = nth_heap(i)); i++) {
+        mm_stats_t h = {0};
+        pthread_mutex_lock(&heap->lock);
+        heap_stats(heap, &h);
+        pthread_mutex_unlock(&heap->lock);
+        set_fragmentation(&h);
+        fprintf(fp, "  <heap nr=\"%d\" type=\"%s\" bytes=\"%zu\" blocks=\"%zu\" free=\"%zu\" "
+                "free_blocks=\"%zu\" largest_free=\"%zu\" fragmentation=\"%.3f\"/>\n",
+                i, heap->is_main ? "brk" : "segments", h.heap_bytes, h.heap_blocks,
+                h.free_bytes, h.free_blocks, h.largest_free, h.fragmentation);
+    }
+    fprintf(fp, "</heaps>\n");
+    fprintf(fp, "<mmap blocks=\"%zu\" bytes=\"%zu\"/>\n", stats.mmapped_blocks, stats.mmapped_bytes);
+
+    int n = tag_totals(totals, &rest);
+    fprintf(fp, "<tags>\n");
+    for (int t = 0; t < n; t++)
+        fprintf(fp, "  <tag site=\"%s\" bytes=\"%zu\" objects=\"%zu\"/>\n",
+                totals[t].tag, totals[t].bytes, totals[t].objects);
+    if (rest.objects)
+        fprintf(fp, "  <tag site=\"other\" bytes=\"%zu\" objects=\"%zu\"/>\n",
+                rest.bytes, rest.objects);
+    fprintf(fp, "</tags>\n");
+    fprintf(fp, "</malloc>\n");
+    return ferror(fp) ? -1 : 0;
+}
+
+void* mm_malloc(size_t size) {
+    void *p;
+
+    pthread_once(&init_once, init_allocator);
+    if (size > MAX_REQUEST)
+        return NULL;
+
+    if (size <= SMALL_MAX && slabs_enabled) {
+        p = tcache_alloc(size);
+        if (p)
+            return p;
+    }
+
+    if (size >= MMAP_THRESHOLD)
+        return mmap_chunk_alloc(size, ALIGNMENT);
+
+    size = request_size(size);
+    heap_t *heap = get_thread_arena()->heap;
+    pthread_mutex_lock(&heap->lock);
+    p = block_malloc(heap, size);
+    pthread_mutex_unlock(&heap->lock);
+    return p;
+}
+
+/*
+ * Moves the break to give B, the last block before the main heap's fence,
+ * S bytes in total. Called with heap->lock held.
+ */
+static int grow_at_top(heap_t *heap, s_block_ptr b, size_t s) {
+    s_block_ptr next = next_block(b);
+    size_t available = size_of(b);
+    if (is_free(next)) {
+        available += BLOCK_SIZE + size_of(next);
+        next = next_block(next);
+    }
+    if (!heap->is_main || next != heap->fence ||
+        (char *)heap->fence + BLOCK_SIZE != (char *)sbrk(0))
+        return 0;
+    size_t grow = s - available + TOP_PAD;
+    if (total_allocated_memory + grow > max_memory_limit)
+        return 0;
+    if (sbrk(grow) == (void*)-1)
+        return 0;
+
+    /* The pad is split off again by the caller and stays free at the top. */
+    heap->heap_bytes += grow;
+    if (is_free(next_block(b)))
+        bin_remove(heap, next_block(b));
+    set_size(b, s + TOP_PAD);
+    heap->fence = next_block(b);
+    make_fence(heap->fence, s + TOP_PAD);
+    return 1;
+}
+
+/*
+ * Resizes B to S bytes without a new allocation: into a free next block,
+ * by moving the break, or by sliding the data down into a free previous
+ * block. Returns the data pointer, or NULL if the block has to move
+ * elsewhere. Called with heap->lock held.
+ */
+static void *block_resize(heap_t *heap, s_block_ptr b, size_t s) {
+    size_t old_size = size_of(b);
+    s_block_ptr next = next_block(b);
+    s_block_ptr prev = prev_block(b);
+    size_t with_next = old_size + (is_free(next) ? BLOCK_SIZE + size_of(next) : 0);
+
+    if (old_size >= s) {
+        /* Shrinking, only the split below is needed. */
+    } else if (with_next >= s) {
+        bin_remove(heap, next);
+        resize_block(b, with_next);
+    } else if (grow_at_top(heap, b, s)) {
+        /* Grown in place. */
+    } else if (prev && is_free(prev) && size_of(prev) + BLOCK_SIZE + with_next >= s) {
+        size_t merged = size_of(prev) + BLOCK_SIZE + with_next;
+        bin_remove(heap, prev);
+        if (is_free(next))
+            bin_remove(heap, next);
+        /* The regions overlap whenever the data is larger than prev. */
+        memmove(prev->data, b->data, old_size);
+        resize_block(prev, merged);
+        b = prev;
     } else {
-        b = extend_heap(NULL, s);
-        if (!b)
-            return NULL;
-        base = b;
+        return NULL;
     }
+
+    if (size_of(b) - s >= MIN_SPLIT)
+        split_block(heap, b, s);
+    __atomic_fetch_add(&total_allocated_memory, size_of(b) - old_size, __ATOMIC_RELAXED);
+    count_live(size_of(b) - old_size, 0);
     return b->data;
 }
 
-void* mm_realloc(void* ptr, size_t size) {
-    size_t s;
-    s_block_ptr b, newb;
+/*
+ * Has the kernel grow B's mapping, moving page table entries instead of
+ * data. A buffer grown step by step gets half again as much room each time,
+ * which only costs address space until it is touched.
+ */
+static void *mmap_chunk_resize(s_block_ptr b, size_t size) {
+    size_t offset = b->prev_size;
+    char *map = (char *)b - offset;
+    size_t old_length = offset + BLOCK_SIZE + size_of(b);
+    if (size < size_of(b) + size_of(b) / 2 && size_of(b) < MAX_REQUEST / 2)
+        size = size_of(b) + size_of(b) / 2;
+    size_t length = (offset + BLOCK_SIZE + size + page_size - 1) & ~(page_size - 1);
+    char *new_map = mremap(map, old_length, length, MREMAP_MAYMOVE);
+    if (new_map == MAP_FAILED)
+        return NULL;
+    b = (s_block_ptr)(new_map + offset);
+    __atomic_add_fetch(&mmapped_bytes, length - old_length, __ATOMIC_RELAXED);
+    count_live(length - old_length, 0);
+    set_size(b, length - offset - BLOCK_SIZE);
+    return b->data;
+}
+
+static void *realloc_untagged(void *ptr, size_t size) {
+    size_t s, old_size;
+    s_block_ptr b;
+    heap_t *heap;
     void *newp;
     if (!ptr)
         return mm_malloc(size);
-    if (valid_addr(ptr)) {
-        s = size;
-        b = get_block(ptr);
-        if (b->size >= s) {
-            if (b->size - s >= (BLOCK_SIZE + 4))
-                split_block(b, s);
-        } else {
-            if (b->next && b->next->free && (b->size + BLOCK_SIZE + b->next->size) >= s) {
-                fusion(b);
-                if (b->size - s >= (BLOCK_SIZE + 4))
-                    split_block(b, s);
-            } else {
-                newp = mm_malloc(s);
-                if (!newp)
-                    return NULL;
-                newb = get_block(newp);
-                memcpy(newb->ptr, b->ptr, b->size);
-                mm_free(ptr);
-                return newp;
-            }
+    if (size > MAX_REQUEST)
+        return NULL;
+    if (region_contains(&slab_region, ptr)) {
+        old_size = slab_of(ptr)->object_size;
+        if (size <= old_size)
+            return ptr;
+    } else if ((heap = heap_of(ptr))) {
+        pthread_mutex_lock(&heap->lock);
+        if (!valid_addr(heap, ptr)) {
+            pthread_mutex_unlock(&heap->lock);
+            return NULL;
         }
-        return ptr;
+        s = request_size(size);
+        b = get_block(ptr);
+        old_size = size_of(b);
+        newp = block_resize(heap, b, s);
+        pthread_mutex_unlock(&heap->lock);
+        if (newp)
+            return newp;
+    } else if (is_mmapped_chunk(ptr)) {
+        b = get_block(ptr);
+        old_size = size_of(b);
+        if (size <= old_size)
+            return ptr;
+        if ((newp = mmap_chunk_resize(b, size)))
+            return newp;
+    } else {
+        return NULL;
     }
-    return NULL;
+
+    /* The block is ours, so it cannot change while we copy out of it. */
+    newp = mm_malloc(size);
+    if (!newp)
+        return NULL;
+    memcpy(newp, ptr, old_size);
+    mm_free(ptr);
+    return newp;
+}
+
+void* mm_realloc(void* ptr, size_t size) {
+    if (!ptr || !__atomic_load_n(&tags_used, __ATOMIC_RELAXED))
+        return realloc_untagged(ptr, size);
+
+    /* The tag moves with the data, or stays put if the call fails. */
+    pthread_mutex_lock(&tag_lock);
+    const char *tag = tag_take(ptr);
+    pthread_mutex_unlock(&tag_lock);
+    void *newp = realloc_untagged(ptr, size);
+    if (tag) {
+        pthread_mutex_lock(&tag_lock);
+        tag_set(newp ? newp : ptr, tag, mm_usable_size(newp ? newp : ptr));
+        pthread_mutex_unlock(&tag_lock);
+    }
+    return newp;
 }
 
 void mm_free(void* ptr) {
-    s_block_ptr b;
-    if (valid_addr(ptr)) {
-        b = get_block(ptr);
-        total_allocated_memory -= b->size + BLOCK_SIZE;
-        b->free = 1;
-        if (b->prev && b->prev->free)
-            b = fusion(b->prev);
-        if (b->next)
-            fusion(b);
-        else {
-            if (b->prev)
-                b->prev->next = NULL;
-            else
-                base = NULL;
-            brk(b);
-        }
+    heap_t *heap;
+    if (!ptr)
+        return;
+    /* Untagged first, the address may be handed out again the moment it is freed. */
+    if (__atomic_load_n(&tags_used, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&tag_lock);
+        tag_take(ptr);
+        pthread_mutex_unlock(&tag_lock);
+    }
+    if (region_contains(&slab_region, ptr)) {
+        tcache_free(ptr);
+    } else if ((heap = heap_of(ptr))) {
+        pthread_mutex_lock(&heap->lock);
+        block_free(heap, ptr);
+        pthread_mutex_unlock(&heap->lock);
+    } else if (is_mmapped_chunk(ptr)) {
+        s_block_ptr b = get_block(ptr);
+        size_t length = b->prev_size + BLOCK_SIZE + size_of(b);
+        __atomic_sub_fetch(&mmapped_blocks, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&mmapped_bytes, length, __ATOMIC_RELAXED);
+        count_live(-(long)size_of(b), -1);
+        munmap((char *)b - b->prev_size, length);
     }
 }
 
+/*
+ * Carves an ALIGNMENT-aligned block out of a larger one, giving the space
+ * in front back to the heap. Called with heap->lock held.
+ */
+static void *block_memalign(heap_t *heap, size_t alignment, size_t size) {
+    char *p = block_malloc(heap, size + alignment + MIN_SPLIT);
+    if (!p)
+        return NULL;
+    s_block_ptr b = get_block(p);
+    size_t counted = size_of(b) + BLOCK_SIZE;
+
+    if ((size_t)p & (alignment - 1)) {
+        /* The front has to be large enough to stand as a free block of its own. */
+        char *aligned = (char *)(((size_t)p + MIN_SPLIT + alignment - 1) & ~(alignment - 1));
+        s_block_ptr nb = get_block(aligned);
+        char *end = b->data + size_of(b);
+        set_size(b, (char *)nb - p);
+        nb->prev_size = size_of(b);
+        nb->size = (end - aligned) | BLOCK_INUSE;
+        next_block(nb)->prev_size = size_of(nb);
+        bin_insert(heap, fusion(heap, b));
+        b = nb;
+    }
+    if (size_of(b) - size >= MIN_SPLIT)
+        split_block(heap, b, size);
+    __atomic_fetch_sub(&total_allocated_memory, counted - (size_of(b) + BLOCK_SIZE), __ATOMIC_RELAXED);
+    count_live(-(long)(counted - (size_of(b) + BLOCK_SIZE)), 0);
+    return b->data;
+}
+
+void *mm_memalign(size_t alignment, size_t size) {
+    void *p;
+    if (alignment <= ALIGNMENT)
+        return mm_malloc(size);
+    if (size > MAX_REQUEST || alignment > MAX_REQUEST)
+        return NULL;
+
+    pthread_once(&init_once, init_allocator);
+    size = request_size(size);
+    if (size + alignment >= MMAP_THRESHOLD)
+        return mmap_chunk_alloc(size, alignment);
+
+    heap_t *heap = get_thread_arena()->heap;
+    pthread_mutex_lock(&heap->lock);
+    p = block_memalign(heap, alignment, size);
+    pthread_mutex_unlock(&heap->lock);
+    return p;
+}
+
+size_t mm_usable_size(void *ptr) {
+    if (!ptr)
+        return 0;
+    if (region_contains(&slab_region, ptr))
+        return slab_of(ptr)->object_size;
+    if (heap_of(ptr) || is_mmapped_chunk(ptr))
+        return size_of(get_block(ptr));
+    return 0;
+}
@@ -9,40 +9,103 @@
 #ifndef _malloc_H_
 #define _malloc_H_
 
- /* Define the block size since the sizeof will be wrong */
-#define BLOCK_SIZE 40
+/* A multiple of 16, so block data stays as aligned as the block. */
+#define BLOCK_SIZE 16
+
+/* Flags kept in the low bits of s_block.size, which is a multiple of 16. */
+#define BLOCK_FREE 1
+#define BLOCK_MMAPPED 2     /* The block has a mapping of its own. */
+#define BLOCK_INUSE 4
+#define BLOCK_FLAGS 15
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h> 
 
 typedef struct s_block *s_block_ptr;
+typedef struct heap heap_t;
 
 struct s_block {
-    size_t size;
-    struct s_block *next;
-    struct s_block *prev;
-    int free;
-    void *ptr;
-    /* A pointer to the allocated block */
+    size_t prev_size;   /* Boundary tag: size of the block just below this one. */
+    size_t size;        /* Size of data, with the BLOCK_ flags in the low bits. */
+    /* A pointer to the allocated block, holding the free bin links while free */
     char data [0];
  };
 
 void* mm_malloc(size_t size);
 void* mm_realloc(void* ptr, size_t size);
 void mm_free(void* ptr);
+/* ALIGNMENT must be a power of two. */
+void* mm_memalign(size_t alignment, size_t size);
+/* Bytes that can be used at PTR, at least what was asked for. */
+size_t mm_usable_size(void* ptr);
+
+/* Size classes served from slabs, see class_sizes in mm_alloc.c. */
+#define MM_NUM_CLASSES 20
+
+typedef struct mm_stats {
+    size_t live_bytes;          /* Usable bytes of all live allocations. */
+    size_t peak_live_bytes;
+    size_t live_objects;
+    size_t memory_limit;        /* Cap on the main heap, MM_MEMORY_LIMIT or free RAM. */
+
+    /* Live slab objects per size class. */
+    size_t class_size[MM_NUM_CLASSES];
+    size_t class_objects[MM_NUM_CLASSES];
+    size_t slab_bytes;          /* Address space carved into slabs. */
+
+    size_t mmapped_blocks;      /* Blocks with a mapping of their own. */
+    size_t mmapped_bytes;
+
+    /* Block heaps, summed over all heaps. */
+    size_t heap_blocks;         /* Live blocks. */
+    size_t heap_bytes;          /* Obtained from the system for block heaps. */
+    size_t free_bytes;          /* Held in free blocks. */
+    size_t free_blocks;
+    size_t largest_free;
+    double fragmentation;       /* 1 - largest_free / free_bytes */
+    unsigned long searches;     /* Free block lookups so far. */
+    unsigned long search_steps; /* Bins and blocks looked at by those lookups. */
+} mm_stats_t;
+
+void mm_stats(mm_stats_t *stats);
+
+/*
+ * Calls FN for every block of the block heaps, live or free, with the heap
+ * locked. FN must not allocate.
+ */
+typedef void (*mm_walk_fn)(void *ptr, size_t size, int in_use, void *arg);
+void mm_walk(mm_walk_fn fn, void *arg);
+
+/*
+ * Allocation-site tags. Allocations made through mm_malloc_tagged remember
+ * TAG, which must be a string that outlives them, until they are freed.
+ * mm_malloc_info lists live tagged bytes per tag, so a growing tag points
+ * at a leak.
+ *
+ *     char *buf = mm_malloc_tagged(size, MM_SITE);
+ */
+#define MM_STRINGIFY_(x) #x
+#define MM_STRINGIFY(x) MM_STRINGIFY_(x)
+#define MM_SITE (__FILE__ ":" MM_STRINGIFY(__LINE__))
+
+void* mm_malloc_tagged(size_t size, const char *tag);
+/* The tag of a live allocation, or NULL. */
+const char *mm_tag_of(void *ptr);
 
-extern s_block_ptr base;
+/* Writes the statistics and the per-tag totals to FP as XML, like malloc_info(3). */
+int mm_malloc_info(FILE *fp);
 
-s_block_ptr find_block(s_block_ptr *last, size_t size);
-void split_block(s_block_ptr b, size_t size);
-s_block_ptr fusion(s_block_ptr b);
+s_block_ptr find_block(heap_t *heap, size_t size);
+void split_block(heap_t *heap, s_block_ptr b, size_t size);
+s_block_ptr fusion(heap_t *heap, s_block_ptr b);
 s_block_ptr get_block(void *p);
-s_block_ptr extend_heap(s_block_ptr last, size_t size);
+s_block_ptr extend_heap(heap_t *heap, size_t size);
 
 
 #ifdef __cplusplus
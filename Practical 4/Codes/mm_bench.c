@@ -0,0 +1,173 @@
+/* Throughput benchmark comparing mm_alloc against the C library malloc. */
+
+#include "mm_alloc.h"
+#include <stdio.h>
+#include <time.h>
+
+#define OPS 2000000
+#define SLOTS 4096
+
+typedef struct {
+    const char *name;
+    void *(*malloc)(size_t);
+    void *(*realloc)(void *, size_t);
+    void (*free)(void *);
+} allocator_t;
+
+static void *slots[SLOTS];
+/* mm_alloc's block heaps as the trace workload left them, before cleanup. */
+static mm_stats_t trace_stats;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Mostly small objects with an occasional page-sized one. */
+static size_t random_size(unsigned int *seed) {
+    int r = rand_r(seed) % 100;
+    if (r < 90)
+        return 8 + rand_r(seed) % 248;
+    if (r < 98)
+        return 256 + rand_r(seed) % 768;
+    return 1024 + rand_r(seed) % 7168;
+}
+
+/* malloc immediately followed by free. */
+static double bench_pairs(allocator_t *a) {
+    unsigned int seed = 1;
+    double start = now();
+    for (int i = 0; i < OPS / 2; i++) {
+        void *p = a->malloc(random_size(&seed));
+        *(char *)p = 1;
+        a->free(p);
+    }
+    return OPS / (now() - start);
+}
+
+/* Random frees and mallocs over a live set of SLOTS objects. */
+static double bench_churn(allocator_t *a) {
+    unsigned int seed = 2;
+    double start = now();
+    for (int i = 0; i < OPS; i++) {
+        int slot = rand_r(&seed) % SLOTS;
+        if (slots[slot]) {
+            a->free(slots[slot]);
+            slots[slot] = NULL;
+        } else {
+            slots[slot] = a->malloc(random_size(&seed));
+            *(char *)slots[slot] = 1;
+        }
+    }
+    double elapsed = now() - start;
+    for (int i = 0; i < SLOTS; i++) {
+        a->free(slots[i]);
+        slots[i] = NULL;
+    }
+    return OPS / elapsed;
+}
+
+/*
+ * Medium blocks shaped like a program's heap: a few hot sizes, a spread of
+ * others, mostly short lifetimes and a long-lived set that builds up in
+ * phases. This is the traffic that lands on the block heaps.
+ */
+static size_t trace_size(unsigned int *seed) {
+    static const size_t hot[] = {1536, 4096, 2200, 12000};
+    if (rand_r(seed) % 2)
+        return hot[rand_r(seed) % 4];
+    return 1100 + rand_r(seed) % 60000;
+}
+
+static double bench_trace(allocator_t *a) {
+    unsigned int seed = 3;
+    double start = now();
+    for (int i = 0; i < OPS / 4; i++) {
+        /* Every 64K ops, drop most of the long-lived set. */
+        if (i % 65536 == 0) {
+            for (int j = 0; j < SLOTS; j++) {
+                if (slots[j] && rand_r(&seed) % 4) {
+                    a->free(slots[j]);
+                    slots[j] = NULL;
+                }
+            }
+        }
+        int slot = rand_r(&seed) % (rand_r(&seed) % 8 ? 256 : SLOTS);
+        if (slots[slot]) {
+            a->free(slots[slot]);
+            slots[slot] = NULL;
+        } else {
+            slots[slot] = a->malloc(trace_size(&seed));
+            *(char *)slots[slot] = 1;
+        }
+    }
+    double elapsed = now() - start;
+    if (a->malloc == mm_malloc)
+        mm_stats(&trace_stats);
+    for (int i = 0; i < SLOTS; i++) {
+        a->free(slots[i]);
+        slots[i] = NULL;
+    }
+    return OPS / 4 / elapsed;
+}
+
+/*
+ * Buffers grown a little at a time up to 1MB, the way a response or a
+ * directory listing is built, with other allocations going on meanwhile.
+ */
+static double bench_grow(allocator_t *a) {
+    unsigned int seed = 4;
+    int ops = 0;
+    double start = now();
+    for (int round = 0; round < 64; round++) {
+        size_t size = 64;
+        char *buf = a->malloc(size);
+        while (size < 1024 * 1024) {
+            size += 256 + rand_r(&seed) % 4096;
+            buf = a->realloc(buf, size);
+            buf[size - 1] = 1;
+            if (rand_r(&seed) % 4 == 0) {
+                int slot = rand_r(&seed) % SLOTS;
+                a->free(slots[slot]);
+                slots[slot] = a->malloc(random_size(&seed));
+            }
+            ops++;
+        }
+        a->free(buf);
+    }
+    double elapsed = now() - start;
+    for (int i = 0; i < SLOTS; i++) {
+        a->free(slots[i]);
+        slots[i] = NULL;
+    }
+    return ops / elapsed;
+}
+
+int main(int argc, char **argv) {
+    allocator_t allocators[] = {
+        {"glibc", malloc, realloc, free},
+        {getenv("MM_DISABLE_SLABS") ? "mm_alloc (no slabs)" : "mm_alloc (slabs)",
+         mm_malloc, mm_realloc, mm_free},
+    };
+
+    printf("%-24s %16s %16s %16s %16s\n", "allocator", "pairs ops/s", "churn ops/s",
+           "trace ops/s", "grow ops/s");
+    for (int i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++) {
+        double pairs = bench_pairs(&allocators[i]);
+        double churn = bench_churn(&allocators[i]);
+        double trace = bench_trace(&allocators[i]);
+        double grow = bench_grow(&allocators[i]);
+        printf("%-24s %16.0f %16.0f %16.0f %16.0f\n", allocators[i].name, pairs, churn,
+               trace, grow);
+    }
+
+    mm_stats_t stats = trace_stats;
+    printf("\nmm_alloc block heaps after trace: %zu KB mapped, %zu KB free in %zu blocks, "
+           "largest %zu KB, fragmentation %.2f\n",
+           stats.heap_bytes / 1024, stats.free_bytes / 1024, stats.free_blocks,
+           stats.largest_free / 1024, stats.fragmentation);
+    printf("%lu searches, %.2f steps per search\n", stats.searches,
+           stats.searches ? (double)stats.search_steps / stats.searches : 0.0);
+    return 0;
+}
@@ -0,0 +1,253 @@
+/*
+ * Replays an allocation trace recorded by libmmtrace.so against mm_alloc,
+ * or against the C library malloc with -c, and reports throughput, peak RSS
+ * and utilization (peak bytes requested over peak RSS growth).
+ *
+ *     mm_replay [-c] trace
+ */
+
+#include "mm_alloc.h"
+#include "mm_trace.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+
+typedef struct {
+    const char *name;
+    void *(*malloc)(size_t);
+    void *(*realloc)(void *, size_t);
+    void (*free)(void *);
+} allocator_t;
+
+/* Maps a traced address to the object standing in for it. */
+typedef struct {
+    uintptr_t key;
+    void *ptr;
+    size_t size;
+} slot_t;
+
+static slot_t *table;
+static size_t table_mask;
+
+typedef struct {
+    const unsigned char *pos;
+    const unsigned char *end;
+    uintptr_t last_ptr;
+} reader_t;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Sampled every RSS_INTERVAL ops, getrusage()'s peak also counts trace loading. */
+#define RSS_INTERVAL 1024
+
+static size_t resident_kb(int statm_fd) {
+    char buf[128];
+    long size, pages;
+    ssize_t n = pread(statm_fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0)
+        return 0;
+    buf[n] = '\0';
+    if (sscanf(buf, "%ld %ld", &size, &pages) != 2)
+        return 0;
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static int get_varint(reader_t *r, uint64_t *v) {
+    int shift = 0;
+    *v = 0;
+    while (r->pos < r->end && shift < 64) {
+        unsigned char byte = *r->pos++;
+        *v |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return 1;
+        shift += 7;
+    }
+    return 0;
+}
+
+static int get_ptr(reader_t *r, uintptr_t *p) {
+    uint64_t v;
+    if (!get_varint(r, &v))
+        return 0;
+    *p = r->last_ptr += trace_unzigzag(v);
+    return 1;
+}
+
+/* Reads one record. Unused fields are left alone. Returns the opcode or 0. */
+static int next_record(reader_t *r, uintptr_t *ptr, uint64_t *size, uintptr_t *result) {
+    if (r->pos >= r->end)
+        return 0;
+    int op = *r->pos++;
+    switch (op) {
+    case TRACE_MALLOC:
+    case TRACE_CALLOC:
+        return get_varint(r, size) && get_ptr(r, result) ? op : 0;
+    case TRACE_REALLOC:
+        return get_ptr(r, ptr) && get_varint(r, size) && get_ptr(r, result) ? op : 0;
+    case TRACE_FREE:
+        return get_ptr(r, ptr) ? op : 0;
+    }
+    return 0;
+}
+
+static size_t hash(uintptr_t key) {
+    return ((key >> 4) * 0x9E3779B97F4A7C15ULL >> 20) & table_mask;
+}
+
+static slot_t *table_find(uintptr_t key) {
+    for (size_t i = hash(key);; i = (i + 1) & table_mask) {
+        if (table[i].key == key || !table[i].key)
+            return &table[i];
+    }
+}
+
+/* Linear probing, so later entries of the cluster shift back into the hole. */
+static void table_remove(slot_t *slot) {
+    size_t hole = slot - table;
+    for (size_t i = (hole + 1) & table_mask; table[i].key; i = (i + 1) & table_mask) {
+        size_t home = hash(table[i].key);
+        if (((i - home) & table_mask) >= ((i - hole) & table_mask)) {
+            table[hole] = table[i];
+            hole = i;
+        }
+    }
+    table[hole].key = 0;
+}
+
+static void fill(void *p, size_t size) {
+    /* Touch every page, as the traced program presumably did. */
+    for (size_t i = 0; i < size; i += 4096)
+        ((char *)p)[i] = 1;
+}
+
+int main(int argc, char **argv) {
+    allocator_t allocator = {"mm_alloc", mm_malloc, mm_realloc, mm_free};
+    int argi = 1;
+    if (argi < argc && strcmp(argv[argi], "-c") == 0) {
+        allocator = (allocator_t){"glibc", malloc, realloc, free};
+        argi++;
+    }
+    if (argi != argc - 1) {
+        fprintf(stderr, "usage: %s [-c] trace\n", argv[0]);
+        return 2;
+    }
+
+    FILE *f = fopen(argv[argi], "rb");
+    if (!f) {
+        perror(argv[argi]);
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    long length = ftell(f);
+    rewind(f);
+    unsigned char *trace = malloc(length > 0 ? length : 1);
+    if (!trace || fread(trace, 1, length, f) != (size_t)length ||
+        length < TRACE_MAGIC_SIZE || memcmp(trace, TRACE_MAGIC, TRACE_MAGIC_SIZE) != 0) {
+        fprintf(stderr, "%s: not an allocation trace\n", argv[argi]);
+        return 1;
+    }
+    fclose(f);
+
+    /* Size the table for the worst case of every allocation being live at once. */
+    reader_t r = {trace + TRACE_MAGIC_SIZE, trace + length, 0};
+    uintptr_t ptr, result;
+    uint64_t size;
+    size_t allocs = 0, ops = 0;
+    int op;
+    while ((op = next_record(&r, &ptr, &size, &result))) {
+        ops++;
+        if (op != TRACE_FREE)
+            allocs++;
+    }
+    size_t capacity = 1024;
+    while (capacity < 2 * allocs)
+        capacity *= 2;
+    table = calloc(capacity, sizeof(slot_t));
+    table_mask = capacity - 1;
+
+    int statm_fd = open("/proc/self/statm", O_RDONLY);
+    size_t base_kb = resident_kb(statm_fd), peak_kb = base_kb, rss;
+    size_t live = 0, peak_live = 0, unknown = 0;
+    r = (reader_t){trace + TRACE_MAGIC_SIZE, trace + length, 0};
+    double start = now();
+    for (size_t n = 0; (op = next_record(&r, &ptr, &size, &result)); n++) {
+        slot_t *slot;
+        if (n % RSS_INTERVAL == 0 && (rss = resident_kb(statm_fd)) > peak_kb)
+            peak_kb = rss;
+        if (op == TRACE_FREE || op == TRACE_REALLOC) {
+            slot = table_find(ptr);
+            if (!slot->key) {
+                /* Allocated before tracing began, or not by malloc at all. */
+                unknown++;
+                if (op == TRACE_FREE || result == 0)
+                    continue;
+                op = TRACE_MALLOC;
+            }
+        }
+
+        if (op == TRACE_FREE) {
+            allocator.free(slot->ptr);
+            live -= slot->size;
+            table_remove(slot);
+            continue;
+        }
+
+        void *p;
+        if (op == TRACE_REALLOC) {
+            if (result == 0 && size == 0) {
+                allocator.free(slot->ptr);
+                live -= slot->size;
+                table_remove(slot);
+                continue;
+            }
+            p = allocator.realloc(slot->ptr, size);
+            live -= slot->size;
+            table_remove(slot);
+        } else {
+            p = allocator.malloc(size);
+            if (p && op == TRACE_CALLOC)
+                memset(p, 0, size);
+        }
+        if (!p) {
+            fprintf(stderr, "%s: allocation of %lu bytes failed\n", allocator.name,
+                    (unsigned long)size);
+            return 1;
+        }
+        fill(p, size);
+
+        slot = table_find(result);
+        if (slot->key)
+            live -= slot->size;
+        slot->key = result;
+        slot->ptr = p;
+        slot->size = size;
+        live += size;
+        if (live > peak_live)
+            peak_live = live;
+    }
+    double elapsed = now() - start;
+
+    if ((rss = resident_kb(statm_fd)) > peak_kb)
+        peak_kb = rss;
+    size_t rss_kb = peak_kb - base_kb;
+    printf("%s: %zu ops in %.3f s, %.0f ops/s\n", allocator.name, ops, elapsed, ops / elapsed);
+    printf("  peak requested %zu KB, peak RSS growth %zu KB, utilization %.2f\n",
+           peak_live / 1024, rss_kb, rss_kb ? (double)peak_live / 1024 / rss_kb : 0.0);
+    if (unknown)
+        printf("  %zu frees or reallocs of untraced pointers\n", unknown);
+    if (allocator.malloc == mm_malloc) {
+        mm_stats_t stats;
+        mm_stats(&stats);
+        printf("  live %zu KB in %zu objects at the end, allocator peak %zu KB\n",
+               stats.live_bytes / 1024, stats.live_objects, stats.peak_live_bytes / 1024);
+        printf("  block heaps: %zu KB, fragmentation %.2f, %.2f steps per search\n",
+               stats.heap_bytes / 1024, stats.fragmentation,
+               stats.searches ? (double)stats.search_steps / stats.searches : 0.0);
+    }
+    return 0;
+}
@@ -0,0 +1,99 @@
+/*
+ * Puts mm_alloc behind the standard allocation functions, so that unmodified
+ * programs can run on it:
+ *
+ *     LD_PRELOAD=./libmm.so ./httpserver --files files/ --port 8000
+ */
+
+#include "mm_alloc.h"
+#include <errno.h>
+#include <stdint.h>
+
+/* A valid alignment for posix_memalign(). */
+static int is_alignment(size_t alignment) {
+    return alignment >= sizeof(void *) && (alignment & (alignment - 1)) == 0;
+}
+
+void *malloc(size_t size) {
+    void *p = mm_malloc(size);
+    if (!p)
+        errno = ENOMEM;
+    return p;
+}
+
+void free(void *ptr) {
+    mm_free(ptr);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    if (size && nmemb > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    void *p = malloc(nmemb * size);
+    if (p)
+        memset(p, 0, nmemb * size);
+    return p;
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (ptr && size == 0) {
+        mm_free(ptr);
+        return NULL;
+    }
+    void *p = mm_realloc(ptr, size);
+    if (!p)
+        errno = ENOMEM;
+    return p;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (!is_alignment(alignment))
+        return EINVAL;
+    void *p = mm_memalign(alignment, size);
+    if (!p)
+        return ENOMEM;
+    *memptr = p;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1))) {
+        errno = EINVAL;
+        return NULL;
+    }
+    void *p = mm_memalign(alignment, size);
+    if (!p)
+        errno = ENOMEM;
+    return p;
+}
+
+void *memalign(size_t alignment, size_t size) {
+    return aligned_alloc(alignment, size);
+}
+
+void *valloc(size_t size) {
+    return aligned_alloc(sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size) {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    if (size > SIZE_MAX / 2) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return aligned_alloc(page_size, (size + page_size - 1) & ~(page_size - 1));
+}
+
+size_t malloc_usable_size(void *ptr) {
+    return mm_usable_size(ptr);
+}
+
+/* No options are defined, as in the C library. */
+int malloc_info(int options, FILE *fp) {
+    if (options != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return mm_malloc_info(fp);
+}
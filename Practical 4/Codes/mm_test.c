@@ -1,7 +1,170 @@
 /* A simple test harness for memory alloction. */
 
 #include "mm_alloc.h"
+#include <pthread.h>
 #include <stdio.h>
+#include <time.h>
+
+#define STRESS_OPS 200000
+#define STRESS_SLOTS 512
+#define MAILBOX_SIZE 1024
+#define FREE_THREADS 200
+#define FREE_OBJECTS 600
+
+/*
+ * Objects handed from one thread to another, so that frees regularly land
+ * on a different thread (and arena) than the one that allocated.
+ */
+struct mailbox {
+	pthread_mutex_t lock;
+	void *items[MAILBOX_SIZE];
+	size_t sizes[MAILBOX_SIZE];
+	int count;
+} mailbox = {PTHREAD_MUTEX_INITIALIZER};
+
+int stress_errors;
+
+size_t stress_size(unsigned int *seed)
+{
+	if (rand_r(seed) % 16 == 0)
+		return 1024 + rand_r(seed) % 4096;
+	return 1 + rand_r(seed) % 512;
+}
+
+/* Objects are filled with a byte derived from their size and checked before free. */
+void fill(void *p, size_t size)
+{
+	memset(p, (int)(size & 0xff), size);
+}
+
+void check_and_free(void *p, size_t size)
+{
+	unsigned char *bytes = p;
+	for (size_t i = 0; i < size; i++) {
+		if (bytes[i] != (size & 0xff)) {
+			__atomic_fetch_add(&stress_errors, 1, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+	mm_free(p);
+}
+
+void *stress_thread(void *arg)
+{
+	unsigned int seed = (unsigned int)(size_t)arg;
+	void *slots[STRESS_SLOTS] = {NULL};
+	size_t sizes[STRESS_SLOTS];
+
+	for (int i = 0; i < STRESS_OPS; i++) {
+		int slot = rand_r(&seed) % STRESS_SLOTS;
+		if (!slots[slot]) {
+			sizes[slot] = stress_size(&seed);
+			slots[slot] = mm_malloc(sizes[slot]);
+			if (!slots[slot]) {
+				__atomic_fetch_add(&stress_errors, 1, __ATOMIC_RELAXED);
+				continue;
+			}
+			fill(slots[slot], sizes[slot]);
+		} else if (rand_r(&seed) % 4 == 0) {
+			size_t size = stress_size(&seed);
+			void *p = mm_realloc(slots[slot], size);
+			if (p) {
+				fill(p, size);
+				slots[slot] = p;
+				sizes[slot] = size;
+			}
+		} else {
+			/* Trade the object with another thread half of the time. */
+			void *p = slots[slot];
+			size_t size = sizes[slot];
+			slots[slot] = NULL;
+			if (rand_r(&seed) % 2) {
+				pthread_mutex_lock(&mailbox.lock);
+				if (mailbox.count < MAILBOX_SIZE) {
+					mailbox.items[mailbox.count] = p;
+					mailbox.sizes[mailbox.count++] = size;
+					p = NULL;
+				} else {
+					void *q = mailbox.items[0];
+					size_t q_size = mailbox.sizes[0];
+					mailbox.items[0] = p;
+					mailbox.sizes[0] = size;
+					p = q;
+					size = q_size;
+				}
+				pthread_mutex_unlock(&mailbox.lock);
+			}
+			if (p)
+				check_and_free(p, size);
+		}
+	}
+
+	for (int i = 0; i < STRESS_SLOTS; i++) {
+		if (slots[i])
+			check_and_free(slots[i], sizes[i]);
+	}
+	return NULL;
+}
+
+double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Runs the stress workload on NTHREADS threads and returns ops/sec. */
+double stress_test(int nthreads)
+{
+	pthread_t threads[nthreads];
+	double start = now();
+
+	for (int i = 0; i < nthreads; i++)
+		pthread_create(&threads[i], NULL, stress_thread, (void *)(size_t)(i + 1));
+	for (int i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	while (mailbox.count > 0) {
+		mailbox.count--;
+		check_and_free(mailbox.items[mailbox.count], mailbox.sizes[mailbox.count]);
+	}
+	return (double)nthreads * STRESS_OPS / (now() - start);
+}
+
+void *free_thread(void *arg)
+{
+	void **objects = arg;
+	for (int i = 0; i < FREE_OBJECTS; i++)
+		check_and_free(objects[i], 64);
+	return NULL;
+}
+
+/*
+ * Objects allocated here are freed by threads that never allocate, which
+ * must still give back what they cached when they exit. Returns the number
+ * of objects left behind.
+ */
+long free_only_test()
+{
+	static void *objects[FREE_THREADS][FREE_OBJECTS];
+	pthread_t threads[FREE_THREADS];
+	mm_stats_t before, after;
+
+	for (int t = 0; t < FREE_THREADS; t++) {
+		for (int i = 0; i < FREE_OBJECTS; i++) {
+			objects[t][i] = mm_malloc(64);
+			fill(objects[t][i], 64);
+		}
+	}
+	mm_stats(&before);
+	for (int t = 0; t < FREE_THREADS; t++)
+		pthread_create(&threads[t], NULL, free_thread, objects[t]);
+	for (int t = 0; t < FREE_THREADS; t++)
+		pthread_join(threads[t], NULL);
+	mm_stats(&after);
+	return (long)after.live_objects - ((long)before.live_objects - FREE_THREADS * FREE_OBJECTS);
+}
+
 int main(int argc, char **argv)
 {
 	int size = 100;
@@ -11,4 +174,19 @@ int main(int argc, char **argv)
 	  printf("%p\n", memory);
 	}
 
-}
\ No newline at end of file
+	printf("\nthreads      ops/sec\n");
+	for (int n = 1; n <= 8; n *= 2)
+		printf("%7d %12.0f\n", n, stress_test(n));
+
+	long stranded = free_only_test();
+	if (stranded) {
+		printf("%ld objects stranded by threads that only free\n", stranded);
+		return 1;
+	}
+
+	if (stress_errors) {
+		printf("%d corrupted or failed allocations\n", stress_errors);
+		return 1;
+	}
+	return 0;
+}
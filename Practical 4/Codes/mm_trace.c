@@ -0,0 +1,272 @@
+/*
+ * An LD_PRELOAD library that records every malloc, calloc, realloc and free
+ * of a program into a binary trace (see mm_trace.h):
+ *
+ *     MM_TRACE_FILE=server.trace LD_PRELOAD=./libmmtrace.so ./httpserver ...
+ *
+ * Each process writes to $MM_TRACE_FILE.<pid> (mm.trace.<pid> by default),
+ * so children of a shell or a forking server get traces of their own.
+ * Records go straight into a shared mapping of the file, so a server that
+ * is killed rather than exiting still leaves a usable trace behind.
+ */
+
+#define _GNU_SOURCE
+#include "mm_trace.h"
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define TRACE_WINDOW_SIZE (1024 * 1024)
+/* Room for the largest record: an opcode and three 10-byte varints. */
+#define TRACE_RECORD_MAX 32
+#define BOOTSTRAP_SIZE 8192
+
+static void *(*real_malloc)(size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static void (*real_free)(void *);
+static int (*real_posix_memalign)(void **, size_t, size_t);
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static int trace_fd = -1;
+static int trace_failed;
+static unsigned char *window;   /* Mapping of the file from window_offset on. */
+static off_t window_offset;
+static size_t used;
+static uintptr_t last_ptr;
+
+/* dlsym() allocates before the real functions are known, serve it from here. */
+static char bootstrap[BOOTSTRAP_SIZE] __attribute__((aligned(16)));
+static size_t bootstrap_used;
+static int resolving;
+
+static int is_bootstrap(void *p) {
+    return (char *)p >= bootstrap && (char *)p < bootstrap + BOOTSTRAP_SIZE;
+}
+
+static void *bootstrap_alloc(size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    if (bootstrap_used + size > BOOTSTRAP_SIZE)
+        return NULL;
+    void *p = bootstrap + bootstrap_used;
+    bootstrap_used += size;
+    return p;
+}
+
+static int map_window(void) {
+    if (ftruncate(trace_fd, window_offset + TRACE_WINDOW_SIZE) != 0)
+        return 0;
+    window = mmap(NULL, TRACE_WINDOW_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  trace_fd, window_offset);
+    if (window == MAP_FAILED) {
+        window = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+/* Slides the window forward, it has to start on a page boundary. */
+static int advance_window(void) {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t skip = used & ~(page_size - 1);
+    munmap(window, TRACE_WINDOW_SIZE);
+    window_offset += skip;
+    used -= skip;
+    return map_window();
+}
+
+/* Called with trace_lock held. Returns 0 if records cannot be written. */
+static int trace_open(void) {
+    if (trace_fd >= 0)
+        return 1;
+    if (trace_failed)
+        return 0;
+
+    char path[4096];
+    const char *prefix = getenv("MM_TRACE_FILE");
+    snprintf(path, sizeof(path), "%s.%d", prefix ? prefix : "mm.trace", (int)getpid());
+    trace_fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    window_offset = 0;
+    if (trace_fd < 0 || !map_window()) {
+        trace_failed = 1;
+        return 0;
+    }
+    memcpy(window, TRACE_MAGIC, TRACE_MAGIC_SIZE);
+    used = TRACE_MAGIC_SIZE;
+    last_ptr = 0;
+    return 1;
+}
+
+static void put_varint(uint64_t v) {
+    while (v >= 0x80) {
+        window[used++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    window[used++] = (unsigned char)v;
+}
+
+static void put_ptr(void *p) {
+    put_varint(trace_zigzag((int64_t)((uintptr_t)p - last_ptr)));
+    last_ptr = (uintptr_t)p;
+}
+
+/* Starts a record. Called with trace_lock held. */
+static int put_op(int op) {
+    if (!trace_open())
+        return 0;
+    if (used + TRACE_RECORD_MAX > TRACE_WINDOW_SIZE && !advance_window()) {
+        trace_failed = 1;
+        return 0;
+    }
+    window[used++] = (unsigned char)op;
+    return 1;
+}
+
+static void record_alloc(int op, size_t size, void *result) {
+    pthread_mutex_lock(&trace_lock);
+    if (put_op(op)) {
+        put_varint(size);
+        put_ptr(result);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void atfork_prepare(void) {
+    pthread_mutex_lock(&trace_lock);
+}
+
+static void atfork_parent(void) {
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/* The child starts a trace of its own, the parent's file is left alone. */
+static void atfork_child(void) {
+    if (window)
+        munmap(window, TRACE_WINDOW_SIZE);
+    if (trace_fd >= 0)
+        close(trace_fd);
+    window = NULL;
+    trace_fd = -1;
+    trace_failed = 0;
+    pthread_mutex_init(&trace_lock, NULL);
+}
+
+static void resolve(void) {
+    resolving = 1;
+    real_malloc = dlsym(RTLD_NEXT, "malloc");
+    real_calloc = dlsym(RTLD_NEXT, "calloc");
+    real_realloc = dlsym(RTLD_NEXT, "realloc");
+    real_free = dlsym(RTLD_NEXT, "free");
+    real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+    resolving = 0;
+    pthread_atfork(atfork_prepare, atfork_parent, atfork_child);
+}
+
+__attribute__((constructor)) static void trace_init(void) {
+    if (!real_malloc)
+        resolve();
+}
+
+/* Cuts the unused tail of the window off the file. Later calls go unrecorded. */
+__attribute__((destructor)) static void trace_fini(void) {
+    pthread_mutex_lock(&trace_lock);
+    if (window) {
+        munmap(window, TRACE_WINDOW_SIZE);
+        if (ftruncate(trace_fd, window_offset + used) != 0)
+            used = 0;
+        close(trace_fd);
+    }
+    window = NULL;
+    trace_fd = -1;
+    trace_failed = 1;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void *malloc(size_t size) {
+    if (!real_malloc) {
+        if (resolving)
+            return bootstrap_alloc(size);
+        resolve();
+    }
+    void *p = real_malloc(size);
+    if (p)
+        record_alloc(TRACE_MALLOC, size, p);
+    return p;
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    if (!real_calloc) {
+        if (resolving)
+            return bootstrap_alloc(nmemb * size);  /* Static memory is already zeroed. */
+        resolve();
+    }
+    void *p = real_calloc(nmemb, size);
+    if (p)
+        record_alloc(TRACE_CALLOC, nmemb * size, p);
+    return p;
+}
+
+void free(void *ptr) {
+    if (!ptr || is_bootstrap(ptr))
+        return;
+    if (!real_free)
+        resolve();
+
+    /* Recorded first, so nobody can be handed the address before we let go. */
+    pthread_mutex_lock(&trace_lock);
+    if (put_op(TRACE_FREE))
+        put_ptr(ptr);
+    pthread_mutex_unlock(&trace_lock);
+    real_free(ptr);
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (!real_realloc)
+        resolve();
+    if (!ptr)
+        return malloc(size);
+    if (is_bootstrap(ptr)) {
+        void *p = malloc(size);
+        size_t available = bootstrap + BOOTSTRAP_SIZE - (char *)ptr;
+        if (p)
+            memcpy(p, ptr, size < available ? size : available);
+        return p;
+    }
+
+    /* Held across the call, the old block may be handed out as soon as it returns. */
+    pthread_mutex_lock(&trace_lock);
+    void *p = real_realloc(ptr, size);
+    if ((p || size == 0) && put_op(TRACE_REALLOC)) {
+        put_ptr(ptr);
+        put_varint(size);
+        put_ptr(p);
+    }
+    pthread_mutex_unlock(&trace_lock);
+    return p;
+}
+
+/* Aligned allocations are replayed as plain ones. */
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (!real_posix_memalign)
+        resolve();
+    int err = real_posix_memalign(memptr, alignment, size);
+    if (err == 0)
+        record_alloc(TRACE_MALLOC, size, *memptr);
+    return err;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    void *p;
+    if (alignment < sizeof(void *))
+        alignment = sizeof(void *);
+    return posix_memalign(&p, alignment, size) == 0 ? p : NULL;
+}
+
+void *memalign(size_t alignment, size_t size) {
+    return aligned_alloc(alignment, size);
+}
@@ -0,0 +1,45 @@
+/*
+ * mm_trace.h
+ *
+ * Format of the allocation traces written by libmmtrace.so and read back
+ * by mm_replay.
+ *
+ * A trace is TRACE_MAGIC followed by records. Each record is an opcode
+ * byte followed by unsigned LEB128 varints:
+ *
+ *     TRACE_MALLOC   size, result
+ *     TRACE_CALLOC   size, result        (size is nmemb * size)
+ *     TRACE_REALLOC  ptr, size, result   (result is 0 when it freed ptr)
+ *     TRACE_FREE     ptr
+ *
+ * Pointers are stored zigzag-encoded as the difference from the previous
+ * pointer in the trace, so most of them take two or three bytes. A trace
+ * whose process was killed ends in zero bytes, which read as the end.
+ */
+
+#pragma once
+
+#ifndef _mm_trace_H_
+#define _mm_trace_H_
+
+#include <stdint.h>
+
+#define TRACE_MAGIC "MMTRACE1"
+#define TRACE_MAGIC_SIZE 8
+
+enum {
+    TRACE_MALLOC = 1,
+    TRACE_CALLOC,
+    TRACE_REALLOC,
+    TRACE_FREE,
+};
+
+static inline uint64_t trace_zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t trace_unzigzag(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+#endif